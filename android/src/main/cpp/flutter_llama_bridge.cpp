@@ -1,37 +1,85 @@
 /*
  * Flutter Llama - JNI Bridge for Android
  * 
- * This file provides JNI bindings between Kotlin and llama.cpp
- * Updated for latest llama.cpp API
+ * This file provides JNI bindings between Kotlin and the shared llama.cpp
+ * engine in src/llama_engine.cpp
  */
 
 #include <jni.h>
 #include <string>
 #include <vector>
-#include <mutex>
 #include <android/log.h>
 
 #define LOG_TAG "FlutterLlamaBridge"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
-// Include llama.cpp headers
-#include "llama.h"
+#include "llama_engine.h"
 
-// Global state
-static llama_model* g_model = nullptr;
-static llama_context* g_context = nullptr;
-static const llama_vocab* g_vocab = nullptr;
-static llama_sampler* g_sampler = nullptr;
-static std::mutex g_mutex;
-static bool g_should_stop = false;
-static std::vector<std::string> g_stream_tokens;
-static size_t g_stream_pos = 0;
+static std::string jstring_to_string(JNIEnv* env, jstring value) {
+    const char* chars = env->GetStringUTFChars(value, nullptr);
+    std::string result(chars);
+    env->ReleaseStringUTFChars(value, chars);
+    return result;
+}
+
+static std::vector<std::string> jstring_array_to_vector(JNIEnv* env, jobjectArray values) {
+    std::vector<std::string> result;
+    const jsize n = values ? env->GetArrayLength(values) : 0;
+    for (jsize i = 0; i < n; i++) {
+        jstring value = (jstring)env->GetObjectArrayElement(values, i);
+        result.push_back(jstring_to_string(env, value));
+        env->DeleteLocalRef(value);
+    }
+    return result;
+}
+
+static flutter_llama::GenerationParams make_generation_params(
+    JNIEnv* env,
+    jstring prompt,
+    jfloat temperature,
+    jfloat top_p,
+    jint top_k,
+    jint max_tokens,
+    jfloat repeat_penalty,
+    jstring session_id,
+    jobjectArray stop_sequences
+) {
+    flutter_llama::GenerationParams params;
+    params.prompt = jstring_to_string(env, prompt);
+    params.temperature = temperature;
+    params.top_p = top_p;
+    params.top_k = top_k;
+    params.max_tokens = max_tokens;
+    params.repeat_penalty = repeat_penalty;
+    if (session_id) {
+        params.session_id = jstring_to_string(env, session_id);
+    }
+    params.stop_sequences = jstring_array_to_vector(env, stop_sequences);
+    return params;
+}
+
+static jobject make_generation_result(JNIEnv* env, const std::string& text, int32_t n_generated) {
+    jclass result_class = env->FindClass("net/nativemind/flutter_llama/FlutterLlamaPlugin$GenerationResult");
+    if (!result_class) {
+        LOGE("Failed to find GenerationResult class");
+        return nullptr;
+    }
+    
+    jmethodID constructor = env->GetMethodID(result_class, "<init>", "(Ljava/lang/String;I)V");
+    if (!constructor) {
+        LOGE("Failed to find GenerationResult constructor");
+        return nullptr;
+    }
+    
+    jstring j_result = env->NewStringUTF(text.c_str());
+    return env->NewObject(result_class, constructor, j_result, n_generated);
+}
 
 extern "C" {
 
-// Initialize and load model
-JNIEXPORT jboolean JNICALL
+// Load a model and return its handle (0 on failure)
+JNIEXPORT jint JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeInitModel(
     JNIEnv* env,
     jobject thiz,
@@ -39,81 +87,114 @@ Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeInitModel(
     jint n_threads,
     jint n_gpu_layers,
     jint context_size,
+    jint initial_context_size,
     jint batch_size,
+    jint max_sequences,
+    jint step_budget,
+    jint cache_reuse,
+    jint sink_tokens,
+    jint recent_window,
+    jobjectArray pinned_prefixes,
+    jstring prompt_cache_dir,
+    jint prompt_cache_budget_mb,
+    jint session_swap_mb,
+    jint session_swap_disk_mb,
+    jint idle_timeout_s,
+    jint response_cache_entries,
     jboolean use_gpu,
     jboolean verbose
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    const char* path = env->GetStringUTFChars(model_path, nullptr);
-    
-    LOGI("Initializing model: %s", path);
-    LOGI("Threads: %d, GPU layers: %d, Context: %d", n_threads, n_gpu_layers, context_size);
-    
-    // Free existing model if any
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
-    }
-    if (g_context) {
-        llama_free(g_context);
-        g_context = nullptr;
+    flutter_llama::ModelParams params;
+    params.model_path = jstring_to_string(env, model_path);
+    params.n_threads = n_threads;
+    params.n_gpu_layers = n_gpu_layers;
+    params.context_size = context_size;
+    params.initial_context_size = initial_context_size;
+    params.batch_size = batch_size;
+    params.max_sequences = max_sequences;
+    params.step_budget = step_budget;
+    params.cache_reuse = cache_reuse;
+    params.sink_tokens = sink_tokens;
+    params.recent_window = recent_window;
+    params.pinned_prefixes = jstring_array_to_vector(env, pinned_prefixes);
+    if (prompt_cache_dir) {
+        params.prompt_cache_dir = jstring_to_string(env, prompt_cache_dir);
     }
-    if (g_model) {
-        llama_free_model(g_model);
-        g_model = nullptr;
-    }
-    
-    // Load dynamic backends
-    ggml_backend_load_all();
-    
-    // Set up model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = use_gpu ? n_gpu_layers : 0;
-    
-    // Load model
-    g_model = llama_model_load_from_file(path, model_params);
-    if (!g_model) {
-        LOGE("Failed to load model from: %s", path);
-        env->ReleaseStringUTFChars(model_path, path);
-        return JNI_FALSE;
+    params.prompt_cache_budget_mb = prompt_cache_budget_mb;
+    params.session_swap_mb = session_swap_mb;
+    params.session_swap_disk_mb = session_swap_disk_mb;
+    params.idle_timeout_s = idle_timeout_s;
+    params.response_cache_entries = response_cache_entries;
+    params.use_gpu = use_gpu;
+    params.verbose = verbose;
+    
+    return flutter_llama::load_model(params);
+}
+
+// Create another context over a loaded model's weights; returns its handle (0 on failure)
+JNIEXPORT jint JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeCreateContext(
+    JNIEnv* env,
+    jobject thiz,
+    jint source_handle,
+    jint n_threads,
+    jint context_size,
+    jint initial_context_size,
+    jint batch_size,
+    jint max_sequences,
+    jint step_budget,
+    jint cache_reuse,
+    jint sink_tokens,
+    jint recent_window,
+    jobjectArray pinned_prefixes,
+    jstring prompt_cache_dir,
+    jint prompt_cache_budget_mb,
+    jint session_swap_mb,
+    jint session_swap_disk_mb,
+    jint idle_timeout_s,
+    jint response_cache_entries,
+    jboolean embeddings
+) {
+    flutter_llama::ContextParams params;
+    params.n_threads = n_threads;
+    params.context_size = context_size;
+    params.initial_context_size = initial_context_size;
+    params.batch_size = batch_size;
+    params.max_sequences = max_sequences;
+    params.step_budget = step_budget;
+    params.cache_reuse = cache_reuse;
+    params.sink_tokens = sink_tokens;
+    params.recent_window = recent_window;
+    params.pinned_prefixes = jstring_array_to_vector(env, pinned_prefixes);
+    if (prompt_cache_dir) {
+        params.prompt_cache_dir = jstring_to_string(env, prompt_cache_dir);
     }
-    
-    // Get vocab
-    g_vocab = llama_model_get_vocab(g_model);
-    
-    // Create context
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = context_size;
-    ctx_params.n_batch = batch_size;
-    ctx_params.n_threads = n_threads;
-    ctx_params.n_threads_batch = n_threads;
-    
-    g_context = llama_init_from_model(g_model, ctx_params);
-    if (!g_context) {
-        LOGE("Failed to create context");
-        llama_free_model(g_model);
-        g_model = nullptr;
-        env->ReleaseStringUTFChars(model_path, path);
-        return JNI_FALSE;
+    params.prompt_cache_budget_mb = prompt_cache_budget_mb;
+    params.session_swap_mb = session_swap_mb;
+    params.session_swap_disk_mb = session_swap_disk_mb;
+    params.idle_timeout_s = idle_timeout_s;
+    params.response_cache_entries = response_cache_entries;
+    params.embeddings = embeddings;
+    
+    return flutter_llama::create_context(source_handle, params);
+}
+
+// Embed text with an embedding context; returns null on failure
+JNIEXPORT jfloatArray JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeEmbed(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle,
+    jstring text
+) {
+    std::vector<float> embedding;
+    if (!flutter_llama::embed(handle, jstring_to_string(env, text), embedding)) {
+        return nullptr;
     }
     
-    // Initialize sampler chain
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false;
-    g_sampler = llama_sampler_chain_init(sparams);
-    
-    // Add samplers
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(0.8f));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(0.95f, 1));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
-    
-    LOGI("Model loaded successfully");
-    LOGI("Context size: %d", llama_n_ctx(g_context));
-    
-    env->ReleaseStringUTFChars(model_path, path);
-    return JNI_TRUE;
+    jfloatArray j_embedding = env->NewFloatArray(embedding.size());
+    env->SetFloatArrayRegion(j_embedding, 0, embedding.size(), embedding.data());
+    return j_embedding;
 }
 
 // Generate text
@@ -121,253 +202,245 @@ JNIEXPORT jobject JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGenerate(
     JNIEnv* env,
     jobject thiz,
+    jint handle,
     jstring prompt,
     jfloat temperature,
     jfloat top_p,
     jint top_k,
     jint max_tokens,
-    jfloat repeat_penalty
+    jfloat repeat_penalty,
+    jstring session_id,
+    jobjectArray stop_sequences
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+    flutter_llama::GenerationParams params = make_generation_params(
+        env, prompt, temperature, top_p, top_k, max_tokens, repeat_penalty, session_id, stop_sequences);
     
-    if (!g_model || !g_context || !g_vocab) {
-        LOGE("Model not loaded");
-        return nullptr;
-    }
-    
-    const char* prompt_str = env->GetStringUTFChars(prompt, nullptr);
-    LOGI("Generating with prompt: %.50s...", prompt_str);
-    
-    std::string prompt_text(prompt_str);
-    env->ReleaseStringUTFChars(prompt, prompt_str);
-    
-    // Tokenize prompt
-    const int n_prompt = -llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), NULL, 0, true, true);
-    std::vector<llama_token> prompt_tokens(n_prompt);
-    
-    if (llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), prompt_tokens.data(), prompt_tokens.size(), true, true) < 0) {
-        LOGE("Failed to tokenize prompt");
-        return nullptr;
-    }
-    
-    // Create batch
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    
-    // Decode prompt
-    if (llama_decode(g_context, batch) != 0) {
-        LOGE("Failed to decode prompt");
-        return nullptr;
-    }
-    
-    // Update sampler with new parameters
-    llama_sampler_free(g_sampler);
-    
-    auto sparams = llama_sampler_chain_default_params();
-    g_sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(top_p, 1));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(top_k));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
-    
-    // Generate tokens
     std::string result;
-    int n_generated = 0;
-    int n_pos = prompt_tokens.size();
-    
-    g_should_stop = false;
-    
-    for (int i = 0; i < max_tokens; i++) {
-        if (g_should_stop) {
-            LOGI("Generation stopped by user");
-            break;
-        }
-        
-        // Sample next token
-        llama_token new_token = llama_sampler_sample(g_sampler, g_context, -1);
-        
-        // Check for EOS
-        if (llama_vocab_is_eog(g_vocab, new_token)) {
-            LOGI("EOS token reached");
-            break;
-        }
-        
-        // Convert token to text
-        char token_str[256] = {0};
-        int n = llama_token_to_piece(g_vocab, new_token, token_str, sizeof(token_str) - 1, 0, true);
-        if (n > 0) {
-            token_str[n] = '\0';
-            result.append(token_str);
-        }
-        
-        // Prepare for next iteration
-        batch = llama_batch_get_one(&new_token, 1);
-        n_pos++;
-        
-        if (llama_decode(g_context, batch) != 0) {
-            LOGE("Failed to decode token");
-            break;
-        }
-        
-        n_generated++;
-    }
-    
-    LOGI("Generated %d tokens", n_generated);
-    
-    // Create GenerationResult object
-    jclass result_class = env->FindClass("net/nativemind/flutter_llama/FlutterLlamaPlugin$GenerationResult");
-    if (!result_class) {
-        LOGE("Failed to find GenerationResult class");
+    int32_t n_generated = 0;
+    if (!flutter_llama::generate(handle, params, result, n_generated)) {
         return nullptr;
     }
     
-    jmethodID constructor = env->GetMethodID(result_class, "<init>", "(Ljava/lang/String;I)V");
-    if (!constructor) {
-        LOGE("Failed to find GenerationResult constructor");
+    return make_generation_result(env, result, n_generated);
+}
+
+// Start a natively kept chat history on a model; returns its id (0 on failure)
+JNIEXPORT jint JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeCreateConversation(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle
+) {
+    return flutter_llama::create_conversation(handle);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeAppendMessage(
+    JNIEnv* env,
+    jobject thiz,
+    jint conversation,
+    jstring role,
+    jstring content
+) {
+    return flutter_llama::append_message(conversation, jstring_to_string(env, role), jstring_to_string(env, content));
+}
+
+// Generate the assistant's next message of a conversation
+JNIEXPORT jobject JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGenerateReply(
+    JNIEnv* env,
+    jobject thiz,
+    jint conversation,
+    jfloat temperature,
+    jfloat top_p,
+    jint top_k,
+    jint max_tokens,
+    jfloat repeat_penalty,
+    jobjectArray stop_sequences
+) {
+    flutter_llama::GenerationParams params;
+    params.temperature = temperature;
+    params.top_p = top_p;
+    params.top_k = top_k;
+    params.max_tokens = max_tokens;
+    params.repeat_penalty = repeat_penalty;
+    params.stop_sequences = jstring_array_to_vector(env, stop_sequences);
+
+    std::string result;
+    int32_t n_generated = 0;
+    if (!flutter_llama::generate_reply(conversation, params, result, n_generated)) {
         return nullptr;
     }
-    
-    jstring j_result = env->NewStringUTF(result.c_str());
-    jobject generation_result = env->NewObject(result_class, constructor, j_result, n_generated);
-    
-    return generation_result;
+    return make_generation_result(env, result, n_generated);
+}
+
+JNIEXPORT jint JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeCheckpointConversation(
+    JNIEnv* env,
+    jobject thiz,
+    jint conversation
+) {
+    return flutter_llama::checkpoint_conversation(conversation);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeRollbackConversation(
+    JNIEnv* env,
+    jobject thiz,
+    jint conversation,
+    jint checkpoint
+) {
+    return flutter_llama::rollback_conversation(conversation, checkpoint);
+}
+
+// Copy a conversation up to a checkpoint (-1: all of it); returns its id (0 on failure)
+JNIEXPORT jint JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeForkConversation(
+    JNIEnv* env,
+    jobject thiz,
+    jint conversation,
+    jint checkpoint
+) {
+    return flutter_llama::fork_conversation(conversation, checkpoint);
 }
 
-// Initialize streaming generation
 JNIEXPORT void JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeFreeConversation(
+    JNIEnv* env,
+    jobject thiz,
+    jint conversation
+) {
+    flutter_llama::free_conversation(conversation);
+}
+
+// Queue a streaming request; returns its id (0 on failure)
+JNIEXPORT jint JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGenerateStreamInit(
     JNIEnv* env,
     jobject thiz,
+    jint handle,
     jstring prompt,
     jfloat temperature,
     jfloat top_p,
     jint top_k,
     jint max_tokens,
-    jfloat repeat_penalty
+    jfloat repeat_penalty,
+    jstring session_id,
+    jobjectArray stop_sequences
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    LOGI("Initializing stream generation");
-    
-    if (!g_model || !g_context || !g_vocab) {
-        LOGE("Model not loaded");
-        return;
-    }
-    
-    g_should_stop = false;
-    g_stream_tokens.clear();
-    g_stream_pos = 0;
-    
-    const char* prompt_str = env->GetStringUTFChars(prompt, nullptr);
-    std::string prompt_text(prompt_str);
-    env->ReleaseStringUTFChars(prompt, prompt_str);
-    
-    // Tokenize prompt
-    const int n_prompt = -llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), NULL, 0, true, true);
-    std::vector<llama_token> prompt_tokens(n_prompt);
-    
-    if (llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), prompt_tokens.data(), prompt_tokens.size(), true, true) < 0) {
-        LOGE("Failed to tokenize prompt");
-        return;
-    }
-    
-    // Create batch
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    
-    // Decode prompt
-    if (llama_decode(g_context, batch) != 0) {
-        LOGE("Failed to decode prompt");
-        return;
-    }
+    flutter_llama::GenerationParams params = make_generation_params(
+        env, prompt, temperature, top_p, top_k, max_tokens, repeat_penalty, session_id, stop_sequences);
     
-    // Update sampler
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-    }
-    
-    auto sparams = llama_sampler_chain_default_params();
-    g_sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(top_p, 1));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(top_k));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
-    
-    // Pre-generate tokens and convert to strings
-    int n_pos = prompt_tokens.size();
-    for (int i = 0; i < max_tokens; i++) {
-        if (g_should_stop) break;
-        
-        llama_token new_token = llama_sampler_sample(g_sampler, g_context, -1);
-        
-        if (llama_vocab_is_eog(g_vocab, new_token)) {
-            break;
-        }
-        
-        // Convert token to text and store
-        char token_str[256] = {0};
-        int n = llama_token_to_piece(g_vocab, new_token, token_str, sizeof(token_str) - 1, 0, true);
-        if (n > 0) {
-            token_str[n] = '\0';
-            g_stream_tokens.push_back(std::string(token_str));
-        }
-        
-        batch = llama_batch_get_one(&new_token, 1);
-        n_pos++;
-        
-        if (llama_decode(g_context, batch) != 0) {
-            break;
-        }
-    }
-    
-    LOGI("Pre-generated %zu tokens for streaming", g_stream_tokens.size());
+    return flutter_llama::stream_start(handle, params);
 }
 
-// Get next token in stream
-JNIEXPORT jstring JNICALL
+// Get next stream event, blocking until it is available.
+// Returns a String for a sampled piece, an IntArray [prefilled, total] for
+// prefill progress, or null once generation has finished.
+JNIEXPORT jobject JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGenerateStreamNext(
     JNIEnv* env,
-    jobject thiz
+    jobject thiz,
+    jint request
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (g_should_stop || g_stream_pos >= g_stream_tokens.size()) {
+    flutter_llama::StreamEvent event;
+    if (!flutter_llama::stream_next(request, event)) {
         return nullptr;
     }
     
-    const std::string& token = g_stream_tokens[g_stream_pos++];
-    return env->NewStringUTF(token.c_str());
+    if (event.type == flutter_llama::StreamEventType::PrefillProgress) {
+        jint progress[2] = { event.n_prefilled, event.n_total };
+        jintArray j_progress = env->NewIntArray(2);
+        env->SetIntArrayRegion(j_progress, 0, 2, progress);
+        return j_progress;
+    }
+    
+    return env->NewStringUTF(event.text.c_str());
 }
 
-// End streaming generation
+// End a stream; safe to call from any thread to cancel it
 JNIEXPORT void JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGenerateStreamEnd(
     JNIEnv* env,
-    jobject thiz
+    jobject thiz,
+    jint request
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    LOGI("Ending stream generation");
-    g_stream_tokens.clear();
-    g_stream_pos = 0;
+    flutter_llama::stream_end(request);
+}
+
+// Prefill a partially typed prompt into a session's sequence in the background
+JNIEXPORT jboolean JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativePrepare(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle,
+    jstring session_id,
+    jstring text
+) {
+    return flutter_llama::prepare(handle, jstring_to_string(env, session_id), jstring_to_string(env, text));
+}
+
+// Save a session's KV cache and token history to a file
+JNIEXPORT jboolean JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeSaveSession(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle,
+    jstring session_id,
+    jstring path
+) {
+    return flutter_llama::save_session(handle, jstring_to_string(env, session_id), jstring_to_string(env, path));
+}
+
+// Restore a session saved with nativeSaveSession
+JNIEXPORT jboolean JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeRestoreSession(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle,
+    jstring session_id,
+    jstring path
+) {
+    return flutter_llama::restore_session(handle, jstring_to_string(env, session_id), jstring_to_string(env, path));
+}
+
+// Prefill document chunks and append their KV cells to a document library
+JNIEXPORT jint JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeAddDocuments(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle,
+    jstring path,
+    jobjectArray texts
+) {
+    return flutter_llama::add_documents(handle, jstring_to_string(env, path), jstring_array_to_vector(env, texts));
+}
+
+// Splice documents of a library into later prompts; an empty path stops
+JNIEXPORT jboolean JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeUseDocumentLibrary(
+    JNIEnv* env,
+    jobject thiz,
+    jint handle,
+    jstring path
+) {
+    return flutter_llama::use_document_library(handle, jstring_to_string(env, path));
 }
 
 // Get model information
 JNIEXPORT jobject JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGetModelInfo(
     JNIEnv* env,
-    jobject thiz
+    jobject thiz,
+    jint handle
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_model || !g_context) {
+    flutter_llama::ModelInfo info;
+    if (!flutter_llama::get_model_info(handle, info)) {
         return nullptr;
     }
     
-    jlong n_params = llama_model_n_params(g_model);
-    jint n_layers = llama_model_n_layer(g_model);
-    jint context_size = llama_n_ctx(g_context);
-    
     LOGI("Model info: params=%lld, layers=%d, context=%d", 
-         (long long)n_params, n_layers, context_size);
+         (long long)info.n_params, info.n_layers, info.context_size);
     
     // Create ModelInfo object
     jclass info_class = env->FindClass("net/nativemind/flutter_llama/FlutterLlamaPlugin$ModelInfo");
@@ -382,50 +455,39 @@ Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeGetModelInfo(
         return nullptr;
     }
     
-    jobject model_info = env->NewObject(info_class, constructor, n_params, n_layers, context_size);
+    jobject model_info = env->NewObject(info_class, constructor,
+        (jlong)info.n_params, (jint)info.n_layers, (jint)info.context_size);
     return model_info;
 }
 
-// Free model
+// Release a model handle
 JNIEXPORT void JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeFreeModel(
     JNIEnv* env,
-    jobject thiz
+    jobject thiz,
+    jint handle
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    LOGI("Freeing model");
-    
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
-    }
-    
-    if (g_context) {
-        llama_free(g_context);
-        g_context = nullptr;
-    }
-    
-    if (g_model) {
-        llama_free_model(g_model);
-        g_model = nullptr;
-    }
-    
-    g_vocab = nullptr;
-    
-    LOGI("Model freed successfully");
+    flutter_llama::release_model(handle);
 }
 
 // Stop generation
 JNIEXPORT void JNICALL
 Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeStopGeneration(
     JNIEnv* env,
-    jobject thiz
+    jobject thiz,
+    jint handle
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    LOGI("Stopping generation");
-    g_should_stop = true;
+    flutter_llama::stop_generation(handle);
+}
+
+// Free memory held by all models; blocks until their schedulers have done so
+JNIEXPORT void JNICALL
+Java_net_nativemind_flutter_1llama_FlutterLlamaPlugin_nativeTrimMemory(
+    JNIEnv* env,
+    jobject thiz,
+    jint level
+) {
+    flutter_llama::trim_memory(level);
 }
 
 } // extern "C"
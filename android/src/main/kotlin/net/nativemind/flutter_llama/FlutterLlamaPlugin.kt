@@ -1,5 +1,8 @@
 package net.nativemind.flutter_llama
 
+import android.content.ComponentCallbacks2
+import android.content.Context
+import android.content.res.Configuration
 import android.os.Handler
 import android.os.Looper
 import android.util.Log
@@ -10,8 +13,10 @@ import io.flutter.plugin.common.MethodChannel
 import io.flutter.plugin.common.MethodChannel.MethodCallHandler
 import io.flutter.plugin.common.MethodChannel.Result
 import java.io.File
+import java.util.concurrent.ConcurrentHashMap
 import java.util.concurrent.ExecutorService
 import java.util.concurrent.Executors
+import java.util.concurrent.atomic.AtomicInteger
 
 /**
  * FlutterLlamaPlugin - плагин для работы с llama.cpp моделями на Android
@@ -20,6 +25,9 @@ import java.util.concurrent.Executors
  * - Загрузку GGUF моделей
  * - GPU ускорение через Vulkan/OpenCL
  * - Потоковую и обычную генерацию
+ * - Несколько одновременно загруженных моделей (по идентификатору)
+ * - Дополнительные контексты (в т.ч. для эмбеддингов) поверх общих весов
+ * - Параллельные запросы генерации к одной модели (непрерывный батчинг)
  */
 class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.StreamHandler {
     companion object {
@@ -27,6 +35,11 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
         private const val CHANNEL_NAME = "flutter_llama"
         private const val EVENT_CHANNEL_NAME = "flutter_llama/stream"
 
+        // Levels of nativeTrimMemory
+        private const val TRIM_CACHES = 1
+        private const val TRIM_SESSIONS = 2
+        private const val TRIM_UNLOAD = 3
+
         init {
             try {
                 // Load llama.cpp libraries in correct order
@@ -46,12 +59,42 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
     private lateinit var channel: MethodChannel
     private lateinit var eventChannel: EventChannel
     private var eventSink: EventChannel.EventSink? = null
+    // Loads and frees models one at a time
     private val executor: ExecutorService = Executors.newSingleThreadExecutor()
+    // Generation requests block their thread until done; the native scheduler
+    // batches the ones running at the same time
+    private val generationExecutor: ExecutorService = Executors.newCachedThreadPool()
     private val mainHandler = Handler(Looper.getMainLooper())
     
-    private var modelLoaded = false
-    private var modelPath: String? = null
-    private var shouldStop = false
+    // Native handles opened by this engine, with their model paths
+    private val modelPaths = ConcurrentHashMap<Int, String>()
+    // Handle used by calls without a "modelId" argument (loadModel/unloadModel)
+    @Volatile private var defaultModelId = 0
+    // Running streams: Dart stream id -> native request id (0 until started)
+    private val activeStreams = ConcurrentHashMap<Int, Int>()
+    // Ids for streams started without a "streamId" argument
+    private val nextLocalStreamId = AtomicInteger(-1)
+    private var applicationContext: Context? = null
+
+    // Frees native memory when the system runs low, see trimMemory
+    private val memoryCallbacks = object : ComponentCallbacks2 {
+        override fun onTrimMemory(level: Int) {
+            val trimLevel = when {
+                level >= ComponentCallbacks2.TRIM_MEMORY_BACKGROUND -> TRIM_UNLOAD
+                level >= ComponentCallbacks2.TRIM_MEMORY_UI_HIDDEN -> TRIM_SESSIONS
+                level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL -> TRIM_SESSIONS
+                level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_MODERATE -> TRIM_CACHES
+                else -> return
+            }
+            trimMemory(trimLevel)
+        }
+
+        override fun onLowMemory() {
+            trimMemory(TRIM_UNLOAD)
+        }
+
+        override fun onConfigurationChanged(newConfig: Configuration) {}
+    }
 
     override fun onAttachedToEngine(flutterPluginBinding: FlutterPlugin.FlutterPluginBinding) {
         channel = MethodChannel(flutterPluginBinding.binaryMessenger, CHANNEL_NAME)
@@ -59,18 +102,39 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
         
         eventChannel = EventChannel(flutterPluginBinding.binaryMessenger, EVENT_CHANNEL_NAME)
         eventChannel.setStreamHandler(this)
+
+        applicationContext = flutterPluginBinding.applicationContext
+        applicationContext?.registerComponentCallbacks(memoryCallbacks)
         
         Log.d(TAG, "Plugin attached to engine")
     }
 
     override fun onMethodCall(call: MethodCall, result: Result) {
         when (call.method) {
-            "loadModel" -> loadModel(call, result)
+            "loadModel" -> loadModel(call, result, asDefault = true)
+            "openModel" -> loadModel(call, result, asDefault = false)
+            "createContext" -> createContext(call, result)
+            "embed" -> embed(call, result)
             "generate" -> generate(call, result)
             "generateStream" -> generateStream(call, result)
-            "unloadModel" -> unloadModel(result)
-            "getModelInfo" -> getModelInfo(result)
-            "stopGeneration" -> stopGeneration(result)
+            "unloadModel" -> unloadModel(call, result)
+            "closeModel" -> unloadModel(call, result)
+            "getModelInfo" -> getModelInfo(call, result)
+            "stopGeneration" -> stopGeneration(call, result)
+            "cancelStream" -> cancelStream(call, result)
+            "prepare" -> prepare(call, result)
+            "createConversation" -> createConversation(call, result)
+            "appendMessage" -> appendMessage(call, result)
+            "generateReply" -> generateReply(call, result)
+            "checkpointConversation" -> checkpointConversation(call, result)
+            "rollbackConversation" -> rollbackConversation(call, result)
+            "forkConversation" -> forkConversation(call, result)
+            "closeConversation" -> closeConversation(call, result)
+            "saveSession" -> saveSession(call, result, restore = false)
+            "restoreSession" -> saveSession(call, result, restore = true)
+            "addDocuments" -> addDocuments(call, result)
+            "useDocumentLibrary" -> useDocumentLibrary(call, result)
+            "trimMemory" -> trimMemory(call, result)
             else -> result.notImplemented()
         }
     }
@@ -78,7 +142,22 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
     override fun onDetachedFromEngine(binding: FlutterPlugin.FlutterPluginBinding) {
         channel.setMethodCallHandler(null)
         eventChannel.setStreamHandler(null)
+        applicationContext?.unregisterComponentCallbacks(memoryCallbacks)
+        applicationContext = null
+        // Release everything this engine loaded; other engines keep their models
+        cancelAllStreams()
+        for (modelId in modelPaths.keys) {
+            nativeStopGeneration(modelId)
+        }
+        executor.execute {
+            for (modelId in modelPaths.keys) {
+                nativeFreeModel(modelId)
+            }
+            modelPaths.clear()
+            defaultModelId = 0
+        }
         executor.shutdown()
+        generationExecutor.shutdown()
     }
 
     // MARK: - EventChannel.StreamHandler
@@ -89,12 +168,34 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
 
     override fun onCancel(arguments: Any?) {
         eventSink = null
-        shouldStop = true
+        // The listener went away mid-stream: abort the native requests right away
+        cancelAllStreams()
+    }
+
+    private fun cancelAllStreams() {
+        for (streamId in activeStreams.keys) {
+            cancelStream(streamId)
+        }
+    }
+
+    // Lock-free on the native side, safe to call from the main thread
+    private fun cancelStream(streamId: Int) {
+        val requestId = activeStreams.remove(streamId) ?: return
+        if (requestId != 0) {
+            nativeGenerateStreamEnd(requestId)
+        }
+    }
+
+    // Explicit "modelId" argument, or the model loaded through loadModel
+    private fun resolveModelId(call: MethodCall): Int {
+        return call.argument<Int>("modelId") ?: defaultModelId
     }
 
     // MARK: - Load Model
 
-    private fun loadModel(call: MethodCall, result: Result) {
+    // loadModel replaces the default model and returns true; openModel keeps
+    // it and returns the new model's handle
+    private fun loadModel(call: MethodCall, result: Result, asDefault: Boolean) {
         executor.execute {
             try {
                 val modelPath = call.argument<String>("modelPath")
@@ -108,7 +209,20 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
                 val nThreads = call.argument<Int>("nThreads") ?: 4
                 val nGpuLayers = call.argument<Int>("nGpuLayers") ?: 0
                 val contextSize = call.argument<Int>("contextSize") ?: 2048
+                val initialContextSize = call.argument<Int>("initialContextSize") ?: 0
                 val batchSize = call.argument<Int>("batchSize") ?: 512
+                val maxSequences = call.argument<Int>("maxSequences") ?: 4
+                val stepBudget = call.argument<Int>("stepBudget") ?: 128
+                val cacheReuse = call.argument<Int>("cacheReuse") ?: 32
+                val sinkTokens = call.argument<Int>("sinkTokens") ?: 4
+                val recentWindow = call.argument<Int>("recentWindow") ?: 0
+                val pinnedPrefixes = (call.argument<List<String>>("pinnedPrefixes") ?: emptyList()).toTypedArray()
+                val promptCacheDir = call.argument<String>("promptCacheDir")
+                val promptCacheBudgetMb = call.argument<Int>("promptCacheBudgetMb") ?: 512
+                val sessionSwapMb = call.argument<Int>("sessionSwapMb") ?: 0
+                val sessionSwapDiskMb = call.argument<Int>("sessionSwapDiskMb") ?: 512
+                val idleTimeoutSeconds = call.argument<Int>("idleTimeoutSeconds") ?: 0
+                val responseCacheEntries = call.argument<Int>("responseCacheEntries") ?: 64
                 val useGpu = call.argument<Boolean>("useGpu") ?: true
                 val verbose = call.argument<Boolean>("verbose") ?: false
 
@@ -121,26 +235,52 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
                     return@execute
                 }
 
-                this.modelPath = modelPath
+                if (asDefault && defaultModelId != 0) {
+                    nativeFreeModel(defaultModelId)
+                    modelPaths.remove(defaultModelId)
+                    defaultModelId = 0
+                }
 
                 // Initialize model through JNI
-                val success = nativeInitModel(
+                val modelId = nativeInitModel(
                     modelPath,
                     nThreads,
                     nGpuLayers,
                     contextSize,
+                    initialContextSize,
                     batchSize,
+                    maxSequences,
+                    stepBudget,
+                    cacheReuse,
+                    sinkTokens,
+                    recentWindow,
+                    pinnedPrefixes,
+                    promptCacheDir,
+                    promptCacheBudgetMb,
+                    sessionSwapMb,
+                    sessionSwapDiskMb,
+                    idleTimeoutSeconds,
+                    responseCacheEntries,
                     useGpu,
                     verbose
                 )
 
-                modelLoaded = success
+                if (modelId != 0) {
+                    modelPaths[modelId] = modelPath
+                    if (asDefault) {
+                        defaultModelId = modelId
+                    }
+                }
 
                 mainHandler.post {
-                    if (success) {
-                        Log.d(TAG, "Model loaded: $modelPath")
+                    if (modelId != 0) {
+                        Log.d(TAG, "Model loaded: $modelPath (id $modelId)")
                         Log.d(TAG, "GPU layers: $nGpuLayers, threads: $nThreads, context: $contextSize")
-                        result.success(true)
+                        if (asDefault) {
+                            result.success(true)
+                        } else {
+                            result.success(modelId)
+                        }
                     } else {
                         result.error("INIT_FAILED", "Failed to initialize model", null)
                     }
@@ -154,15 +294,125 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
         }
     }
 
+    // MARK: - Create Context
+
+    // New handle with its own context over the weights of "modelId"
+    private fun createContext(call: MethodCall, result: Result) {
+        val sourceId = resolveModelId(call)
+        val modelPath = modelPaths[sourceId]
+        if (modelPath == null) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+
+        executor.execute {
+            try {
+                val nThreads = call.argument<Int>("nThreads") ?: 4
+                val contextSize = call.argument<Int>("contextSize") ?: 2048
+                val initialContextSize = call.argument<Int>("initialContextSize") ?: 0
+                val batchSize = call.argument<Int>("batchSize") ?: 512
+                val maxSequences = call.argument<Int>("maxSequences") ?: 4
+                val stepBudget = call.argument<Int>("stepBudget") ?: 128
+                val cacheReuse = call.argument<Int>("cacheReuse") ?: 32
+                val sinkTokens = call.argument<Int>("sinkTokens") ?: 4
+                val recentWindow = call.argument<Int>("recentWindow") ?: 0
+                val pinnedPrefixes = (call.argument<List<String>>("pinnedPrefixes") ?: emptyList()).toTypedArray()
+                val promptCacheDir = call.argument<String>("promptCacheDir")
+                val promptCacheBudgetMb = call.argument<Int>("promptCacheBudgetMb") ?: 512
+                val sessionSwapMb = call.argument<Int>("sessionSwapMb") ?: 0
+                val sessionSwapDiskMb = call.argument<Int>("sessionSwapDiskMb") ?: 512
+                val idleTimeoutSeconds = call.argument<Int>("idleTimeoutSeconds") ?: 0
+                val responseCacheEntries = call.argument<Int>("responseCacheEntries") ?: 64
+                val embeddings = call.argument<Boolean>("embeddings") ?: false
+
+                val modelId = nativeCreateContext(
+                    sourceId,
+                    nThreads,
+                    contextSize,
+                    initialContextSize,
+                    batchSize,
+                    maxSequences,
+                    stepBudget,
+                    cacheReuse,
+                    sinkTokens,
+                    recentWindow,
+                    pinnedPrefixes,
+                    promptCacheDir,
+                    promptCacheBudgetMb,
+                    sessionSwapMb,
+                    sessionSwapDiskMb,
+                    idleTimeoutSeconds,
+                    responseCacheEntries,
+                    embeddings
+                )
+                if (modelId != 0) {
+                    modelPaths[modelId] = modelPath
+                }
+
+                mainHandler.post {
+                    if (modelId != 0) {
+                        Log.d(TAG, "Context $modelId created over model $sourceId (embeddings: $embeddings)")
+                        result.success(modelId)
+                    } else {
+                        result.error("INIT_FAILED", "Failed to create context", null)
+                    }
+                }
+            } catch (e: Exception) {
+                Log.e(TAG, "Error creating context", e)
+                mainHandler.post {
+                    result.error("EXCEPTION", "Error creating context: ${e.message}", null)
+                }
+            }
+        }
+    }
+
+    // MARK: - Embed
+
+    private fun embed(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+
+        generationExecutor.execute {
+            try {
+                val text = call.argument<String>("text")
+                if (text == null) {
+                    mainHandler.post {
+                        result.error("INVALID_ARGS", "Missing text", null)
+                    }
+                    return@execute
+                }
+
+                val embedding = nativeEmbed(modelId, text)
+
+                mainHandler.post {
+                    if (embedding != null) {
+                        result.success(embedding.map { it.toDouble() })
+                    } else {
+                        result.error("EMBEDDING_FAILED", "Failed to embed text", null)
+                    }
+                }
+            } catch (e: Exception) {
+                Log.e(TAG, "Error embedding", e)
+                mainHandler.post {
+                    result.error("EXCEPTION", "Error embedding: ${e.message}", null)
+                }
+            }
+        }
+    }
+
     // MARK: - Generate (blocking)
 
     private fun generate(call: MethodCall, result: Result) {
-        if (!modelLoaded) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
             result.error("MODEL_NOT_LOADED", "Model not loaded", null)
             return
         }
 
-        executor.execute {
+        generationExecutor.execute {
             try {
                 val prompt = call.argument<String>("prompt")
                 if (prompt == null) {
@@ -177,18 +427,22 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
                 val topK = call.argument<Int>("topK") ?: 40
                 val maxTokens = call.argument<Int>("maxTokens") ?: 512
                 val repeatPenalty = call.argument<Double>("repeatPenalty")?.toFloat() ?: 1.1f
+                val sessionId = call.argument<String>("sessionId")
+                val stopSequences = (call.argument<List<String>>("stopSequences") ?: emptyList()).toTypedArray()
 
-                shouldStop = false
                 val startTime = System.currentTimeMillis()
 
                 // Generate through JNI
                 val generationResult = nativeGenerate(
+                    modelId,
                     prompt,
                     temperature,
                     topP,
                     topK,
                     maxTokens,
-                    repeatPenalty
+                    repeatPenalty,
+                    sessionId,
+                    stopSequences
                 )
 
                 val generationTime = System.currentTimeMillis() - startTime
@@ -217,8 +471,11 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
 
     // MARK: - Generate Stream
 
+    // Every event carries the "streamId" the call was made with, so any
+    // number of streams can share the event channel
     private fun generateStream(call: MethodCall, result: Result) {
-        if (!modelLoaded) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
             result.error("MODEL_NOT_LOADED", "Model not loaded", null)
             return
         }
@@ -229,10 +486,15 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
             return
         }
 
-        executor.execute {
+        val streamId = call.argument<Int>("streamId") ?: nextLocalStreamId.getAndDecrement()
+        activeStreams[streamId] = 0
+
+        generationExecutor.execute {
+            var requestId = 0
             try {
                 val prompt = call.argument<String>("prompt")
                 if (prompt == null) {
+                    activeStreams.remove(streamId)
                     mainHandler.post {
                         result.error("INVALID_ARGS", "Missing prompt", null)
                     }
@@ -244,34 +506,75 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
                 val topK = call.argument<Int>("topK") ?: 40
                 val maxTokens = call.argument<Int>("maxTokens") ?: 512
                 val repeatPenalty = call.argument<Double>("repeatPenalty")?.toFloat() ?: 1.1f
+                val sessionId = call.argument<String>("sessionId")
+                val stopSequences = (call.argument<List<String>>("stopSequences") ?: emptyList()).toTypedArray()
 
-                shouldStop = false
+                // Queue the request with the native scheduler
+                requestId = nativeGenerateStreamInit(
+                    modelId, prompt, temperature, topP, topK, maxTokens, repeatPenalty, sessionId, stopSequences
+                )
 
-                // Initialize streaming generation
-                nativeGenerateStreamInit(prompt, temperature, topP, topK, maxTokens, repeatPenalty)
+                // Cancelled while the request was being queued
+                if (requestId != 0 && !activeStreams.replace(streamId, 0, requestId)) {
+                    nativeGenerateStreamEnd(requestId)
+                }
 
-                // Stream tokens one by one
-                while (!shouldStop) {
-                    val token = nativeGenerateStreamNext()
-                    if (token != null) {
-                        mainHandler.post {
-                            sink.success(token)
+                // Stream prefill progress and tokens as the native scheduler produces them
+                while (requestId != 0) {
+                    when (val event = nativeGenerateStreamNext(requestId)) {
+                        is String -> {
+                            val token = hashMapOf(
+                                "streamId" to streamId,
+                                "type" to "token",
+                                "text" to event
+                            )
+                            mainHandler.post {
+                                sink.success(token)
+                            }
                         }
-                    } else {
-                        break
+                        is IntArray -> {
+                            val progress = hashMapOf(
+                                "streamId" to streamId,
+                                "type" to "prefillProgress",
+                                "prefilled" to event[0],
+                                "total" to event[1]
+                            )
+                            mainHandler.post {
+                                sink.success(progress)
+                            }
+                        }
+                        else -> break
                     }
                 }
 
-                nativeGenerateStreamEnd()
+                activeStreams.remove(streamId)
+                nativeGenerateStreamEnd(requestId)
 
+                val done = hashMapOf<String, Any>(
+                    "streamId" to streamId,
+                    "type" to "done"
+                )
                 mainHandler.post {
-                    sink.endOfStream()
-                    result.success(null)
+                    sink.success(done)
+                    if (requestId != 0) {
+                        result.success(null)
+                    } else {
+                        result.error("GENERATION_FAILED", "Failed to start streaming", null)
+                    }
                 }
             } catch (e: Exception) {
+                activeStreams.remove(streamId)
+                if (requestId != 0) {
+                    nativeGenerateStreamEnd(requestId)
+                }
                 Log.e(TAG, "Error in streaming generation", e)
+                val error = hashMapOf<String, Any>(
+                    "streamId" to streamId,
+                    "type" to "error",
+                    "message" to "Error in streaming: ${e.message}"
+                )
                 mainHandler.post {
-                    sink.error("EXCEPTION", "Error in streaming: ${e.message}", null)
+                    sink.success(error)
                     result.error("EXCEPTION", "Error in streaming: ${e.message}", null)
                 }
             }
@@ -280,48 +583,309 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
 
     // MARK: - Unload Model
 
-    private fun unloadModel(result: Result) {
-        if (modelLoaded) {
-            nativeFreeModel()
-            modelLoaded = false
-            modelPath = null
-            Log.d(TAG, "Model unloaded")
+    private fun unloadModel(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        if (modelPaths.remove(modelId) != null) {
+            if (modelId == defaultModelId) {
+                defaultModelId = 0
+            }
+            // Cancels its running requests; their threads return right away
+            nativeStopGeneration(modelId)
+            executor.execute {
+                nativeFreeModel(modelId)
+                Log.d(TAG, "Model $modelId unloaded")
+            }
         }
         result.success(null)
     }
 
-    // MARK: - Get Model Info
+    // MARK: - Conversations
+
+    // Reloads a model unloaded under memory pressure, so it runs off the
+    // main thread
+    private fun createConversation(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+        generationExecutor.execute {
+            val conversationId = nativeCreateConversation(modelId)
+            mainHandler.post { result.success(conversationId) }
+        }
+    }
+
+    // Waits while the conversation generates a reply, so it runs off the main thread
+    private fun appendMessage(call: MethodCall, result: Result) {
+        val conversationId = call.argument<Int>("conversationId")
+        val role = call.argument<String>("role")
+        val content = call.argument<String>("content")
+        if (conversationId == null || role == null || content == null) {
+            result.error("INVALID_ARGS", "Missing conversationId, role or content", null)
+            return
+        }
+
+        generationExecutor.execute {
+            val ok = nativeAppendMessage(conversationId, role, content)
+            mainHandler.post { result.success(ok) }
+        }
+    }
+
+    private fun generateReply(call: MethodCall, result: Result) {
+        val conversationId = call.argument<Int>("conversationId")
+        if (conversationId == null) {
+            result.error("INVALID_ARGS", "Missing conversationId", null)
+            return
+        }
+
+        val temperature = call.argument<Double>("temperature")?.toFloat() ?: 0.8f
+        val topP = call.argument<Double>("topP")?.toFloat() ?: 0.95f
+        val topK = call.argument<Int>("topK") ?: 40
+        val maxTokens = call.argument<Int>("maxTokens") ?: 512
+        val repeatPenalty = call.argument<Double>("repeatPenalty")?.toFloat() ?: 1.1f
+        val stopSequences = (call.argument<List<String>>("stopSequences") ?: emptyList()).toTypedArray()
+
+        generationExecutor.execute {
+            val startTime = System.currentTimeMillis()
+            val generationResult = nativeGenerateReply(
+                conversationId,
+                temperature,
+                topP,
+                topK,
+                maxTokens,
+                repeatPenalty,
+                stopSequences
+            )
+            val generationTime = System.currentTimeMillis() - startTime
+
+            mainHandler.post {
+                if (generationResult != null) {
+                    result.success(hashMapOf(
+                        "text" to generationResult.text,
+                        "tokensGenerated" to generationResult.tokensGenerated,
+                        "generationTimeMs" to generationTime
+                    ))
+                } else {
+                    result.error("GENERATION_FAILED", "Failed to generate reply", null)
+                }
+            }
+        }
+    }
+
+    // These wait for a reply being generated as well
+    private fun checkpointConversation(call: MethodCall, result: Result) {
+        val conversationId = call.argument<Int>("conversationId")
+        if (conversationId == null) {
+            result.error("INVALID_ARGS", "Missing conversationId", null)
+            return
+        }
+
+        generationExecutor.execute {
+            val checkpoint = nativeCheckpointConversation(conversationId)
+            mainHandler.post { result.success(checkpoint) }
+        }
+    }
+
+    private fun rollbackConversation(call: MethodCall, result: Result) {
+        val conversationId = call.argument<Int>("conversationId")
+        val checkpoint = call.argument<Int>("checkpoint")
+        if (conversationId == null || checkpoint == null) {
+            result.error("INVALID_ARGS", "Missing conversationId or checkpoint", null)
+            return
+        }
+
+        generationExecutor.execute {
+            val ok = nativeRollbackConversation(conversationId, checkpoint)
+            mainHandler.post { result.success(ok) }
+        }
+    }
 
-    private fun getModelInfo(result: Result) {
-        if (!modelLoaded || modelPath == null) {
+    private fun forkConversation(call: MethodCall, result: Result) {
+        val conversationId = call.argument<Int>("conversationId")
+        if (conversationId == null) {
+            result.error("INVALID_ARGS", "Missing conversationId", null)
+            return
+        }
+        val checkpoint = call.argument<Int>("checkpoint") ?: -1
+
+        generationExecutor.execute {
+            val forkId = nativeForkConversation(conversationId, checkpoint)
+            mainHandler.post { result.success(forkId) }
+        }
+    }
+
+    private fun closeConversation(call: MethodCall, result: Result) {
+        val conversationId = call.argument<Int>("conversationId")
+        if (conversationId == null) {
             result.success(null)
             return
         }
 
-        try {
-            val info = nativeGetModelInfo()
-            if (info != null) {
-                val infoMap = hashMapOf(
-                    "modelPath" to modelPath!!,
-                    "nParams" to info.nParams,
-                    "nLayers" to info.nLayers,
-                    "contextSize" to info.contextSize
-                )
-                result.success(infoMap)
+        generationExecutor.execute {
+            nativeFreeConversation(conversationId)
+            mainHandler.post { result.success(null) }
+        }
+    }
+
+    // MARK: - Prepare
+
+    private fun prepare(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+
+        val sessionId = call.argument<String>("sessionId")
+        val text = call.argument<String>("text")
+        if (sessionId == null || text == null) {
+            result.error("INVALID_ARGS", "Missing sessionId or text", null)
+            return
+        }
+
+        // Called on every keystroke: in order, and never waiting on the main
+        // thread for the model lock
+        executor.execute {
+            val ok = nativePrepare(modelId, sessionId, text)
+            mainHandler.post { result.success(ok) }
+        }
+    }
+
+    // MARK: - Sessions
+
+    // Both directions do file I/O and wait for the scheduler to reach a step
+    // boundary, so they run off the main thread
+    private fun saveSession(call: MethodCall, result: Result, restore: Boolean) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+
+        val sessionId = call.argument<String>("sessionId")
+        val path = call.argument<String>("path")
+        if (sessionId == null || path == null) {
+            result.error("INVALID_ARGS", "Missing sessionId or path", null)
+            return
+        }
+
+        generationExecutor.execute {
+            val ok = if (restore) {
+                nativeRestoreSession(modelId, sessionId, path)
             } else {
-                result.success(null)
+                nativeSaveSession(modelId, sessionId, path)
             }
-        } catch (e: Exception) {
-            Log.e(TAG, "Error getting model info", e)
+            mainHandler.post {
+                Log.d(TAG, "Session $sessionId ${if (restore) "restore" else "save"}: $ok")
+                result.success(ok)
+            }
+        }
+    }
+
+    // MARK: - Document Library
+
+    // Prefills every new chunk, so it runs off the main thread
+    private fun addDocuments(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+
+        val path = call.argument<String>("path")
+        val chunks = call.argument<List<String>>("chunks")
+        if (path == null || chunks == null) {
+            result.error("INVALID_ARGS", "Missing path or chunks", null)
+            return
+        }
+
+        generationExecutor.execute {
+            val added = nativeAddDocuments(modelId, path, chunks.toTypedArray())
+            mainHandler.post {
+                Log.d(TAG, "Added $added documents to $path")
+                result.success(added)
+            }
+        }
+    }
+
+    private fun useDocumentLibrary(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        if (!modelPaths.containsKey(modelId)) {
+            result.error("MODEL_NOT_LOADED", "Model not loaded", null)
+            return
+        }
+
+        val path = call.argument<String>("path") ?: ""
+        generationExecutor.execute {
+            val ok = nativeUseDocumentLibrary(modelId, path)
+            mainHandler.post { result.success(ok) }
+        }
+    }
+
+    // MARK: - Get Model Info
+
+    private fun getModelInfo(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        val modelPath = modelPaths[modelId]
+        if (modelPath == null) {
             result.success(null)
+            return
+        }
+
+        generationExecutor.execute {
+            try {
+                val info = nativeGetModelInfo(modelId)
+                if (info != null) {
+                    val infoMap = hashMapOf(
+                        "modelPath" to modelPath,
+                        "nParams" to info.nParams,
+                        "nLayers" to info.nLayers,
+                        "contextSize" to info.contextSize
+                    )
+                    mainHandler.post { result.success(infoMap) }
+                } else {
+                    mainHandler.post { result.success(null) }
+                }
+            } catch (e: Exception) {
+                Log.e(TAG, "Error getting model info", e)
+                mainHandler.post { result.success(null) }
+            }
         }
     }
 
     // MARK: - Stop Generation
 
-    private fun stopGeneration(result: Result) {
-        shouldStop = true
-        nativeStopGeneration()
+    private fun stopGeneration(call: MethodCall, result: Result) {
+        val modelId = resolveModelId(call)
+        // Cancels every request on the model; lock-free on the native side,
+        // safe to call from the main thread mid-decode
+        nativeStopGeneration(modelId)
+        result.success(null)
+    }
+
+    // MARK: - Trim Memory
+
+    private fun trimMemory(call: MethodCall, result: Result) {
+        val level = call.argument<Int>("level") ?: TRIM_CACHES
+        generationExecutor.execute {
+            nativeTrimMemory(level)
+            mainHandler.post { result.success(null) }
+        }
+    }
+
+    // Waits for the models' scheduler threads, so never on the main thread
+    private fun trimMemory(level: Int) {
+        Log.d(TAG, "Trimming memory, level $level")
+        generationExecutor.execute { nativeTrimMemory(level) }
+    }
+
+    // MARK: - Cancel Stream
+
+    private fun cancelStream(call: MethodCall, result: Result) {
+        val streamId = call.argument<Int>("streamId")
+        if (streamId != null) {
+            cancelStream(streamId)
+        }
         result.success(null)
     }
 
@@ -332,38 +896,123 @@ class FlutterLlamaPlugin : FlutterPlugin, MethodCallHandler, EventChannel.Stream
         nThreads: Int,
         nGpuLayers: Int,
         contextSize: Int,
+        initialContextSize: Int,
         batchSize: Int,
+        maxSequences: Int,
+        stepBudget: Int,
+        cacheReuse: Int,
+        sinkTokens: Int,
+        recentWindow: Int,
+        pinnedPrefixes: Array<String>,
+        promptCacheDir: String?,
+        promptCacheBudgetMb: Int,
+        sessionSwapMb: Int,
+        sessionSwapDiskMb: Int,
+        idleTimeoutSeconds: Int,
+        responseCacheEntries: Int,
         useGpu: Boolean,
         verbose: Boolean
-    ): Boolean
+    ): Int
+
+    private external fun nativeCreateContext(
+        sourceModelId: Int,
+        nThreads: Int,
+        contextSize: Int,
+        initialContextSize: Int,
+        batchSize: Int,
+        maxSequences: Int,
+        stepBudget: Int,
+        cacheReuse: Int,
+        sinkTokens: Int,
+        recentWindow: Int,
+        pinnedPrefixes: Array<String>,
+        promptCacheDir: String?,
+        promptCacheBudgetMb: Int,
+        sessionSwapMb: Int,
+        sessionSwapDiskMb: Int,
+        idleTimeoutSeconds: Int,
+        responseCacheEntries: Int,
+        embeddings: Boolean
+    ): Int
+
+    private external fun nativeEmbed(modelId: Int, text: String): FloatArray?
 
     private external fun nativeGenerate(
+        modelId: Int,
         prompt: String,
         temperature: Float,
         topP: Float,
         topK: Int,
         maxTokens: Int,
-        repeatPenalty: Float
+        repeatPenalty: Float,
+        sessionId: String?,
+        stopSequences: Array<String>
     ): GenerationResult?
 
     private external fun nativeGenerateStreamInit(
+        modelId: Int,
         prompt: String,
         temperature: Float,
         topP: Float,
         topK: Int,
         maxTokens: Int,
-        repeatPenalty: Float
-    )
+        repeatPenalty: Float,
+        sessionId: String?,
+        stopSequences: Array<String>
+    ): Int
+
+    // String for a sampled piece, IntArray [prefilled, total] for prefill progress, null when done
+    private external fun nativeGenerateStreamNext(requestId: Int): Any?
+
+    // Thread-safe; cancels the request if it is still running
+    private external fun nativeGenerateStreamEnd(requestId: Int)
+
+    // Returns 0 on failure
+    private external fun nativeCreateConversation(modelId: Int): Int
+
+    private external fun nativeAppendMessage(conversationId: Int, role: String, content: String): Boolean
+
+    private external fun nativeGenerateReply(
+        conversationId: Int,
+        temperature: Float,
+        topP: Float,
+        topK: Int,
+        maxTokens: Int,
+        repeatPenalty: Float,
+        stopSequences: Array<String>
+    ): GenerationResult?
+
+    // Returns -1 for unknown conversations
+    private external fun nativeCheckpointConversation(conversationId: Int): Int
+
+    private external fun nativeRollbackConversation(conversationId: Int, checkpoint: Int): Boolean
+
+    // checkpoint -1 copies the whole history; returns 0 on failure
+    private external fun nativeForkConversation(conversationId: Int, checkpoint: Int): Int
+
+    // Waits for a reply still being generated
+    private external fun nativeFreeConversation(conversationId: Int)
+
+    // Returns at once; the prefill runs on the model's scheduler thread
+    private external fun nativePrepare(modelId: Int, sessionId: String, text: String): Boolean
+
+    private external fun nativeSaveSession(modelId: Int, sessionId: String, path: String): Boolean
+
+    private external fun nativeRestoreSession(modelId: Int, sessionId: String, path: String): Boolean
+
+    // Number of documents added, -1 on failure
+    private external fun nativeAddDocuments(modelId: Int, path: String, texts: Array<String>): Int
 
-    private external fun nativeGenerateStreamNext(): String?
+    private external fun nativeUseDocumentLibrary(modelId: Int, path: String): Boolean
 
-    private external fun nativeGenerateStreamEnd()
+    private external fun nativeGetModelInfo(modelId: Int): ModelInfo?
 
-    private external fun nativeGetModelInfo(): ModelInfo?
+    private external fun nativeFreeModel(modelId: Int)
 
-    private external fun nativeFreeModel()
+    private external fun nativeStopGeneration(modelId: Int)
 
-    private external fun nativeStopGeneration()
+    // 1: caches, 2: idle sessions too, 3: unload idle models; see trim_memory
+    private external fun nativeTrimMemory(level: Int)
 
     // Data classes for JNI results
     data class GenerationResult(
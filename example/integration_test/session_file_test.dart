@@ -0,0 +1,91 @@
+import 'dart:io';
+import 'dart:typed_data';
+import 'package:flutter_test/flutter_test.dart';
+import 'package:integration_test/integration_test.dart';
+import 'package:flutter_llama/flutter_llama.dart';
+import '../lib/utils/model_downloader.dart';
+
+void main() {
+  IntegrationTestWidgetsFlutterBinding.ensureInitialized();
+
+  group('Session File Integration Tests', () {
+    late FlutterLlama llama;
+
+    setUpAll(() async {
+      String? path = await ModelDownloader.getModelPath('braindler-q2_k');
+      path ??= await ModelDownloader.downloadModel('braindler-q2_k');
+
+      llama = FlutterLlama.instance;
+      final loaded = await llama.loadModel(
+        LlamaConfig(modelPath: path!, nThreads: 4, contextSize: 2048),
+      );
+      expect(loaded, isTrue, reason: 'Model should load successfully');
+    });
+
+    tearDownAll(() async {
+      try {
+        if (llama.isModelLoaded) {
+          await llama.unloadModel();
+        }
+      } catch (e) {
+        print('Error during final cleanup: $e');
+      }
+    });
+
+    testWidgets('should restore up to the last good frame', (
+      WidgetTester tester,
+    ) async {
+      final path = '${Directory.systemTemp.path}/session_file_test.bin';
+
+      // A keyframe, then a delta appended by the second save: maxTokens 0
+      // only prefills, so the second prompt continues the saved history
+      await llama.generate(
+        GenerationParams(
+          prompt: 'The quick brown fox',
+          maxTokens: 0,
+          sessionId: 'damaged',
+        ),
+      );
+      expect(await llama.saveSession('damaged', path), isTrue);
+      await llama.generate(
+        GenerationParams(
+          prompt: 'The quick brown fox jumps over the lazy dog',
+          maxTokens: 0,
+          sessionId: 'damaged',
+        ),
+      );
+      expect(await llama.saveSession('damaged', path), isTrue);
+
+      // Corrupt the state size of the delta: "FLSS", version, model params,
+      // then per frame "FLFR", base, n_tokens, tokens, state size,
+      // compressed size, compressed state
+      final bytes = File(path).readAsBytesSync();
+      final data = ByteData.sublistView(bytes);
+      int frameStart = 16;
+      int stateSizeOffset(int frame) =>
+          frame + 12 + 4 * data.getUint32(frame + 8, Endian.host);
+      final firstStateSize = stateSizeOffset(frameStart);
+      frameStart = firstStateSize +
+          16 +
+          data.getUint64(firstStateSize + 8, Endian.host);
+      expect(frameStart, lessThan(bytes.length), reason: 'Two frames');
+      data.setUint64(stateSizeOffset(frameStart), 1 << 60, Endian.host);
+      File(path).writeAsBytesSync(bytes);
+
+      // The keyframe still restores instead of the app running out of memory
+      expect(await llama.restoreSession('damaged-copy', path), isTrue);
+
+      final response = await llama.generate(
+        GenerationParams(
+          prompt: 'The quick brown fox jumps over the lazy dog',
+          maxTokens: 8,
+          temperature: 0.0,
+          sessionId: 'damaged-copy',
+        ),
+      );
+      expect(response.text, isNotEmpty);
+
+      File(path).deleteSync();
+    });
+  });
+}
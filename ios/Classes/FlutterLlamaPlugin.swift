@@ -9,14 +9,33 @@ import Foundation
  * - Загрузку GGUF моделей
  * - GPU ускорение через Metal
  * - Потоковую и обычную генерацию
+ * - Несколько одновременно загруженных моделей (по идентификатору)
+ * - Дополнительные контексты (в т.ч. для эмбеддингов) поверх общих весов
+ * - Параллельные запросы генерации к одной модели (непрерывный батчинг)
  */
 @available(iOS 13.0, *)
 public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
-    private var modelLoaded = false
-    private var modelPath: String?
+    // Native handles opened by this engine, with their model paths.
+    // Only touched on the main thread.
+    private var modelPaths: [Int32: String] = [:]
+    // Handle used by calls without a "modelId" argument (loadModel/unloadModel)
+    private var defaultModelId: Int32 = 0
+    // Loads and frees models one at a time
     private let queue = DispatchQueue(label: "net.nativemind.flutter_llama", qos: .userInitiated)
+    // Generation requests block their thread until done; the native scheduler
+    // batches the ones running at the same time
+    private let generationQueue = DispatchQueue(
+        label: "net.nativemind.flutter_llama.generation",
+        qos: .userInitiated,
+        attributes: .concurrent
+    )
     private var eventSink: FlutterEventSink?
-    private var shouldStop = false
+    // Running streams: Dart stream id -> native request id (0 until started)
+    private var activeStreams: [Int: Int32] = [:]
+    private let activeStreamsLock = NSLock()
+    // Ids for streams started without a "streamId" argument. Main thread only.
+    private var nextLocalStreamId = -1
+    private var memoryWarningObserver: NSObjectProtocol?
     
     public static func register(with registrar: FlutterPluginRegistrar) {
         let channel = FlutterMethodChannel(
@@ -32,29 +51,105 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
         let instance = FlutterLlamaPlugin()
         registrar.addMethodCallDelegate(instance, channel: channel)
         eventChannel.setStreamHandler(instance)
+        instance.observeMemoryPressure()
         
         NSLog("[FlutterLlama] Plugin registered")
     }
     
+    // Frees native memory on memory warnings; models are unloaded only once
+    // the app is in the background
+    private func observeMemoryPressure() {
+        memoryWarningObserver = NotificationCenter.default.addObserver(
+            forName: UIApplication.didReceiveMemoryWarningNotification,
+            object: nil,
+            queue: .main
+        ) { [weak self] _ in
+            let level: Int32 = UIApplication.shared.applicationState == .background ? 3 : 2
+            self?.trimMemory(level)
+        }
+    }
+    
     public func handle(_ call: FlutterMethodCall, result: @escaping FlutterResult) {
         switch call.method {
         case "loadModel":
-            loadModel(call: call, result: result)
+            loadModel(call: call, result: result, asDefault: true)
+        case "openModel":
+            loadModel(call: call, result: result, asDefault: false)
+        case "createContext":
+            createContext(call: call, result: result)
+        case "embed":
+            embed(call: call, result: result)
         case "generate":
             generate(call: call, result: result)
         case "generateStream":
             generateStream(call: call, result: result)
-        case "unloadModel":
-            unloadModel(result: result)
+        case "unloadModel", "closeModel":
+            unloadModel(call: call, result: result)
         case "getModelInfo":
-            getModelInfo(result: result)
+            getModelInfo(call: call, result: result)
         case "stopGeneration":
-            stopGeneration(result: result)
+            stopGeneration(call: call, result: result)
+        case "cancelStream":
+            cancelStream(call: call, result: result)
+        case "prepare":
+            prepare(call: call, result: result)
+        case "createConversation":
+            createConversation(call: call, result: result)
+        case "appendMessage":
+            appendMessage(call: call, result: result)
+        case "generateReply":
+            generateReply(call: call, result: result)
+        case "checkpointConversation":
+            checkpointConversation(call: call, result: result)
+        case "rollbackConversation":
+            rollbackConversation(call: call, result: result)
+        case "forkConversation":
+            forkConversation(call: call, result: result)
+        case "closeConversation":
+            closeConversation(call: call, result: result)
+        case "saveSession":
+            saveSession(call: call, result: result, restore: false)
+        case "restoreSession":
+            saveSession(call: call, result: result, restore: true)
+        case "addDocuments":
+            addDocuments(call: call, result: result)
+        case "useDocumentLibrary":
+            useDocumentLibrary(call: call, result: result)
+        case "trimMemory":
+            trimMemory(call: call, result: result)
         default:
             result(FlutterMethodNotImplemented)
         }
     }
     
+    public func detachFromEngine(for registrar: FlutterPluginRegistrar) {
+        if let observer = memoryWarningObserver {
+            NotificationCenter.default.removeObserver(observer)
+            memoryWarningObserver = nil
+        }
+        // Release everything this engine loaded; other engines keep their models
+        let modelIds = Array(modelPaths.keys)
+        modelPaths.removeAll()
+        defaultModelId = 0
+        cancelAllStreams()
+        for modelId in modelIds {
+            llama_stop_generation(modelId)
+        }
+        queue.async {
+            for modelId in modelIds {
+                llama_cpp_bridge_free_model(modelId)
+            }
+        }
+    }
+    
+    // Explicit "modelId" argument, or the model loaded through loadModel
+    private func resolveModelId(_ call: FlutterMethodCall) -> Int32 {
+        if let args = call.arguments as? [String: Any], let modelId = args["modelId"] as? Int {
+            return Int32(modelId)
+        }
+        return defaultModelId
+    }
+    
     // MARK: - FlutterStreamHandler
     
     public func onListen(withArguments arguments: Any?, eventSink events: @escaping FlutterEventSink) -> FlutterError? {
@@ -64,13 +159,59 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
     
     public func onCancel(withArguments arguments: Any?) -> FlutterError? {
         self.eventSink = nil
-        shouldStop = true
+        // The listener went away mid-stream: abort the native requests right away
+        cancelAllStreams()
         return nil
     }
     
+    private func cancelAllStreams() {
+        activeStreamsLock.lock()
+        let streamIds = Array(activeStreams.keys)
+        activeStreamsLock.unlock()
+        for streamId in streamIds {
+            cancelStream(streamId)
+        }
+    }
+    
+    // Lock-free on the native side, safe to call from the main thread
+    private func cancelStream(_ streamId: Int) {
+        activeStreamsLock.lock()
+        let requestId = activeStreams.removeValue(forKey: streamId)
+        activeStreamsLock.unlock()
+        if let requestId = requestId, requestId != 0 {
+            llama_generate_stream_end(requestId)
+        }
+    }
+    
+    // Records the native request of a stream; false if it was cancelled meanwhile
+    private func attachStream(_ streamId: Int, requestId: Int32) -> Bool {
+        activeStreamsLock.lock()
+        defer { activeStreamsLock.unlock() }
+        guard activeStreams[streamId] != nil else {
+            return false
+        }
+        activeStreams[streamId] = requestId
+        return true
+    }
+    
+    private func detachStream(_ streamId: Int) {
+        activeStreamsLock.lock()
+        activeStreams.removeValue(forKey: streamId)
+        activeStreamsLock.unlock()
+    }
+    
     // MARK: - Load Model
     
-    private func loadModel(call: FlutterMethodCall, result: @escaping FlutterResult) {
+    // loadModel replaces the default model and returns true; openModel keeps
+    // it and returns the new model's handle
+    private func loadModel(call: FlutterMethodCall, result: @escaping FlutterResult, asDefault: Bool) {
+        var previousModelId: Int32 = 0
+        if asDefault && defaultModelId != 0 {
+            previousModelId = defaultModelId
+            modelPaths[defaultModelId] = nil
+            defaultModelId = 0
+        }
+        
         queue.async { [weak self] in
             guard let self = self else { return }
             guard let args = call.arguments as? [String: Any],
@@ -88,7 +229,20 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
             let nThreads = args["nThreads"] as? Int ?? 4
             let nGpuLayers = args["nGpuLayers"] as? Int ?? 0
             let contextSize = args["contextSize"] as? Int ?? 2048
+            let initialContextSize = args["initialContextSize"] as? Int ?? 0
             let batchSize = args["batchSize"] as? Int ?? 512
+            let maxSequences = args["maxSequences"] as? Int ?? 4
+            let stepBudget = args["stepBudget"] as? Int ?? 128
+            let cacheReuse = args["cacheReuse"] as? Int ?? 32
+            let sinkTokens = args["sinkTokens"] as? Int ?? 4
+            let recentWindow = args["recentWindow"] as? Int ?? 0
+            let pinnedPrefixes = args["pinnedPrefixes"] as? [String] ?? []
+            let promptCacheDir = args["promptCacheDir"] as? String ?? ""
+            let promptCacheBudgetMb = args["promptCacheBudgetMb"] as? Int ?? 512
+            let sessionSwapMb = args["sessionSwapMb"] as? Int ?? 0
+            let sessionSwapDiskMb = args["sessionSwapDiskMb"] as? Int ?? 512
+            let idleTimeoutSeconds = args["idleTimeoutSeconds"] as? Int ?? 0
+            let responseCacheEntries = args["responseCacheEntries"] as? Int ?? 64
             let useGpu = args["useGpu"] as? Bool ?? true
             let verbose = args["verbose"] as? Bool ?? false
             
@@ -105,26 +259,46 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
                 return
             }
             
-            self.modelPath = modelPath
+            if previousModelId != 0 {
+                llama_cpp_bridge_free_model(previousModelId)
+            }
             
             // Initialize model through llama.cpp C++ bridge
-            let success = llama_init_model(
-                modelPath,
-                Int32(nThreads),
-                Int32(nGpuLayers),
-                Int32(contextSize),
-                Int32(batchSize),
-                useGpu,
-                verbose
-            )
-            
-            self.modelLoaded = success
+            let modelId = withCStringArray(pinnedPrefixes) { pinned, nPinned in
+                llama_init_model(
+                    modelPath,
+                    Int32(nThreads),
+                    Int32(nGpuLayers),
+                    Int32(contextSize),
+                    Int32(initialContextSize),
+                    Int32(batchSize),
+                    Int32(maxSequences),
+                    Int32(stepBudget),
+                    Int32(cacheReuse),
+                    Int32(sinkTokens),
+                    Int32(recentWindow),
+                    pinned,
+                    nPinned,
+                    promptCacheDir,
+                    Int32(promptCacheBudgetMb),
+                    Int32(sessionSwapMb),
+                    Int32(sessionSwapDiskMb),
+                    Int32(idleTimeoutSeconds),
+                    Int32(responseCacheEntries),
+                    useGpu,
+                    verbose
+                )
+            }
             
             DispatchQueue.main.async {
-                if success {
-                    NSLog("[FlutterLlama] Model loaded: \(modelPath)")
+                if modelId != 0 {
+                    self.modelPaths[modelId] = modelPath
+                    if asDefault {
+                        self.defaultModelId = modelId
+                    }
+                    NSLog("[FlutterLlama] Model loaded: \(modelPath) (id \(modelId))")
                     NSLog("[FlutterLlama] GPU layers: \(nGpuLayers), threads: \(nThreads), context: \(contextSize)")
-                    result(true)
+                    result(asDefault ? true : Int(modelId))
                 } else {
                     result(FlutterError(
                         code: "INIT_FAILED",
@@ -136,10 +310,126 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
         }
     }
     
+    // MARK: - Create Context
+    
+    // New handle with its own context over the weights of "modelId"
+    private func createContext(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let sourceId = resolveModelId(call)
+        guard let modelPath = modelPaths[sourceId] else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
+        
+        let args = call.arguments as? [String: Any] ?? [:]
+        let nThreads = args["nThreads"] as? Int ?? 4
+        let contextSize = args["contextSize"] as? Int ?? 2048
+        let initialContextSize = args["initialContextSize"] as? Int ?? 0
+        let batchSize = args["batchSize"] as? Int ?? 512
+        let maxSequences = args["maxSequences"] as? Int ?? 4
+        let stepBudget = args["stepBudget"] as? Int ?? 128
+        let cacheReuse = args["cacheReuse"] as? Int ?? 32
+        let sinkTokens = args["sinkTokens"] as? Int ?? 4
+        let recentWindow = args["recentWindow"] as? Int ?? 0
+        let pinnedPrefixes = args["pinnedPrefixes"] as? [String] ?? []
+        let promptCacheDir = args["promptCacheDir"] as? String ?? ""
+        let promptCacheBudgetMb = args["promptCacheBudgetMb"] as? Int ?? 512
+        let sessionSwapMb = args["sessionSwapMb"] as? Int ?? 0
+        let sessionSwapDiskMb = args["sessionSwapDiskMb"] as? Int ?? 512
+        let idleTimeoutSeconds = args["idleTimeoutSeconds"] as? Int ?? 0
+        let responseCacheEntries = args["responseCacheEntries"] as? Int ?? 64
+        let embeddings = args["embeddings"] as? Bool ?? false
+        
+        queue.async {
+            let modelId = withCStringArray(pinnedPrefixes) { pinned, nPinned in
+                llama_create_context(
+                    sourceId,
+                    Int32(nThreads),
+                    Int32(contextSize),
+                    Int32(initialContextSize),
+                    Int32(batchSize),
+                    Int32(maxSequences),
+                    Int32(stepBudget),
+                    Int32(cacheReuse),
+                    Int32(sinkTokens),
+                    Int32(recentWindow),
+                    pinned,
+                    nPinned,
+                    promptCacheDir,
+                    Int32(promptCacheBudgetMb),
+                    Int32(sessionSwapMb),
+                    Int32(sessionSwapDiskMb),
+                    Int32(idleTimeoutSeconds),
+                    Int32(responseCacheEntries),
+                    embeddings
+                )
+            }
+            
+            DispatchQueue.main.async {
+                if modelId != 0 {
+                    self.modelPaths[modelId] = modelPath
+                    NSLog("[FlutterLlama] Context \(modelId) created over model \(sourceId) (embeddings: \(embeddings))")
+                    result(Int(modelId))
+                } else {
+                    result(FlutterError(
+                        code: "INIT_FAILED",
+                        message: "Failed to create context",
+                        details: nil
+                    ))
+                }
+            }
+        }
+    }
+    
+    // MARK: - Embed
+    
+    private func embed(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
+        
+        guard let args = call.arguments as? [String: Any],
+              let text = args["text"] as? String else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing text",
+                details: nil
+            ))
+            return
+        }
+        
+        generationQueue.async {
+            var embedding = [Float](repeating: 0, count: Int(llama_embedding_size(modelId)))
+            let written = llama_embed(modelId, text, &embedding, Int32(embedding.count))
+            
+            DispatchQueue.main.async {
+                if written >= 0 {
+                    result(embedding.prefix(Int(written)).map { Double($0) })
+                } else {
+                    result(FlutterError(
+                        code: "EMBEDDING_FAILED",
+                        message: "Failed to embed text",
+                        details: nil
+                    ))
+                }
+            }
+        }
+    }
+    
     // MARK: - Generate (blocking)
     
     private func generate(call: FlutterMethodCall, result: @escaping FlutterResult) {
-        guard modelLoaded else {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
             result(FlutterError(
                 code: "MODEL_NOT_LOADED",
                 message: "Model not loaded",
@@ -148,7 +438,7 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
             return
         }
         
-        queue.async { [weak self] in
+        generationQueue.async { [weak self] in
             guard let self = self else { return }
             guard let args = call.arguments as? [String: Any],
                   let prompt = args["prompt"] as? String else {
@@ -167,25 +457,32 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
             let topK = (args["topK"] as? Int) ?? 40
             let maxTokens = (args["maxTokens"] as? Int) ?? 512
             let repeatPenalty = (args["repeatPenalty"] as? Double) ?? 1.1
+            let sessionId = (args["sessionId"] as? String) ?? ""
+            let stopSequences = args["stopSequences"] as? [String] ?? []
             
-            self.shouldStop = false
             let startTime = Date()
             
             // Generate through llama.cpp C++ bridge
             var outputBuffer = [CChar](repeating: 0, count: 16384)
             var tokensGenerated: Int32 = 0
             
-            let success = llama_generate(
-                prompt,
-                Float(temperature),
-                Float(topP),
-                Int32(topK),
-                Int32(maxTokens),
-                Float(repeatPenalty),
-                &outputBuffer,
-                Int32(outputBuffer.count),
-                &tokensGenerated
-            )
+            let success = withCStringArray(stopSequences) { stops, nStops in
+                llama_generate(
+                    modelId,
+                    prompt,
+                    Float(temperature),
+                    Float(topP),
+                    Int32(topK),
+                    Int32(maxTokens),
+                    Float(repeatPenalty),
+                    sessionId,
+                    stops,
+                    nStops,
+                    &outputBuffer,
+                    Int32(outputBuffer.count),
+                    &tokensGenerated
+                )
+            }
             
             let generationTime = Int(Date().timeIntervalSince(startTime) * 1000)
             
@@ -212,8 +509,11 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
     
     // MARK: - Generate Stream
     
+    // Every event carries the "streamId" the call was made with, so any
+    // number of streams can share the event channel
     private func generateStream(call: FlutterMethodCall, result: @escaping FlutterResult) {
-        guard modelLoaded else {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
             result(FlutterError(
                 code: "MODEL_NOT_LOADED",
                 message: "Model not loaded",
@@ -231,10 +531,22 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
             return
         }
         
-        queue.async { [weak self] in
+        let streamId: Int
+        if let args = call.arguments as? [String: Any], let id = args["streamId"] as? Int {
+            streamId = id
+        } else {
+            streamId = nextLocalStreamId
+            nextLocalStreamId -= 1
+        }
+        activeStreamsLock.lock()
+        activeStreams[streamId] = 0
+        activeStreamsLock.unlock()
+        
+        generationQueue.async { [weak self] in
             guard let self = self else { return }
             guard let args = call.arguments as? [String: Any],
                   let prompt = args["prompt"] as? String else {
+                self.detachStream(streamId)
                 DispatchQueue.main.async {
                     result(FlutterError(
                         code: "INVALID_ARGS",
@@ -250,84 +562,471 @@ public class FlutterLlamaPlugin: NSObject, FlutterPlugin, FlutterStreamHandler {
             let topK = (args["topK"] as? Int) ?? 40
             let maxTokens = (args["maxTokens"] as? Int) ?? 512
             let repeatPenalty = (args["repeatPenalty"] as? Double) ?? 1.1
+            let sessionId = (args["sessionId"] as? String) ?? ""
+            let stopSequences = args["stopSequences"] as? [String] ?? []
             
-            self.shouldStop = false
+            // Queue the request with the native scheduler
+            let requestId = withCStringArray(stopSequences) { stops, nStops in
+                llama_generate_stream_init(
+                    modelId,
+                    prompt,
+                    Float(temperature),
+                    Float(topP),
+                    Int32(topK),
+                    Int32(maxTokens),
+                    Float(repeatPenalty),
+                    sessionId,
+                    stops,
+                    nStops
+                )
+            }
             
-            // Initialize streaming generation
-            llama_generate_stream_init(
-                prompt,
-                Float(temperature),
-                Float(topP),
-                Int32(topK),
-                Int32(maxTokens),
-                Float(repeatPenalty)
-            )
+            // Cancelled while the request was being queued
+            if requestId != 0 && !self.attachStream(streamId, requestId: requestId) {
+                llama_generate_stream_end(requestId)
+            }
             
-            // Stream tokens one by one
+            // Stream prefill progress and tokens as the native scheduler produces them
             var tokenBuffer = [CChar](repeating: 0, count: 256)
-            while !self.shouldStop {
-                let hasMore = llama_generate_stream_next(&tokenBuffer, Int32(tokenBuffer.count))
+            var prefilled: Int32 = 0
+            var total: Int32 = 0
+            streamLoop: while requestId != 0 {
+                let eventType = llama_generate_stream_next(requestId, &tokenBuffer, Int32(tokenBuffer.count), &prefilled, &total)
                 
-                if hasMore {
-                    let token = String(cString: tokenBuffer)
+                switch eventType {
+                case 1:
+                    let token: [String: Any] = [
+                        "streamId": streamId,
+                        "type": "token",
+                        "text": String(cString: tokenBuffer)
+                    ]
                     DispatchQueue.main.async {
                         eventSink(token)
                     }
-                } else {
-                    break
+                case 2:
+                    let progress: [String: Any] = [
+                        "streamId": streamId,
+                        "type": "prefillProgress",
+                        "prefilled": Int(prefilled),
+                        "total": Int(total)
+                    ]
+                    DispatchQueue.main.async {
+                        eventSink(progress)
+                    }
+                default:
+                    break streamLoop
                 }
             }
             
-            llama_generate_stream_end()
+            self.detachStream(streamId)
+            if requestId != 0 {
+                llama_generate_stream_end(requestId)
+            }
             
             DispatchQueue.main.async {
-                eventSink(FlutterEndOfEventStream)
-                result(nil)
+                eventSink(["streamId": streamId, "type": "done"])
+                if requestId != 0 {
+                    result(nil)
+                } else {
+                    result(FlutterError(
+                        code: "GENERATION_FAILED",
+                        message: "Failed to start streaming",
+                        details: nil
+                    ))
+                }
             }
         }
     }
     
     // MARK: - Unload Model
     
-    private func unloadModel(result: @escaping FlutterResult) {
-        if modelLoaded {
-            llama_cpp_bridge_free_model()
-            modelLoaded = false
-            modelPath = nil
-            NSLog("[FlutterLlama] Model unloaded")
+    private func unloadModel(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        if modelPaths.removeValue(forKey: modelId) != nil {
+            if modelId == defaultModelId {
+                defaultModelId = 0
+            }
+            // Cancels its running requests; their threads return right away
+            llama_stop_generation(modelId)
+            queue.async {
+                llama_cpp_bridge_free_model(modelId)
+                NSLog("[FlutterLlama] Model \(modelId) unloaded")
+            }
         }
         result(nil)
     }
     
-    // MARK: - Get Model Info
+    // MARK: - Conversations
+    
+    private func createConversation(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
+        // Reloads a model unloaded under memory pressure
+        generationQueue.async {
+            let conversationId = Int(llama_create_conversation(modelId))
+            DispatchQueue.main.async {
+                result(conversationId)
+            }
+        }
+    }
+    
+    // Waits while the conversation generates a reply, so it runs off the main thread
+    private func appendMessage(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        guard let args = call.arguments as? [String: Any],
+              let conversationId = args["conversationId"] as? Int,
+              let role = args["role"] as? String,
+              let content = args["content"] as? String else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing conversationId, role or content",
+                details: nil
+            ))
+            return
+        }
+        
+        generationQueue.async {
+            let conversationId = Int32(conversationId)
+            let ok = llama_append_message(conversationId, role, content)
+            DispatchQueue.main.async {
+                result(ok)
+            }
+        }
+    }
+    
+    private func generateReply(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        guard let args = call.arguments as? [String: Any],
+              let conversationId = args["conversationId"] as? Int else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing conversationId",
+                details: nil
+            ))
+            return
+        }
+        
+        let temperature = (args["temperature"] as? Double) ?? 0.8
+        let topP = (args["topP"] as? Double) ?? 0.95
+        let topK = (args["topK"] as? Int) ?? 40
+        let maxTokens = (args["maxTokens"] as? Int) ?? 512
+        let repeatPenalty = (args["repeatPenalty"] as? Double) ?? 1.1
+        let stopSequences = args["stopSequences"] as? [String] ?? []
+        
+        generationQueue.async {
+            let startTime = Date()
+            var outputBuffer = [CChar](repeating: 0, count: 16384)
+            var tokensGenerated: Int32 = 0
+            
+            let success = withCStringArray(stopSequences) { stops, nStops in
+                llama_generate_reply(
+                    Int32(conversationId),
+                    Float(temperature),
+                    Float(topP),
+                    Int32(topK),
+                    Int32(maxTokens),
+                    Float(repeatPenalty),
+                    stops,
+                    nStops,
+                    &outputBuffer,
+                    Int32(outputBuffer.count),
+                    &tokensGenerated
+                )
+            }
+            
+            let generationTime = Int(Date().timeIntervalSince(startTime) * 1000)
+            
+            DispatchQueue.main.async {
+                if success {
+                    result([
+                        "text": String(cString: outputBuffer),
+                        "tokensGenerated": Int(tokensGenerated),
+                        "generationTimeMs": generationTime
+                    ] as [String: Any])
+                } else {
+                    result(FlutterError(
+                        code: "GENERATION_FAILED",
+                        message: "Failed to generate reply",
+                        details: nil
+                    ))
+                }
+            }
+        }
+    }
+    
+    // These wait for a reply being generated as well
+    private func checkpointConversation(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        guard let args = call.arguments as? [String: Any],
+              let conversationId = args["conversationId"] as? Int else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing conversationId",
+                details: nil
+            ))
+            return
+        }
+        
+        generationQueue.async {
+            let checkpoint = llama_checkpoint_conversation(Int32(conversationId))
+            DispatchQueue.main.async {
+                result(Int(checkpoint))
+            }
+        }
+    }
     
-    private func getModelInfo(result: @escaping FlutterResult) {
-        guard modelLoaded, let modelPath = modelPath else {
+    private func rollbackConversation(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        guard let args = call.arguments as? [String: Any],
+              let conversationId = args["conversationId"] as? Int,
+              let checkpoint = args["checkpoint"] as? Int else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing conversationId or checkpoint",
+                details: nil
+            ))
+            return
+        }
+        
+        generationQueue.async {
+            let ok = llama_rollback_conversation(Int32(conversationId), Int32(checkpoint))
+            DispatchQueue.main.async {
+                result(ok)
+            }
+        }
+    }
+    
+    private func forkConversation(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        guard let args = call.arguments as? [String: Any],
+              let conversationId = args["conversationId"] as? Int else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing conversationId",
+                details: nil
+            ))
+            return
+        }
+        let checkpoint = (args["checkpoint"] as? Int) ?? -1
+        
+        generationQueue.async {
+            let forkId = llama_fork_conversation(Int32(conversationId), Int32(checkpoint))
+            DispatchQueue.main.async {
+                result(Int(forkId))
+            }
+        }
+    }
+    
+    private func closeConversation(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        guard let args = call.arguments as? [String: Any],
+              let conversationId = args["conversationId"] as? Int else {
             result(nil)
             return
         }
         
-        var nParams: Int64 = 0
-        var nLayers: Int32 = 0
-        var contextSize: Int32 = 0
+        generationQueue.async {
+            llama_free_conversation(Int32(conversationId))
+            DispatchQueue.main.async {
+                result(nil)
+            }
+        }
+    }
+    
+    // MARK: - Prepare
+    
+    // Called on every keystroke: in order, and never waiting on the main
+    // thread for the model lock
+    private func prepare(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
         
-        llama_get_model_info(&nParams, &nLayers, &contextSize)
+        guard let args = call.arguments as? [String: Any],
+              let sessionId = args["sessionId"] as? String,
+              let text = args["text"] as? String else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing sessionId or text",
+                details: nil
+            ))
+            return
+        }
         
-        let info: [String: Any] = [
-            "modelPath": modelPath,
-            "nParams": nParams,
-            "nLayers": nLayers,
-            "contextSize": contextSize
-        ]
+        queue.async {
+            let ok = llama_prepare(modelId, sessionId, text)
+            DispatchQueue.main.async {
+                result(ok)
+            }
+        }
+    }
+    
+    // MARK: - Sessions
+    
+    // Both directions do file I/O and wait for the scheduler to reach a step
+    // boundary, so they run off the main thread
+    private func saveSession(call: FlutterMethodCall, result: @escaping FlutterResult, restore: Bool) {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
+        
+        guard let args = call.arguments as? [String: Any],
+              let sessionId = args["sessionId"] as? String,
+              let path = args["path"] as? String else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing sessionId or path",
+                details: nil
+            ))
+            return
+        }
         
-        result(info)
+        generationQueue.async {
+            let ok = restore
+                ? llama_restore_session(modelId, sessionId, path)
+                : llama_save_session(modelId, sessionId, path)
+            
+            DispatchQueue.main.async {
+                NSLog("[FlutterLlama] Session \(sessionId) \(restore ? "restore" : "save"): \(ok)")
+                result(ok)
+            }
+        }
+    }
+    
+    // MARK: - Document Library
+    
+    // Prefills every new chunk, so it runs off the main thread
+    private func addDocuments(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
+        
+        guard let args = call.arguments as? [String: Any],
+              let path = args["path"] as? String,
+              let chunks = args["chunks"] as? [String] else {
+            result(FlutterError(
+                code: "INVALID_ARGS",
+                message: "Missing path or chunks",
+                details: nil
+            ))
+            return
+        }
+        
+        generationQueue.async {
+            let added = withCStringArray(chunks) { texts, nTexts in
+                llama_add_documents(modelId, path, texts, nTexts)
+            }
+            
+            DispatchQueue.main.async {
+                NSLog("[FlutterLlama] Added \(added) documents to \(path)")
+                result(Int(added))
+            }
+        }
+    }
+    
+    private func useDocumentLibrary(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        guard modelPaths[modelId] != nil else {
+            result(FlutterError(
+                code: "MODEL_NOT_LOADED",
+                message: "Model not loaded",
+                details: nil
+            ))
+            return
+        }
+        
+        let path = (call.arguments as? [String: Any])?["path"] as? String ?? ""
+        generationQueue.async {
+            let ok = llama_use_document_library(modelId, path)
+            DispatchQueue.main.async {
+                result(ok)
+            }
+        }
+    }
+    
+    // MARK: - Get Model Info
+    
+    private func getModelInfo(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        guard let modelPath = modelPaths[modelId] else {
+            result(nil)
+            return
+        }
+        
+        generationQueue.async {
+            var nParams: Int64 = 0
+            var nLayers: Int32 = 0
+            var contextSize: Int32 = 0
+            
+            llama_get_model_info(modelId, &nParams, &nLayers, &contextSize)
+            
+            let info: [String: Any] = [
+                "modelPath": modelPath,
+                "nParams": nParams,
+                "nLayers": nLayers,
+                "contextSize": contextSize
+            ]
+            
+            DispatchQueue.main.async {
+                result(info)
+            }
+        }
     }
     
     // MARK: - Stop Generation
     
-    private func stopGeneration(result: @escaping FlutterResult) {
-        shouldStop = true
-        llama_stop_generation()
+    private func stopGeneration(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let modelId = resolveModelId(call)
+        // Cancels every request on the model
+        llama_stop_generation(modelId)
+        result(nil)
+    }
+    
+    // MARK: - Trim Memory
+    
+    private func trimMemory(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        let level = (call.arguments as? [String: Any])?["level"] as? Int ?? 1
+        generationQueue.async {
+            llama_trim_memory(Int32(level))
+            DispatchQueue.main.async {
+                result(nil)
+            }
+        }
+    }
+    
+    // Waits for the models' scheduler threads, so never on the main thread
+    private func trimMemory(_ level: Int32) {
+        NSLog("[FlutterLlama] Trimming memory, level \(level)")
+        generationQueue.async {
+            llama_trim_memory(level)
+        }
+    }
+    
+    // MARK: - Cancel Stream
+    
+    private func cancelStream(call: FlutterMethodCall, result: @escaping FlutterResult) {
+        if let args = call.arguments as? [String: Any], let streamId = args["streamId"] as? Int {
+            cancelStream(streamId)
+        }
         result(nil)
     }
 }
@@ -341,52 +1040,182 @@ func llama_init_model(
     _ nThreads: Int32,
     _ nGpuLayers: Int32,
     _ contextSize: Int32,
+    _ initialContextSize: Int32,
     _ batchSize: Int32,
+    _ maxSequences: Int32,
+    _ stepBudget: Int32,
+    _ cacheReuse: Int32,
+    _ sinkTokens: Int32,
+    _ recentWindow: Int32,
+    _ pinnedPrefixes: UnsafePointer<UnsafePointer<CChar>?>?,
+    _ nPinnedPrefixes: Int32,
+    _ promptCacheDir: String,
+    _ promptCacheBudgetMb: Int32,
+    _ sessionSwapMb: Int32,
+    _ sessionSwapDiskMb: Int32,
+    _ idleTimeoutSeconds: Int32,
+    _ responseCacheEntries: Int32,
     _ useGpu: Bool,
     _ verbose: Bool
-) -> Bool
+) -> Int32
+
+@_silgen_name("llama_create_context")
+func llama_create_context(
+    _ sourceModelId: Int32,
+    _ nThreads: Int32,
+    _ contextSize: Int32,
+    _ initialContextSize: Int32,
+    _ batchSize: Int32,
+    _ maxSequences: Int32,
+    _ stepBudget: Int32,
+    _ cacheReuse: Int32,
+    _ sinkTokens: Int32,
+    _ recentWindow: Int32,
+    _ pinnedPrefixes: UnsafePointer<UnsafePointer<CChar>?>?,
+    _ nPinnedPrefixes: Int32,
+    _ promptCacheDir: String,
+    _ promptCacheBudgetMb: Int32,
+    _ sessionSwapMb: Int32,
+    _ sessionSwapDiskMb: Int32,
+    _ idleTimeoutSeconds: Int32,
+    _ responseCacheEntries: Int32,
+    _ embeddings: Bool
+) -> Int32
+
+@_silgen_name("llama_embedding_size")
+func llama_embedding_size(_ modelId: Int32) -> Int32
+
+// Returns the number of floats written, -1 on failure
+@_silgen_name("llama_embed")
+func llama_embed(
+    _ modelId: Int32,
+    _ text: String,
+    _ output: UnsafeMutablePointer<Float>,
+    _ outputSize: Int32
+) -> Int32
 
 @_silgen_name("llama_generate")
 func llama_generate(
+    _ modelId: Int32,
     _ prompt: String,
     _ temperature: Float,
     _ topP: Float,
     _ topK: Int32,
     _ maxTokens: Int32,
     _ repeatPenalty: Float,
+    _ sessionId: String,
+    _ stopSequences: UnsafePointer<UnsafePointer<CChar>?>?,
+    _ nStopSequences: Int32,
     _ output: UnsafeMutablePointer<CChar>,
     _ outputSize: Int32,
     _ tokensGenerated: UnsafeMutablePointer<Int32>
 ) -> Bool
 
+@_silgen_name("llama_create_conversation")
+func llama_create_conversation(_ modelId: Int32) -> Int32
+
+@_silgen_name("llama_append_message")
+func llama_append_message(_ conversationId: Int32, _ role: String, _ content: String) -> Bool
+
+@_silgen_name("llama_generate_reply")
+func llama_generate_reply(
+    _ conversationId: Int32,
+    _ temperature: Float,
+    _ topP: Float,
+    _ topK: Int32,
+    _ maxTokens: Int32,
+    _ repeatPenalty: Float,
+    _ stopSequences: UnsafePointer<UnsafePointer<CChar>?>?,
+    _ nStopSequences: Int32,
+    _ output: UnsafeMutablePointer<CChar>,
+    _ outputSize: Int32,
+    _ tokensGenerated: UnsafeMutablePointer<Int32>
+) -> Bool
+
+@_silgen_name("llama_checkpoint_conversation")
+func llama_checkpoint_conversation(_ conversationId: Int32) -> Int32
+
+@_silgen_name("llama_rollback_conversation")
+func llama_rollback_conversation(_ conversationId: Int32, _ checkpoint: Int32) -> Bool
+
+@_silgen_name("llama_fork_conversation")
+func llama_fork_conversation(_ conversationId: Int32, _ checkpoint: Int32) -> Int32
+
+@_silgen_name("llama_free_conversation")
+func llama_free_conversation(_ conversationId: Int32)
+
 @_silgen_name("llama_generate_stream_init")
 func llama_generate_stream_init(
+    _ modelId: Int32,
     _ prompt: String,
     _ temperature: Float,
     _ topP: Float,
     _ topK: Int32,
     _ maxTokens: Int32,
-    _ repeatPenalty: Float
-)
+    _ repeatPenalty: Float,
+    _ sessionId: String,
+    _ stopSequences: UnsafePointer<UnsafePointer<CChar>?>?,
+    _ nStopSequences: Int32
+) -> Int32
 
+// Returns 0 when the stream is finished, 1 for a token, 2 for prefill progress
 @_silgen_name("llama_generate_stream_next")
 func llama_generate_stream_next(
+    _ requestId: Int32,
     _ output: UnsafeMutablePointer<CChar>,
-    _ outputSize: Int32
-) -> Bool
+    _ outputSize: Int32,
+    _ prefilled: UnsafeMutablePointer<Int32>,
+    _ total: UnsafeMutablePointer<Int32>
+) -> Int32
 
 @_silgen_name("llama_generate_stream_end")
-func llama_generate_stream_end()
+func llama_generate_stream_end(_ requestId: Int32)
+
+@_silgen_name("llama_prepare")
+func llama_prepare(_ modelId: Int32, _ sessionId: String, _ text: String) -> Bool
+
+@_silgen_name("llama_save_session")
+func llama_save_session(_ modelId: Int32, _ sessionId: String, _ path: String) -> Bool
+
+@_silgen_name("llama_restore_session")
+func llama_restore_session(_ modelId: Int32, _ sessionId: String, _ path: String) -> Bool
+
+@_silgen_name("llama_add_documents")
+func llama_add_documents(
+    _ modelId: Int32,
+    _ path: String,
+    _ texts: UnsafePointer<UnsafePointer<CChar>?>?,
+    _ nTexts: Int32
+) -> Int32
+
+@_silgen_name("llama_use_document_library")
+func llama_use_document_library(_ modelId: Int32, _ path: String) -> Bool
 
 @_silgen_name("llama_get_model_info")
 func llama_get_model_info(
+    _ modelId: Int32,
     _ nParams: UnsafeMutablePointer<Int64>,
     _ nLayers: UnsafeMutablePointer<Int32>,
     _ contextSize: UnsafeMutablePointer<Int32>
 )
 
-@_silgen_name("llama_free_model")
-func llama_cpp_bridge_free_model()
+@_silgen_name("llama_cpp_bridge_free_model")
+func llama_cpp_bridge_free_model(_ modelId: Int32)
 
 @_silgen_name("llama_stop_generation")
-func llama_stop_generation()
+func llama_stop_generation(_ modelId: Int32)
+
+// 1: caches, 2: idle sessions too, 3: unload idle models
+@_silgen_name("llama_trim_memory")
+func llama_trim_memory(_ level: Int32)
+
+// Hands strings to C as a `const char* const*` array that lives for the call
+private func withCStringArray<R>(
+    _ strings: [String],
+    _ body: (UnsafePointer<UnsafePointer<CChar>?>?, Int32) -> R
+) -> R {
+    let copies = strings.map { strdup($0) }
+    defer { copies.forEach { free($0) } }
+    let pointers = copies.map { UnsafePointer($0) }
+    return pointers.withUnsafeBufferPointer { body($0.baseAddress, Int32($0.count)) }
+}
@@ -1,377 +1,371 @@
 /*
  * Flutter Llama - llama.cpp Bridge for iOS
  * 
- * This file provides a C++ bridge between Swift and llama.cpp
- * Updated for latest llama.cpp API
+ * This file provides the C entry points Swift calls into the shared
+ * llama.cpp engine in src/llama_engine.cpp
  */
 
 #import <Foundation/Foundation.h>
 #include <string>
+#include <cstring>
+#include <algorithm>
 #include <vector>
-#include <mutex>
 
-// Include llama.cpp headers
-#include "../../llama.cpp/include/llama.h"
+#include "../../src/llama_engine.h"
 
-// Global state
-static llama_model* g_model = nullptr;
-static llama_context* g_context = nullptr;
-static const llama_vocab* g_vocab = nullptr;
-static llama_sampler* g_sampler = nullptr;
-static std::mutex g_mutex;
-static bool g_should_stop = false;
-static std::vector<std::string> g_stream_tokens;
-static size_t g_stream_pos = 0;
+static void copy_to_buffer(const std::string& value, char* output, int32_t output_size) {
+    size_t copy_len = std::min(value.length(), (size_t)(output_size - 1));
+    memcpy(output, value.c_str(), copy_len);
+    output[copy_len] = '\0';
+}
+
+static flutter_llama::GenerationParams make_generation_params(
+    const char* prompt,
+    float temperature,
+    float top_p,
+    int32_t top_k,
+    int32_t max_tokens,
+    float repeat_penalty,
+    const char* session_id,
+    const char* const* stop_sequences,
+    int32_t n_stop_sequences
+) {
+    flutter_llama::GenerationParams params;
+    params.prompt = prompt;
+    params.temperature = temperature;
+    params.top_p = top_p;
+    params.top_k = top_k;
+    params.max_tokens = max_tokens;
+    params.repeat_penalty = repeat_penalty;
+    if (session_id) {
+        params.session_id = session_id;
+    }
+    params.stop_sequences.assign(stop_sequences, stop_sequences + n_stop_sequences);
+    return params;
+}
 
 extern "C" {
 
-// Initialize and load model
-bool llama_init_model(
+// Load a model and return its handle (0 on failure)
+int32_t llama_init_model(
     const char* model_path,
     int32_t n_threads,
     int32_t n_gpu_layers,
     int32_t context_size,
+    int32_t initial_context_size,
     int32_t batch_size,
+    int32_t max_sequences,
+    int32_t step_budget,
+    int32_t cache_reuse,
+    int32_t sink_tokens,
+    int32_t recent_window,
+    const char* const* pinned_prefixes,
+    int32_t n_pinned_prefixes,
+    const char* prompt_cache_dir,
+    int32_t prompt_cache_budget_mb,
+    int32_t session_swap_mb,
+    int32_t session_swap_disk_mb,
+    int32_t idle_timeout_s,
+    int32_t response_cache_entries,
     bool use_gpu,
     bool verbose
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
     NSLog(@"[llama_cpp_bridge] Initializing model: %s", model_path);
-    NSLog(@"[llama_cpp_bridge] Threads: %d, GPU layers: %d, Context: %d", 
-          n_threads, n_gpu_layers, context_size);
     
-    // Free existing model if any
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
+    flutter_llama::ModelParams params;
+    params.model_path = model_path;
+    params.n_threads = n_threads;
+    params.n_gpu_layers = n_gpu_layers;
+    params.context_size = context_size;
+    params.initial_context_size = initial_context_size;
+    params.batch_size = batch_size;
+    params.max_sequences = max_sequences;
+    params.step_budget = step_budget;
+    params.cache_reuse = cache_reuse;
+    params.sink_tokens = sink_tokens;
+    params.recent_window = recent_window;
+    params.pinned_prefixes.assign(pinned_prefixes, pinned_prefixes + n_pinned_prefixes);
+    if (prompt_cache_dir) {
+        params.prompt_cache_dir = prompt_cache_dir;
     }
-    if (g_context) {
-        llama_free(g_context);
-        g_context = nullptr;
-    }
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-    }
-    
-    // Load dynamic backends
-    ggml_backend_load_all();
-    
-    // Set up model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = use_gpu ? n_gpu_layers : 0;
-    
-    // Load model
-    g_model = llama_model_load_from_file(model_path, model_params);
-    if (!g_model) {
-        NSLog(@"[llama_cpp_bridge] Failed to load model from: %s", model_path);
-        return false;
+    params.prompt_cache_budget_mb = prompt_cache_budget_mb;
+    params.session_swap_mb = session_swap_mb;
+    params.session_swap_disk_mb = session_swap_disk_mb;
+    params.idle_timeout_s = idle_timeout_s;
+    params.response_cache_entries = response_cache_entries;
+    params.use_gpu = use_gpu;
+    params.verbose = verbose;
+    
+    return flutter_llama::load_model(params);
+}
+
+// Create another context over a loaded model's weights; returns its handle (0 on failure)
+int32_t llama_create_context(
+    int32_t source_handle,
+    int32_t n_threads,
+    int32_t context_size,
+    int32_t initial_context_size,
+    int32_t batch_size,
+    int32_t max_sequences,
+    int32_t step_budget,
+    int32_t cache_reuse,
+    int32_t sink_tokens,
+    int32_t recent_window,
+    const char* const* pinned_prefixes,
+    int32_t n_pinned_prefixes,
+    const char* prompt_cache_dir,
+    int32_t prompt_cache_budget_mb,
+    int32_t session_swap_mb,
+    int32_t session_swap_disk_mb,
+    int32_t idle_timeout_s,
+    int32_t response_cache_entries,
+    bool embeddings
+) {
+    flutter_llama::ContextParams params;
+    params.n_threads = n_threads;
+    params.context_size = context_size;
+    params.initial_context_size = initial_context_size;
+    params.batch_size = batch_size;
+    params.max_sequences = max_sequences;
+    params.step_budget = step_budget;
+    params.cache_reuse = cache_reuse;
+    params.sink_tokens = sink_tokens;
+    params.recent_window = recent_window;
+    params.pinned_prefixes.assign(pinned_prefixes, pinned_prefixes + n_pinned_prefixes);
+    if (prompt_cache_dir) {
+        params.prompt_cache_dir = prompt_cache_dir;
     }
-    
-    // Get vocab
-    g_vocab = llama_model_get_vocab(g_model);
-    
-    // Create context
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = context_size;
-    ctx_params.n_batch = batch_size;
-    ctx_params.n_threads = n_threads;
-    ctx_params.n_threads_batch = n_threads;
-    
-    g_context = llama_init_from_model(g_model, ctx_params);
-    if (!g_context) {
-        NSLog(@"[llama_cpp_bridge] Failed to create context");
-        llama_model_free(g_model);
-        g_model = nullptr;
-        return false;
+    params.prompt_cache_budget_mb = prompt_cache_budget_mb;
+    params.session_swap_mb = session_swap_mb;
+    params.session_swap_disk_mb = session_swap_disk_mb;
+    params.idle_timeout_s = idle_timeout_s;
+    params.response_cache_entries = response_cache_entries;
+    params.embeddings = embeddings;
+    
+    return flutter_llama::create_context(source_handle, params);
+}
+
+// Length of the vectors llama_embed writes
+int32_t llama_embedding_size(int32_t handle) {
+    return flutter_llama::embedding_size(handle);
+}
+
+// Embed text with an embedding context. Returns the number of floats
+// written to output, or -1 on failure.
+int32_t llama_embed(
+    int32_t handle,
+    const char* text,
+    float* output,
+    int32_t output_size
+) {
+    std::vector<float> embedding;
+    if (!flutter_llama::embed(handle, text, embedding)) {
+        return -1;
     }
     
-    // Initialize sampler chain
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false;
-    g_sampler = llama_sampler_chain_init(sparams);
-    
-    // Add samplers
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(0.8f));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(0.95f, 1));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
-    
-    NSLog(@"[llama_cpp_bridge] Model loaded successfully");
-    NSLog(@"[llama_cpp_bridge] Context size: %d", llama_n_ctx(g_context));
-    
-    return true;
+    const int32_t n = std::min((int32_t)embedding.size(), output_size);
+    std::copy(embedding.begin(), embedding.begin() + n, output);
+    return n;
 }
 
 // Generate text
 bool llama_generate(
+    int32_t handle,
     const char* prompt,
     float temperature,
     float top_p,
     int32_t top_k,
     int32_t max_tokens,
     float repeat_penalty,
+    const char* session_id,
+    const char* const* stop_sequences,
+    int32_t n_stop_sequences,
     char* output,
     int32_t output_size,
     int32_t* tokens_generated
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_model || !g_context || !g_vocab) {
-        NSLog(@"[llama_cpp_bridge] Model not loaded");
-        return false;
-    }
-    
-    NSLog(@"[llama_cpp_bridge] Generating with prompt: %.50s...", prompt);
+    flutter_llama::GenerationParams params = make_generation_params(
+        prompt, temperature, top_p, top_k, max_tokens, repeat_penalty, session_id, stop_sequences, n_stop_sequences);
     
-    std::string prompt_text(prompt);
-    
-    // Tokenize prompt
-    const int n_prompt = -llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), NULL, 0, true, true);
-    std::vector<llama_token> prompt_tokens(n_prompt);
-    
-    if (llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), prompt_tokens.data(), prompt_tokens.size(), true, true) < 0) {
-        NSLog(@"[llama_cpp_bridge] Failed to tokenize prompt");
-        return false;
-    }
-    
-    // Create batch
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    
-    // Decode prompt
-    if (llama_decode(g_context, batch) != 0) {
-        NSLog(@"[llama_cpp_bridge] Failed to decode prompt");
+    std::string result;
+    int32_t n_gen = 0;
+    if (!flutter_llama::generate(handle, params, result, n_gen)) {
         return false;
     }
     
-    // Update sampler with new parameters
-    llama_sampler_free(g_sampler);
-    
-    auto sparams = llama_sampler_chain_default_params();
-    g_sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(top_p, 1));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(top_k));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
+    copy_to_buffer(result, output, output_size);
+    *tokens_generated = n_gen;
     
-    // Generate tokens
+    NSLog(@"[llama_cpp_bridge] Generated %d tokens", n_gen);
+    return true;
+}
+
+// Start a natively kept chat history on a model; returns its id (0 on failure)
+int32_t llama_create_conversation(int32_t handle) {
+    return flutter_llama::create_conversation(handle);
+}
+
+bool llama_append_message(int32_t conversation, const char* role, const char* content) {
+    return flutter_llama::append_message(conversation, role, content);
+}
+
+// Generate the assistant's next message of a conversation
+bool llama_generate_reply(
+    int32_t conversation,
+    float temperature,
+    float top_p,
+    int32_t top_k,
+    int32_t max_tokens,
+    float repeat_penalty,
+    const char* const* stop_sequences,
+    int32_t n_stop_sequences,
+    char* output,
+    int32_t output_size,
+    int32_t* tokens_generated
+) {
+    flutter_llama::GenerationParams params;
+    params.temperature = temperature;
+    params.top_p = top_p;
+    params.top_k = top_k;
+    params.max_tokens = max_tokens;
+    params.repeat_penalty = repeat_penalty;
+    params.stop_sequences.assign(stop_sequences, stop_sequences + n_stop_sequences);
+
     std::string result;
-    int n_gen = 0;
-    int n_pos = prompt_tokens.size();
-    
-    g_should_stop = false;
-    
-    for (int i = 0; i < max_tokens; i++) {
-        if (g_should_stop) {
-            NSLog(@"[llama_cpp_bridge] Generation stopped by user");
-            break;
-        }
-        
-        // Sample next token
-        llama_token new_token = llama_sampler_sample(g_sampler, g_context, -1);
-        
-        // Check for EOS
-        if (llama_vocab_is_eog(g_vocab, new_token)) {
-            NSLog(@"[llama_cpp_bridge] EOS token reached");
-            break;
-        }
-        
-        // Convert token to text
-        char token_str[256] = {0};
-        int n = llama_token_to_piece(g_vocab, new_token, token_str, sizeof(token_str) - 1, 0, true);
-        if (n > 0) {
-            token_str[n] = '\0';
-            result.append(token_str);
-        }
-        
-        // Prepare for next iteration
-        batch = llama_batch_get_one(&new_token, 1);
-        n_pos++;
-        
-        if (llama_decode(g_context, batch) != 0) {
-            NSLog(@"[llama_cpp_bridge] Failed to decode token");
-            break;
-        }
-        
-        n_gen++;
+    int32_t n_gen = 0;
+    if (!flutter_llama::generate_reply(conversation, params, result, n_gen)) {
+        return false;
     }
-    
-    // Copy result
-    size_t copy_len = std::min(result.length(), (size_t)(output_size - 1));
-    memcpy(output, result.c_str(), copy_len);
-    output[copy_len] = '\0';
+
+    copy_to_buffer(result, output, output_size);
     *tokens_generated = n_gen;
-    
-    NSLog(@"[llama_cpp_bridge] Generated %d tokens", n_gen);
     return true;
 }
 
-// Initialize streaming generation
-void llama_generate_stream_init(
+int32_t llama_checkpoint_conversation(int32_t conversation) {
+    return flutter_llama::checkpoint_conversation(conversation);
+}
+
+bool llama_rollback_conversation(int32_t conversation, int32_t checkpoint) {
+    return flutter_llama::rollback_conversation(conversation, checkpoint);
+}
+
+// Copy a conversation up to a checkpoint (-1: all of it); returns its id (0 on failure)
+int32_t llama_fork_conversation(int32_t conversation, int32_t checkpoint) {
+    return flutter_llama::fork_conversation(conversation, checkpoint);
+}
+
+// Waits for a reply still being generated
+void llama_free_conversation(int32_t conversation) {
+    flutter_llama::free_conversation(conversation);
+}
+
+// Queue a streaming request; returns its id (0 on failure)
+int32_t llama_generate_stream_init(
+    int32_t handle,
     const char* prompt,
     float temperature,
     float top_p,
     int32_t top_k,
     int32_t max_tokens,
-    float repeat_penalty
+    float repeat_penalty,
+    const char* session_id,
+    const char* const* stop_sequences,
+    int32_t n_stop_sequences
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    NSLog(@"[llama_cpp_bridge] Initializing stream generation");
-    
-    if (!g_model || !g_context || !g_vocab) {
-        NSLog(@"[llama_cpp_bridge] Model not loaded");
-        return;
-    }
-    
-    g_should_stop = false;
-    g_stream_tokens.clear();
-    g_stream_pos = 0;
-    
-    std::string prompt_text(prompt);
-    
-    // Tokenize prompt
-    const int n_prompt = -llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), NULL, 0, true, true);
-    std::vector<llama_token> prompt_tokens(n_prompt);
-    
-    if (llama_tokenize(g_vocab, prompt_text.c_str(), prompt_text.size(), prompt_tokens.data(), prompt_tokens.size(), true, true) < 0) {
-        NSLog(@"[llama_cpp_bridge] Failed to tokenize prompt");
-        return;
-    }
-    
-    // Create batch
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
-    
-    // Decode prompt
-    if (llama_decode(g_context, batch) != 0) {
-        NSLog(@"[llama_cpp_bridge] Failed to decode prompt");
-        return;
-    }
-    
-    // Update sampler
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-    }
-    
-    auto sparams = llama_sampler_chain_default_params();
-    g_sampler = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_p(top_p, 1));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_top_k(top_k));
-    llama_sampler_chain_add(g_sampler, llama_sampler_init_dist(1234));
-    
-    // Pre-generate tokens and convert to strings
-    int n_pos = prompt_tokens.size();
-    for (int i = 0; i < max_tokens; i++) {
-        if (g_should_stop) break;
-        
-        llama_token new_token = llama_sampler_sample(g_sampler, g_context, -1);
-        
-        if (llama_vocab_is_eog(g_vocab, new_token)) {
-            break;
-        }
-        
-        // Convert token to text and store
-        char token_str[256] = {0};
-        int n = llama_token_to_piece(g_vocab, new_token, token_str, sizeof(token_str) - 1, 0, true);
-        if (n > 0) {
-            token_str[n] = '\0';
-            g_stream_tokens.push_back(std::string(token_str));
-        }
-        
-        batch = llama_batch_get_one(&new_token, 1);
-        n_pos++;
-        
-        if (llama_decode(g_context, batch) != 0) {
-            break;
-        }
-    }
+    flutter_llama::GenerationParams params = make_generation_params(
+        prompt, temperature, top_p, top_k, max_tokens, repeat_penalty, session_id, stop_sequences, n_stop_sequences);
     
-    NSLog(@"[llama_cpp_bridge] Pre-generated %zu tokens for streaming", g_stream_tokens.size());
+    return flutter_llama::stream_start(handle, params);
 }
 
-// Get next token in stream
-bool llama_generate_stream_next(
+// Get next stream event, blocking until it is available.
+// Returns 0 once generation has finished, 1 for a sampled piece (copied to
+// output) and 2 for prefill progress (written to prefilled/total).
+int32_t llama_generate_stream_next(
+    int32_t request,
     char* output,
-    int32_t output_size
+    int32_t output_size,
+    int32_t* prefilled,
+    int32_t* total
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (g_should_stop || g_stream_pos >= g_stream_tokens.size()) {
-        return false;
+    flutter_llama::StreamEvent event;
+    if (!flutter_llama::stream_next(request, event)) {
+        return 0;
     }
     
-    const std::string& token = g_stream_tokens[g_stream_pos++];
-    
-    size_t copy_len = std::min(token.length(), (size_t)(output_size - 1));
-    memcpy(output, token.c_str(), copy_len);
-    output[copy_len] = '\0';
+    if (event.type == flutter_llama::StreamEventType::PrefillProgress) {
+        *prefilled = event.n_prefilled;
+        *total = event.n_total;
+        return 2;
+    }
     
-    return true;
+    copy_to_buffer(event.text, output, output_size);
+    return 1;
 }
 
-// End streaming generation
-void llama_generate_stream_end() {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    NSLog(@"[llama_cpp_bridge] Ending stream generation");
-    g_stream_tokens.clear();
-    g_stream_pos = 0;
+// End a stream; safe to call from any thread to cancel it
+void llama_generate_stream_end(int32_t request) {
+    flutter_llama::stream_end(request);
+}
+
+// Prefill a partially typed prompt into a session's sequence in the background
+bool llama_prepare(int32_t handle, const char* session_id, const char* text) {
+    return flutter_llama::prepare(handle, session_id, text);
+}
+
+// Save a session's KV cache and token history to a file
+bool llama_save_session(int32_t handle, const char* session_id, const char* path) {
+    return flutter_llama::save_session(handle, session_id, path);
+}
+
+// Restore a session saved with llama_save_session
+bool llama_restore_session(int32_t handle, const char* session_id, const char* path) {
+    return flutter_llama::restore_session(handle, session_id, path);
+}
+
+// Prefill document chunks and append their KV cells to a document library.
+// Returns the number added, -1 on failure.
+int32_t llama_add_documents(int32_t handle, const char* path, const char* const* texts, int32_t n_texts) {
+    return flutter_llama::add_documents(handle, path, std::vector<std::string>(texts, texts + n_texts));
+}
+
+// Splice documents of a library into later prompts; an empty path stops
+bool llama_use_document_library(int32_t handle, const char* path) {
+    return flutter_llama::use_document_library(handle, path);
 }
 
 // Get model information
 void llama_get_model_info(
+    int32_t handle,
     int64_t* n_params,
     int32_t* n_layers,
     int32_t* context_size
 ) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_model || !g_context) {
-        *n_params = 0;
-        *n_layers = 0;
-        *context_size = 0;
-        return;
-    }
+    flutter_llama::ModelInfo info;
+    flutter_llama::get_model_info(handle, info);
     
-    *n_params = llama_model_n_params(g_model);
-    *n_layers = llama_model_n_layer(g_model);
-    *context_size = llama_n_ctx(g_context);
+    *n_params = info.n_params;
+    *n_layers = info.n_layers;
+    *context_size = info.context_size;
 }
 
-// Free model
-void llama_cpp_bridge_free_model() {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    NSLog(@"[llama_cpp_bridge] Freeing model");
-    
-    if (g_sampler) {
-        llama_sampler_free(g_sampler);
-        g_sampler = nullptr;
-    }
-    
-    if (g_context) {
-        llama_free(g_context);
-        g_context = nullptr;
-    }
-    
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-    }
-    
-    g_vocab = nullptr;
-    
-    NSLog(@"[llama_cpp_bridge] Model freed successfully");
+// Release a model handle
+void llama_cpp_bridge_free_model(int32_t handle) {
+    NSLog(@"[llama_cpp_bridge] Releasing model %d", handle);
+    flutter_llama::release_model(handle);
 }
 
 // Stop generation
-void llama_stop_generation() {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
+void llama_stop_generation(int32_t handle) {
     NSLog(@"[llama_cpp_bridge] Stopping generation");
-    g_should_stop = true;
+    flutter_llama::stop_generation(handle);
+}
+
+// Free memory held by all models; blocks until their schedulers have done so
+void llama_trim_memory(int32_t level) {
+    NSLog(@"[llama_cpp_bridge] Trimming memory, level %d", level);
+    flutter_llama::trim_memory(level);
 }
 
 } // extern "C"
@@ -1,8 +1,11 @@
 export 'src/flutter_llama.dart';
 export 'src/flutter_llama_multimodal.dart';
 export 'src/models/llama_config.dart';
+export 'src/models/llama_context_config.dart';
 export 'src/models/llama_response.dart';
 export 'src/models/generation_params.dart';
+export 'src/models/prefill_progress.dart';
+export 'src/models/memory_trim_level.dart';
 export 'src/models/multimodal_input.dart';
 export 'src/models/multimodal_config.dart';
 export 'src/models/multimodal_response.dart';
@@ -2,8 +2,11 @@ import 'dart:async';
 import 'package:flutter/foundation.dart';
 import 'package:flutter/services.dart';
 import 'models/llama_config.dart';
+import 'models/llama_context_config.dart';
 import 'models/generation_params.dart';
 import 'models/llama_response.dart';
+import 'models/prefill_progress.dart';
+import 'models/memory_trim_level.dart';
 import 'models/model_source.dart';
 import 'models/preset_model.dart';
 import 'services/model_manager.dart';
@@ -11,6 +14,15 @@ import 'services/model_manager.dart';
 /// Main class for interacting with llama.cpp models
 class FlutterLlama {
   static const MethodChannel _channel = MethodChannel('flutter_llama');
+  static const EventChannel _eventChannel = EventChannel('flutter_llama/stream');
+
+  // One platform subscription shared by all running streams; events are
+  // routed by their "streamId"
+  static Stream<dynamic>? _streamEvents;
+  static int _nextStreamId = 1;
+
+  static Stream<dynamic> get _events =>
+      _streamEvents ??= _eventChannel.receiveBroadcastStream();
 
   static FlutterLlama? _instance;
   bool _isInitialized = false;
@@ -82,6 +94,10 @@ class FlutterLlama {
       throw StateError('Model not loaded. Call loadModel() first.');
     }
 
+    return _generate(params, null);
+  }
+
+  Future<LlamaResponse> _generate(GenerationParams params, int? modelId) async {
     try {
       if (kDebugMode) {
         print('[FlutterLlama] Generating with params: $params');
@@ -89,7 +105,7 @@ class FlutterLlama {
 
       final result = await _channel.invokeMethod<Map<dynamic, dynamic>>(
         'generate',
-        params.toMap(),
+        _withModelId(params.toMap(), modelId),
       );
 
       if (result == null) {
@@ -113,27 +129,96 @@ class FlutterLlama {
 
   /// Generate text as a stream (token by token)
   /// 
-  /// Returns Stream of strings (individual tokens)
-  Stream<String> generateStream(GenerationParams params) async* {
+  /// Returns Stream of strings (individual tokens). Long prompts are
+  /// prefilled in chunks; [onPrefillProgress] is called after each chunk.
+  Stream<String> generateStream(
+    GenerationParams params, {
+    void Function(PrefillProgress progress)? onPrefillProgress,
+  }) async* {
     if (!_isModelLoaded) {
       throw StateError('Model not loaded. Call loadModel() first.');
     }
 
+    yield* _generateStream(params, null, onPrefillProgress);
+  }
+
+  Stream<String> _generateStream(
+    GenerationParams params,
+    int? modelId,
+    void Function(PrefillProgress progress)? onPrefillProgress,
+  ) async* {
     try {
       if (kDebugMode) {
         print('[FlutterLlama] Streaming generation with params: $params');
       }
 
-      // Set up event channel for streaming
-      final eventChannel = EventChannel('flutter_llama/stream');
-      
-      // Send generation request
-      await _channel.invokeMethod('generateStream', params.toMap());
+      final streamId = _nextStreamId++;
+      final events = StreamController<dynamic>();
+      var finished = false;
 
-      // Listen to token stream
-      await for (final token in eventChannel.receiveBroadcastStream()) {
-        if (token is String) {
-          yield token;
+      // Subscribe before starting generation so no token is missed. Events of
+      // other streams are skipped; untagged ones come from older platform code
+      // that runs a single stream.
+      final subscription = _events.listen(
+        (event) {
+          if (event is Map &&
+              event.containsKey('streamId') &&
+              event['streamId'] != streamId) {
+            return;
+          }
+          events.add(event);
+        },
+        onError: events.addError,
+        onDone: () {
+          _streamEvents = null;
+          events.close();
+        },
+      );
+
+      try {
+        // Send generation request; tokens arrive on the event channel
+        final args = _withModelId(params.toMap(), modelId);
+        args['streamId'] = streamId;
+        unawaited(_channel.invokeMethod('generateStream', args).then<void>(
+          (_) {},
+          onError: (Object e) {
+            if (!events.isClosed) {
+              events.addError(e);
+              events.close();
+            }
+          },
+        ));
+
+        await for (final event in events.stream) {
+          if (event is String) {
+            yield event;
+          } else if (event is Map) {
+            switch (event['type']) {
+              case 'token':
+                yield event['text'] as String;
+              case 'prefillProgress':
+                onPrefillProgress?.call(
+                  PrefillProgress.fromMap(Map<String, dynamic>.from(event)),
+                );
+              case 'error':
+                throw Exception(event['message']);
+              case 'done':
+                finished = true;
+            }
+            if (finished) {
+              break;
+            }
+          }
+        }
+        finished = true;
+      } finally {
+        await subscription.cancel();
+        if (!finished) {
+          // Abandoned early: only this request is cancelled, other streams
+          // on the same model keep running
+          unawaited(_channel
+              .invokeMethod('cancelStream', <String, dynamic>{'streamId': streamId})
+              .then<void>((_) {}, onError: (Object _) {}));
         }
       }
     } catch (e) {
@@ -167,15 +252,256 @@ class FlutterLlama {
     }
   }
 
+  /// Open an additional model next to the one loaded with [loadModel]
+  ///
+  /// Every call returns an independent [LlamaModel] with its own context and
+  /// KV cache. Opening the same GGUF file again shares its weights in memory.
+  /// Returns null if the model could not be loaded.
+  Future<LlamaModel?> openModel(LlamaConfig config) async {
+    try {
+      if (kDebugMode) {
+        print('[FlutterLlama] Opening model: ${config.modelPath}');
+      }
+
+      final id = await _channel.invokeMethod<int>('openModel', config.toMap());
+      if (id == null || id == 0) {
+        return null;
+      }
+
+      if (kDebugMode) {
+        print('[FlutterLlama] Model opened with id $id');
+      }
+
+      return LlamaModel._(this, id, config.modelPath);
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error opening model: $e');
+      }
+      return null;
+    }
+  }
+
+  /// Create another context over the weights of the model loaded with
+  /// [loadModel]
+  ///
+  /// Returns null if no model is loaded or the context could not be created.
+  Future<LlamaModel?> createContext(LlamaContextConfig config) async {
+    if (!_isModelLoaded || _modelPath == null) {
+      return null;
+    }
+    return _createContext(null, _modelPath!, config);
+  }
+
+  Future<LlamaModel?> _createContext(
+    int? modelId,
+    String modelPath,
+    LlamaContextConfig config,
+  ) async {
+    try {
+      final id = await _channel.invokeMethod<int>(
+        'createContext',
+        _withModelId(config.toMap(), modelId),
+      );
+      if (id == null || id == 0) {
+        return null;
+      }
+
+      if (kDebugMode) {
+        print('[FlutterLlama] Context created with id $id: $config');
+      }
+
+      return LlamaModel._(this, id, modelPath, embeddings: config.embeddings);
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error creating context: $e');
+      }
+      return null;
+    }
+  }
+
+  /// Start a chat history kept on the native side
+  ///
+  /// See [LlamaConversation]. Returns null if no model is loaded or it is an
+  /// embedding context.
+  Future<LlamaConversation?> createConversation() async {
+    if (!_isModelLoaded) {
+      throw StateError('Model not loaded. Call loadModel() first.');
+    }
+    return _createConversation(null);
+  }
+
+  Future<LlamaConversation?> _createConversation(int? modelId) async {
+    try {
+      final id = await _channel.invokeMethod<int>(
+        'createConversation',
+        _modelIdArgs(modelId),
+      );
+      if (id == null || id == 0) {
+        return null;
+      }
+      return LlamaConversation._(id);
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error creating conversation: $e');
+      }
+      return null;
+    }
+  }
+
+  /// Prefill [partialText] into the sequence of [sessionId] while the user
+  /// is still typing
+  ///
+  /// Call it on every change of the input with the prompt as it would be
+  /// sent right now (template included). The prefill runs natively in the
+  /// background at low priority and only the tokens that differ from the
+  /// previous call are rolled back; the next `generate`/`generateStream`
+  /// with the same `GenerationParams.sessionId` then has just the rest of
+  /// its prompt left to decode. Returns once the prefill is queued.
+  Future<bool> prepare(String sessionId, String partialText) async {
+    if (!_isModelLoaded) {
+      throw StateError('Model not loaded. Call loadModel() first.');
+    }
+    return _prepare(null, sessionId, partialText);
+  }
+
+  Future<bool> _prepare(int? modelId, String sessionId, String partialText) async {
+    try {
+      final result = await _channel.invokeMethod<bool>(
+        'prepare',
+        _withModelId(
+          <String, dynamic>{'sessionId': sessionId, 'text': partialText},
+          modelId,
+        ),
+      );
+      return result ?? false;
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error preparing session $sessionId: $e');
+      }
+      return false;
+    }
+  }
+
+  /// Save the KV cache and token history of [sessionId] to [path]
+  ///
+  /// The session is the one requests with `GenerationParams.sessionId` ran
+  /// in. Returns false if the model holds no such session.
+  Future<bool> saveSession(String sessionId, String path) async {
+    if (!_isModelLoaded) {
+      throw StateError('Model not loaded. Call loadModel() first.');
+    }
+    return _session('saveSession', null, sessionId, path);
+  }
+
+  /// Restore a session saved with [saveSession]
+  ///
+  /// The next request with the same `sessionId` continues from the restored
+  /// history without prefilling it again. Returns false if the file is
+  /// missing, belongs to another model or no sequence is free.
+  Future<bool> restoreSession(String sessionId, String path) async {
+    if (!_isModelLoaded) {
+      throw StateError('Model not loaded. Call loadModel() first.');
+    }
+    return _session('restoreSession', null, sessionId, path);
+  }
+
+  Future<bool> _session(
+    String method,
+    int? modelId,
+    String sessionId,
+    String path,
+  ) async {
+    try {
+      final result = await _channel.invokeMethod<bool>(
+        method,
+        _withModelId(
+          <String, dynamic>{'sessionId': sessionId, 'path': path},
+          modelId,
+        ),
+      );
+      return result ?? false;
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error in $method: $e');
+      }
+      return false;
+    }
+  }
+
+  /// Precompute the KV cache of document [chunks] into the library at [path]
+  ///
+  /// Each chunk is prefilled once on its own and appended to the library
+  /// (created if missing); chunks it already holds are skipped. The library
+  /// is then used as with [useDocumentLibrary]: a prompt quoting a chunk
+  /// verbatim gets its cells spliced in instead of prefilling it. Chunks are
+  /// computed without the text preceding them in a prompt, so output may
+  /// differ slightly from a full prefill. Returns the number of chunks added,
+  /// -1 on failure.
+  Future<int> addDocuments(String path, List<String> chunks) async {
+    if (!_isModelLoaded) {
+      throw StateError('Model not loaded. Call loadModel() first.');
+    }
+    return _addDocuments(null, path, chunks);
+  }
+
+  /// Splice chunks of the document library at [path] into later prompts
+  ///
+  /// An empty [path] stops using a library. Returns false if the file is
+  /// missing or was built with another model.
+  Future<bool> useDocumentLibrary(String path) async {
+    if (!_isModelLoaded) {
+      throw StateError('Model not loaded. Call loadModel() first.');
+    }
+    return _useDocumentLibrary(null, path);
+  }
+
+  Future<int> _addDocuments(int? modelId, String path, List<String> chunks) async {
+    try {
+      final result = await _channel.invokeMethod<int>(
+        'addDocuments',
+        _withModelId(
+          <String, dynamic>{'path': path, 'chunks': chunks},
+          modelId,
+        ),
+      );
+      return result ?? -1;
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error adding documents: $e');
+      }
+      return -1;
+    }
+  }
+
+  Future<bool> _useDocumentLibrary(int? modelId, String path) async {
+    try {
+      final result = await _channel.invokeMethod<bool>(
+        'useDocumentLibrary',
+        _withModelId(<String, dynamic>{'path': path}, modelId),
+      );
+      return result ?? false;
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error using document library: $e');
+      }
+      return false;
+    }
+  }
+
   /// Get model information
   Future<Map<String, dynamic>?> getModelInfo() async {
     if (!_isModelLoaded) {
       return null;
     }
 
+    return _getModelInfo(null);
+  }
+
+  Future<Map<String, dynamic>?> _getModelInfo(int? modelId) async {
     try {
       final result = await _channel.invokeMethod<Map<dynamic, dynamic>>(
         'getModelInfo',
+        _modelIdArgs(modelId),
       );
       
       return result != null ? Map<String, dynamic>.from(result) : null;
@@ -188,16 +514,56 @@ class FlutterLlama {
   }
 
   /// Stop ongoing generation
-  Future<void> stopGeneration() async {
+  Future<void> stopGeneration() => _stopGeneration(null);
+
+  Future<void> _stopGeneration(int? modelId) async {
     try {
-      await _channel.invokeMethod<void>('stopGeneration');
+      await _channel.invokeMethod<void>(
+        'stopGeneration',
+        _modelIdArgs(modelId),
+      );
     } catch (e) {
       if (kDebugMode) {
         print('[FlutterLlama] Error stopping generation: $e');
       }
     }
   }
-  
+
+  /// Free memory held by every open model, down to [level]
+  ///
+  /// The plugin already calls this when the OS reports memory pressure
+  /// (`onTrimMemory` on Android, memory warnings on iOS, memory pressure
+  /// events on macOS); call it yourself e.g. before a memory-hungry screen.
+  /// Swapped-out sessions and unloaded models come back on their next
+  /// request, at the cost of reloading them.
+  Future<void> trimMemory(MemoryTrimLevel level) async {
+    try {
+      await _channel.invokeMethod<void>(
+        'trimMemory',
+        <String, dynamic>{'level': level.value},
+      );
+    } catch (e) {
+      if (kDebugMode) {
+        print('[FlutterLlama] Error trimming memory: $e');
+      }
+    }
+  }
+
+  // Calls without a modelId go to the model loaded with loadModel
+  static Map<String, dynamic> _withModelId(
+    Map<String, dynamic> args,
+    int? modelId,
+  ) {
+    if (modelId != null) {
+      args['modelId'] = modelId;
+    }
+    return args;
+  }
+
+  static Map<String, dynamic>? _modelIdArgs(int? modelId) {
+    return modelId == null ? null : <String, dynamic>{'modelId': modelId};
+  }
+
   /// Load model with automatic download from HuggingFace or Ollama
   /// 
   /// This method will:
@@ -278,7 +644,261 @@ class FlutterLlama {
   }
 }
 
+/// A model opened with [FlutterLlama.openModel] or a context created with
+/// [FlutterLlama.createContext] / [LlamaModel.createContext]
+///
+/// Keeps its own context, KV cache and sampler, so several models can be
+/// used side by side. Call [close] to free it.
+class LlamaModel {
+  final FlutterLlama _llama;
+
+  /// Native handle of this model
+  final int id;
+
+  /// Path of the GGUF file
+  final String modelPath;
 
+  /// Whether this is an embedding context (see [embed])
+  final bool embeddings;
 
+  bool _isClosed = false;
 
+  LlamaModel._(this._llama, this.id, this.modelPath, {this.embeddings = false});
 
+  /// Whether [close] has been called
+  bool get isClosed => _isClosed;
+
+  void _checkOpen() {
+    if (_isClosed) {
+      throw StateError('Model $id is closed.');
+    }
+  }
+
+  /// Generate text from a prompt
+  Future<LlamaResponse> generate(GenerationParams params) async {
+    _checkOpen();
+    return _llama._generate(params, id);
+  }
+
+  /// Generate text as a stream (token by token)
+  ///
+  /// Several streams may run at once, on this model or others; requests on
+  /// the same model are batched natively up to
+  /// [LlamaConfig.maxSequences] at a time.
+  Stream<String> generateStream(
+    GenerationParams params, {
+    void Function(PrefillProgress progress)? onPrefillProgress,
+  }) async* {
+    _checkOpen();
+    yield* _llama._generateStream(params, id, onPrefillProgress);
+  }
+
+  /// Create another context over the weights of this model
+  ///
+  /// The weights stay in memory once; the new context has its own KV cache
+  /// and remains usable after this one is closed.
+  Future<LlamaModel?> createContext(LlamaContextConfig config) async {
+    _checkOpen();
+    return _llama._createContext(id, modelPath, config);
+  }
+
+  /// Compute the L2-normalized embedding of [text]
+  ///
+  /// Only available on contexts created with
+  /// `LlamaContextConfig(embeddings: true)`.
+  Future<List<double>> embed(String text) async {
+    _checkOpen();
+    if (!embeddings) {
+      throw StateError('Model $id is not an embedding context.');
+    }
+
+    final result = await FlutterLlama._channel.invokeMethod<List<dynamic>>(
+      'embed',
+      <String, dynamic>{'modelId': id, 'text': text},
+    );
+    if (result == null) {
+      throw Exception('Embedding returned null result');
+    }
+    return result.map((v) => (v as num).toDouble()).toList();
+  }
+
+  /// Start a chat history on this model, see [LlamaConversation]
+  Future<LlamaConversation?> createConversation() async {
+    _checkOpen();
+    return _llama._createConversation(id);
+  }
+
+  /// Prefill [partialText] into the sequence of [sessionId] while the user
+  /// is still typing, see [FlutterLlama.prepare]
+  Future<bool> prepare(String sessionId, String partialText) async {
+    _checkOpen();
+    return _llama._prepare(id, sessionId, partialText);
+  }
+
+  /// Save the KV cache and token history of [sessionId] to [path]
+  Future<bool> saveSession(String sessionId, String path) async {
+    _checkOpen();
+    return _llama._session('saveSession', id, sessionId, path);
+  }
+
+  /// Restore a session saved with [saveSession]
+  Future<bool> restoreSession(String sessionId, String path) async {
+    _checkOpen();
+    return _llama._session('restoreSession', id, sessionId, path);
+  }
+
+  /// Precompute document [chunks] into the library at [path], see
+  /// [FlutterLlama.addDocuments]
+  Future<int> addDocuments(String path, List<String> chunks) async {
+    _checkOpen();
+    return _llama._addDocuments(id, path, chunks);
+  }
+
+  /// Splice chunks of the document library at [path] into later prompts
+  Future<bool> useDocumentLibrary(String path) async {
+    _checkOpen();
+    return _llama._useDocumentLibrary(id, path);
+  }
+
+  /// Get model information
+  Future<Map<String, dynamic>?> getModelInfo() async {
+    if (_isClosed) {
+      return null;
+    }
+    return _llama._getModelInfo(id);
+  }
+
+  /// Stop ongoing generation of this model
+  Future<void> stopGeneration() => _llama._stopGeneration(id);
+
+  /// Free the model. Weights shared with other open models stay loaded.
+  Future<void> close() async {
+    if (_isClosed) {
+      return;
+    }
+    _isClosed = true;
+    await FlutterLlama._channel.invokeMethod<void>(
+      'closeModel',
+      <String, dynamic>{'modelId': id},
+    );
+  }
+
+  @override
+  String toString() => 'LlamaModel(id: $id, modelPath: $modelPath)';
+}
+
+/// A chat kept on the native side and formatted with the model's chat
+/// template
+///
+/// Messages are appended with [appendMessage]; [generateReply] formats only
+/// what was added since the previous reply, tokenizes just that and continues
+/// the conversation's KV cache, so a turn costs the same at message 100 as
+/// at message 2. The reply is appended to the history as the assistant's
+/// message.
+///
+/// [checkpoint] marks a point of the history to come back to: [rollback]
+/// regenerates an answer or resends an edited message with only the changed
+/// part prefilled, and [fork] branches off a copy, so several alternative
+/// answers can be generated side by side from the shared history.
+class LlamaConversation {
+  /// Native id of this conversation
+  final int id;
+
+  bool _isClosed = false;
+
+  LlamaConversation._(this.id);
+
+  /// Whether [close] has been called
+  bool get isClosed => _isClosed;
+
+  void _checkOpen() {
+    if (_isClosed) {
+      throw StateError('Conversation $id is closed.');
+    }
+  }
+
+  /// Append a message; [role] is one the template knows, e.g. `system`,
+  /// `user` or `assistant`
+  Future<bool> appendMessage(String role, String content) async {
+    _checkOpen();
+    final result = await FlutterLlama._channel.invokeMethod<bool>(
+      'appendMessage',
+      <String, dynamic>{'conversationId': id, 'role': role, 'content': content},
+    );
+    return result ?? false;
+  }
+
+  /// Generate the assistant's next message
+  ///
+  /// Only the sampling settings of [params] are used; its `prompt` and
+  /// `sessionId` are ignored.
+  Future<LlamaResponse> generateReply([
+    GenerationParams params = const GenerationParams(prompt: ''),
+  ]) async {
+    _checkOpen();
+    final args = params.toMap()
+      ..remove('prompt')
+      ..remove('sessionId')
+      ..['conversationId'] = id;
+    final result = await FlutterLlama._channel.invokeMethod<Map<dynamic, dynamic>>(
+      'generateReply',
+      args,
+    );
+    if (result == null) {
+      throw Exception('Generation returned null result');
+    }
+    return LlamaResponse.fromMap(Map<String, dynamic>.from(result));
+  }
+
+  /// The current point of the history, for [rollback] and [fork]
+  Future<int> checkpoint() async {
+    _checkOpen();
+    final result = await FlutterLlama._channel.invokeMethod<int>(
+      'checkpointConversation',
+      <String, dynamic>{'conversationId': id},
+    );
+    return result ?? -1;
+  }
+
+  /// Drop the messages added after [checkpoint]
+  Future<bool> rollback(int checkpoint) async {
+    _checkOpen();
+    final result = await FlutterLlama._channel.invokeMethod<bool>(
+      'rollbackConversation',
+      <String, dynamic>{'conversationId': id, 'checkpoint': checkpoint},
+    );
+    return result ?? false;
+  }
+
+  /// A new conversation with this one's history up to [checkpoint] (all of
+  /// it if null); both go on independently. Returns null on failure.
+  Future<LlamaConversation?> fork([int? checkpoint]) async {
+    _checkOpen();
+    final forkId = await FlutterLlama._channel.invokeMethod<int>(
+      'forkConversation',
+      <String, dynamic>{
+        'conversationId': id,
+        if (checkpoint != null) 'checkpoint': checkpoint,
+      },
+    );
+    if (forkId == null || forkId == 0) {
+      return null;
+    }
+    return LlamaConversation._(forkId);
+  }
+
+  /// Forget the history; the conversation cannot be used afterwards
+  Future<void> close() async {
+    if (_isClosed) {
+      return;
+    }
+    _isClosed = true;
+    await FlutterLlama._channel.invokeMethod<void>(
+      'closeConversation',
+      <String, dynamic>{'conversationId': id},
+    );
+  }
+
+  @override
+  String toString() => 'LlamaConversation(id: $id)';
+}
@@ -21,6 +21,11 @@ class GenerationParams {
   /// Stop sequences - строки, при которых генерация останавливается
   final List<String> stopSequences;
 
+  /// Идентификатор сессии (диалога). Запросы одной сессии продолжают её
+  /// KV-кэш; по нему же сессия сохраняется и восстанавливается
+  /// (`saveSession` / `restoreSession`)
+  final String? sessionId;
+
   const GenerationParams({
     required this.prompt,
     this.temperature = 0.8,
@@ -29,6 +34,7 @@ class GenerationParams {
     this.maxTokens = 512,
     this.repeatPenalty = 1.1,
     this.stopSequences = const [],
+    this.sessionId,
   });
 
   Map<String, dynamic> toMap() {
@@ -40,6 +46,7 @@ class GenerationParams {
       'maxTokens': maxTokens,
       'repeatPenalty': repeatPenalty,
       'stopSequences': stopSequences,
+      if (sessionId != null) 'sessionId': sessionId,
     };
   }
 
@@ -47,7 +54,8 @@ class GenerationParams {
   String toString() {
     return 'GenerationParams(temperature: $temperature, topP: $topP, '
         'topK: $topK, maxTokens: $maxTokens, repeatPenalty: $repeatPenalty, '
-        'prompt length: ${prompt.length}, stopSequences: $stopSequences)';
+        'prompt length: ${prompt.length}, stopSequences: $stopSequences, '
+        'sessionId: $sessionId)';
   }
 }
 
@@ -12,9 +12,80 @@ class LlamaConfig {
   /// Размер контекста в токенах
   final int contextSize;
 
+  /// Если больше 0 и меньше [contextSize], KV-кэш сначала выделяется на
+  /// столько токенов и удваивается (до [contextSize]), когда диалогу не
+  /// хватает места, а после простоя снова уменьшается: короткие чаты
+  /// не держат в памяти кэш на весь [contextSize] (0 = сразу весь)
+  final int initialContextSize;
+
   /// Размер батча для обработки
   final int batchSize;
 
+  /// Максимум одновременных запросов генерации, объединяемых в общий батч
+  final int maxSequences;
+
+  /// Лимит токенов на один шаг декодирования, пока идёт генерация других
+  /// запросов: длинный промпт обрабатывается частями и не задерживает
+  /// их токены (0 = весь [batchSize])
+  final int stepBudget;
+
+  /// Минимальная длина (в токенах) фрагмента прежней истории, который
+  /// после места расхождения с новым промптом (например, отредактированного
+  /// сообщения в середине чата) переносится на новую позицию в KV-кэше
+  /// вместо повторной обработки (0 = отключено)
+  final int cacheReuse;
+
+  /// Когда последовательность заполняет весь контекст, в ней остаются
+  /// первые [sinkTokens] токенов («якоря» внимания) и последние
+  /// [recentWindow], а токены между ними удаляются из KV-кэша: генерация
+  /// продолжается без ошибки и без повторной обработки промпта
+  /// (отрицательное значение = запрос завершается, как раньше)
+  final int sinkTokens;
+
+  /// Сколько последних токенов сохраняется при сдвиге окна
+  /// (0 = половина [contextSize])
+  final int recentWindow;
+
+  /// Префиксы промптов (например, системные промпты), которые
+  /// обрабатываются один раз при загрузке и хранятся в отдельных
+  /// последовательностях KV-кэша: запрос, начинающийся с такого префикса,
+  /// копирует его кэш вместо повторной обработки
+  final List<String> pinnedPrefixes;
+
+  /// Каталог для дискового кэша промптов: состояние KV-кэша повторяющихся
+  /// префиксов (инструкции, описания инструментов, [pinnedPrefixes])
+  /// сохраняется между запусками приложения и загружается вместо повторной
+  /// обработки (null = отключено)
+  final String? promptCacheDir;
+
+  /// Лимит размера [promptCacheDir] в мегабайтах; при превышении удаляются
+  /// давно не использованные файлы
+  final int promptCacheBudgetMb;
+
+  /// Память (в мегабайтах) под KV-кэш неактивных сессий: когда последовательность
+  /// сессии отдаётся другой сессии, её состояние копируется сюда, и следующий
+  /// запрос сессии загружает его обратно вместо повторной обработки истории.
+  /// Сверх лимита давно не использованные сессии выгружаются в
+  /// [promptCacheDir] (если задан) в пределах [sessionSwapDiskMb]
+  /// (0 = отключено)
+  final int sessionSwapMb;
+
+  /// Лимит места на диске (в мегабайтах) под выгруженные сессии
+  /// [sessionSwapMb]; считается отдельно от [promptCacheBudgetMb], так что
+  /// вместе они занимают в [promptCacheDir] до суммы обоих лимитов
+  final int sessionSwapDiskMb;
+
+  /// Через сколько секунд простоя выгружать модель из памяти; следующий
+  /// запрос загрузит её снова, а сессии переживут выгрузку через
+  /// [sessionSwapMb] (0 = не выгружать)
+  final int idleTimeoutSeconds;
+
+  /// Сколько последних промптов помнить для жадных запросов
+  /// (`temperature: 0`): повтор такого промпта сразу получает ранее
+  /// сгенерированный ответ, без обработки промпта и декодирования
+  /// (0 = отключено)
+  final int responseCacheEntries;
+
   /// Использовать ли Metal (iOS) или GPU акселерацию (Android)
   final bool useGpu;
 
@@ -26,7 +97,20 @@ class LlamaConfig {
     this.nThreads = 4,
     this.nGpuLayers = 0,
     this.contextSize = 2048,
+    this.initialContextSize = 0,
     this.batchSize = 512,
+    this.maxSequences = 4,
+    this.stepBudget = 128,
+    this.cacheReuse = 32,
+    this.sinkTokens = 4,
+    this.recentWindow = 0,
+    this.pinnedPrefixes = const [],
+    this.promptCacheDir,
+    this.promptCacheBudgetMb = 512,
+    this.sessionSwapMb = 0,
+    this.sessionSwapDiskMb = 512,
+    this.idleTimeoutSeconds = 0,
+    this.responseCacheEntries = 64,
     this.useGpu = true,
     this.verbose = false,
   });
@@ -37,7 +121,20 @@ class LlamaConfig {
       'nThreads': nThreads,
       'nGpuLayers': nGpuLayers,
       'contextSize': contextSize,
+      'initialContextSize': initialContextSize,
       'batchSize': batchSize,
+      'maxSequences': maxSequences,
+      'stepBudget': stepBudget,
+      'cacheReuse': cacheReuse,
+      'sinkTokens': sinkTokens,
+      'recentWindow': recentWindow,
+      'pinnedPrefixes': pinnedPrefixes,
+      if (promptCacheDir != null) 'promptCacheDir': promptCacheDir,
+      'promptCacheBudgetMb': promptCacheBudgetMb,
+      'sessionSwapMb': sessionSwapMb,
+      'sessionSwapDiskMb': sessionSwapDiskMb,
+      'idleTimeoutSeconds': idleTimeoutSeconds,
+      'responseCacheEntries': responseCacheEntries,
       'useGpu': useGpu,
       'verbose': verbose,
     };
@@ -49,7 +146,20 @@ class LlamaConfig {
     int? nThreads,
     int? nGpuLayers,
     int? contextSize,
+    int? initialContextSize,
     int? batchSize,
+    int? maxSequences,
+    int? stepBudget,
+    int? cacheReuse,
+    int? sinkTokens,
+    int? recentWindow,
+    List<String>? pinnedPrefixes,
+    String? promptCacheDir,
+    int? promptCacheBudgetMb,
+    int? sessionSwapMb,
+    int? sessionSwapDiskMb,
+    int? idleTimeoutSeconds,
+    int? responseCacheEntries,
     bool? useGpu,
     bool? verbose,
   }) {
@@ -58,7 +168,20 @@ class LlamaConfig {
       nThreads: nThreads ?? this.nThreads,
       nGpuLayers: nGpuLayers ?? this.nGpuLayers,
       contextSize: contextSize ?? this.contextSize,
+      initialContextSize: initialContextSize ?? this.initialContextSize,
       batchSize: batchSize ?? this.batchSize,
+      maxSequences: maxSequences ?? this.maxSequences,
+      stepBudget: stepBudget ?? this.stepBudget,
+      cacheReuse: cacheReuse ?? this.cacheReuse,
+      sinkTokens: sinkTokens ?? this.sinkTokens,
+      recentWindow: recentWindow ?? this.recentWindow,
+      pinnedPrefixes: pinnedPrefixes ?? this.pinnedPrefixes,
+      promptCacheDir: promptCacheDir ?? this.promptCacheDir,
+      promptCacheBudgetMb: promptCacheBudgetMb ?? this.promptCacheBudgetMb,
+      sessionSwapMb: sessionSwapMb ?? this.sessionSwapMb,
+      sessionSwapDiskMb: sessionSwapDiskMb ?? this.sessionSwapDiskMb,
+      idleTimeoutSeconds: idleTimeoutSeconds ?? this.idleTimeoutSeconds,
+      responseCacheEntries: responseCacheEntries ?? this.responseCacheEntries,
       useGpu: useGpu ?? this.useGpu,
       verbose: verbose ?? this.verbose,
     );
@@ -68,7 +191,16 @@ class LlamaConfig {
   String toString() {
     return 'LlamaConfig(modelPath: $modelPath, nThreads: $nThreads, '
         'nGpuLayers: $nGpuLayers, contextSize: $contextSize, '
-        'batchSize: $batchSize, useGpu: $useGpu, verbose: $verbose)';
+        'initialContextSize: $initialContextSize, '
+        'batchSize: $batchSize, maxSequences: $maxSequences, '
+        'stepBudget: $stepBudget, cacheReuse: $cacheReuse, '
+        'sinkTokens: $sinkTokens, recentWindow: $recentWindow, '
+        'pinnedPrefixes: ${pinnedPrefixes.length}, '
+        'promptCacheDir: $promptCacheDir, sessionSwapMb: $sessionSwapMb, '
+        'sessionSwapDiskMb: $sessionSwapDiskMb, '
+        'idleTimeoutSeconds: $idleTimeoutSeconds, '
+        'responseCacheEntries: $responseCacheEntries, '
+        'useGpu: $useGpu, verbose: $verbose)';
   }
 }
 
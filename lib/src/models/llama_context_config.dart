@@ -0,0 +1,186 @@
+/// Конфигурация дополнительного контекста поверх уже загруженных весов модели
+///
+/// Каждый контекст имеет собственный KV-кэш и сэмплер; веса модели
+/// загружаются в память только один раз.
+class LlamaContextConfig {
+  /// Количество потоков для инференса
+  final int nThreads;
+
+  /// Размер контекста в токенах
+  final int contextSize;
+
+  /// Если больше 0 и меньше [contextSize], KV-кэш сначала выделяется на
+  /// столько токенов и удваивается (до [contextSize]), когда диалогу не
+  /// хватает места, а после простоя снова уменьшается: короткие чаты
+  /// не держат в памяти кэш на весь [contextSize] (0 = сразу весь)
+  final int initialContextSize;
+
+  /// Размер батча для обработки
+  final int batchSize;
+
+  /// Максимум одновременных запросов генерации, объединяемых в общий батч
+  final int maxSequences;
+
+  /// Лимит токенов на один шаг декодирования, пока идёт генерация других
+  /// запросов: длинный промпт обрабатывается частями и не задерживает
+  /// их токены (0 = весь [batchSize])
+  final int stepBudget;
+
+  /// Минимальная длина (в токенах) фрагмента прежней истории, который
+  /// после места расхождения с новым промптом (например, отредактированного
+  /// сообщения в середине чата) переносится на новую позицию в KV-кэше
+  /// вместо повторной обработки (0 = отключено)
+  final int cacheReuse;
+
+  /// Когда последовательность заполняет весь контекст, в ней остаются
+  /// первые [sinkTokens] токенов («якоря» внимания) и последние
+  /// [recentWindow], а токены между ними удаляются из KV-кэша: генерация
+  /// продолжается без ошибки и без повторной обработки промпта
+  /// (отрицательное значение = запрос завершается, как раньше)
+  final int sinkTokens;
+
+  /// Сколько последних токенов сохраняется при сдвиге окна
+  /// (0 = половина [contextSize])
+  final int recentWindow;
+
+  /// Префиксы промптов (например, системные промпты), которые
+  /// обрабатываются один раз при загрузке и хранятся в отдельных
+  /// последовательностях KV-кэша: запрос, начинающийся с такого префикса,
+  /// копирует его кэш вместо повторной обработки
+  final List<String> pinnedPrefixes;
+
+  /// Каталог для дискового кэша промптов: состояние KV-кэша повторяющихся
+  /// префиксов (инструкции, описания инструментов, [pinnedPrefixes])
+  /// сохраняется между запусками приложения и загружается вместо повторной
+  /// обработки (null = отключено)
+  final String? promptCacheDir;
+
+  /// Лимит размера [promptCacheDir] в мегабайтах; при превышении удаляются
+  /// давно не использованные файлы
+  final int promptCacheBudgetMb;
+
+  /// Память (в мегабайтах) под KV-кэш неактивных сессий: когда последовательность
+  /// сессии отдаётся другой сессии, её состояние копируется сюда, и следующий
+  /// запрос сессии загружает его обратно вместо повторной обработки истории.
+  /// Сверх лимита давно не использованные сессии выгружаются в
+  /// [promptCacheDir] (если задан) в пределах [sessionSwapDiskMb]
+  /// (0 = отключено)
+  final int sessionSwapMb;
+
+  /// Лимит места на диске (в мегабайтах) под выгруженные сессии
+  /// [sessionSwapMb]; считается отдельно от [promptCacheBudgetMb], так что
+  /// вместе они занимают в [promptCacheDir] до суммы обоих лимитов
+  final int sessionSwapDiskMb;
+
+  /// Через сколько секунд простоя выгружать модель из памяти; следующий
+  /// запрос загрузит её снова, а сессии переживут выгрузку через
+  /// [sessionSwapMb] (0 = не выгружать)
+  final int idleTimeoutSeconds;
+
+  /// Сколько последних промптов помнить для жадных запросов
+  /// (`temperature: 0`): повтор такого промпта сразу получает ранее
+  /// сгенерированный ответ, без обработки промпта и декодирования
+  /// (0 = отключено)
+  final int responseCacheEntries;
+
+  /// Контекст для эмбеддингов (только `embed`, без генерации)
+  final bool embeddings;
+
+  const LlamaContextConfig({
+    this.nThreads = 4,
+    this.contextSize = 2048,
+    this.initialContextSize = 0,
+    this.batchSize = 512,
+    this.maxSequences = 4,
+    this.stepBudget = 128,
+    this.cacheReuse = 32,
+    this.sinkTokens = 4,
+    this.recentWindow = 0,
+    this.pinnedPrefixes = const [],
+    this.promptCacheDir,
+    this.promptCacheBudgetMb = 512,
+    this.sessionSwapMb = 0,
+    this.sessionSwapDiskMb = 512,
+    this.idleTimeoutSeconds = 0,
+    this.responseCacheEntries = 64,
+    this.embeddings = false,
+  });
+
+  Map<String, dynamic> toMap() {
+    return {
+      'nThreads': nThreads,
+      'contextSize': contextSize,
+      'initialContextSize': initialContextSize,
+      'batchSize': batchSize,
+      'maxSequences': maxSequences,
+      'stepBudget': stepBudget,
+      'cacheReuse': cacheReuse,
+      'sinkTokens': sinkTokens,
+      'recentWindow': recentWindow,
+      'pinnedPrefixes': pinnedPrefixes,
+      if (promptCacheDir != null) 'promptCacheDir': promptCacheDir,
+      'promptCacheBudgetMb': promptCacheBudgetMb,
+      'sessionSwapMb': sessionSwapMb,
+      'sessionSwapDiskMb': sessionSwapDiskMb,
+      'idleTimeoutSeconds': idleTimeoutSeconds,
+      'responseCacheEntries': responseCacheEntries,
+      'embeddings': embeddings,
+    };
+  }
+
+  /// Создать копию конфигурации с изменениями
+  LlamaContextConfig copyWith({
+    int? nThreads,
+    int? contextSize,
+    int? initialContextSize,
+    int? batchSize,
+    int? maxSequences,
+    int? stepBudget,
+    int? cacheReuse,
+    int? sinkTokens,
+    int? recentWindow,
+    List<String>? pinnedPrefixes,
+    String? promptCacheDir,
+    int? promptCacheBudgetMb,
+    int? sessionSwapMb,
+    int? sessionSwapDiskMb,
+    int? idleTimeoutSeconds,
+    int? responseCacheEntries,
+    bool? embeddings,
+  }) {
+    return LlamaContextConfig(
+      nThreads: nThreads ?? this.nThreads,
+      contextSize: contextSize ?? this.contextSize,
+      initialContextSize: initialContextSize ?? this.initialContextSize,
+      batchSize: batchSize ?? this.batchSize,
+      maxSequences: maxSequences ?? this.maxSequences,
+      stepBudget: stepBudget ?? this.stepBudget,
+      cacheReuse: cacheReuse ?? this.cacheReuse,
+      sinkTokens: sinkTokens ?? this.sinkTokens,
+      recentWindow: recentWindow ?? this.recentWindow,
+      pinnedPrefixes: pinnedPrefixes ?? this.pinnedPrefixes,
+      promptCacheDir: promptCacheDir ?? this.promptCacheDir,
+      promptCacheBudgetMb: promptCacheBudgetMb ?? this.promptCacheBudgetMb,
+      sessionSwapMb: sessionSwapMb ?? this.sessionSwapMb,
+      sessionSwapDiskMb: sessionSwapDiskMb ?? this.sessionSwapDiskMb,
+      idleTimeoutSeconds: idleTimeoutSeconds ?? this.idleTimeoutSeconds,
+      responseCacheEntries: responseCacheEntries ?? this.responseCacheEntries,
+      embeddings: embeddings ?? this.embeddings,
+    );
+  }
+
+  @override
+  String toString() {
+    return 'LlamaContextConfig(nThreads: $nThreads, contextSize: $contextSize, '
+        'initialContextSize: $initialContextSize, '
+        'batchSize: $batchSize, maxSequences: $maxSequences, '
+        'stepBudget: $stepBudget, cacheReuse: $cacheReuse, '
+        'sinkTokens: $sinkTokens, recentWindow: $recentWindow, '
+        'pinnedPrefixes: ${pinnedPrefixes.length}, '
+        'promptCacheDir: $promptCacheDir, sessionSwapMb: $sessionSwapMb, '
+        'sessionSwapDiskMb: $sessionSwapDiskMb, '
+        'idleTimeoutSeconds: $idleTimeoutSeconds, '
+        'responseCacheEntries: $responseCacheEntries, '
+        'embeddings: $embeddings)';
+  }
+}
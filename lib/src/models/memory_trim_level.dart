@@ -0,0 +1,20 @@
+/// Насколько освобождать память в `FlutterLlama.trimMemory`; каждый
+/// уровень включает предыдущие
+enum MemoryTrimLevel {
+  /// Сбросить кэш общих префиксов и кэш ответов, ужать контекст до нужного
+  /// текущим последовательностям
+  caches(1),
+
+  /// Вытеснить неактивные сессии в своп (на диск, если задан
+  /// `promptCacheDir`) и ужать контекст до минимума
+  sessions(2),
+
+  /// Выгрузить простаивающие модели целиком; следующий запрос загрузит их
+  /// снова. Занятые генерацией модели освобождаются как при [sessions]
+  unload(3);
+
+  /// Значение, передаваемое в нативный код
+  final int value;
+
+  const MemoryTrimLevel(this.value);
+}
@@ -0,0 +1,31 @@
+/// Прогресс обработки промпта (prefill) при потоковой генерации
+class PrefillProgress {
+  /// Количество токенов промпта, уже находящихся в KV-кэше
+  final int prefilled;
+
+  /// Общая длина промпта в токенах
+  final int total;
+
+  /// Доля обработанного промпта (0.0 - 1.0)
+  double get fraction => total > 0 ? prefilled / total : 1.0;
+
+  /// Обработан ли промпт полностью
+  bool get isComplete => prefilled >= total;
+
+  const PrefillProgress({
+    required this.prefilled,
+    required this.total,
+  });
+
+  factory PrefillProgress.fromMap(Map<String, dynamic> map) {
+    return PrefillProgress(
+      prefilled: map['prefilled'] as int? ?? 0,
+      total: map['total'] as int? ?? 0,
+    );
+  }
+
+  @override
+  String toString() {
+    return 'PrefillProgress(prefilled: $prefilled, total: $total)';
+  }
+}
@@ -0,0 +1,19 @@
+/*
+ * Flutter Llama - shared engine sources
+ *
+ * CocoaPods only compiles files inside the pod directory, so the shared
+ * engine in ../../src is pulled in through this translation unit.
+ * Android builds the same sources from src/main/cpp/CMakeLists.txt.
+ */
+
+#include "../../src/batch_scheduler.cpp"
+#include "../../src/conversation.cpp"
+#include "../../src/document_library.cpp"
+#include "../../src/llama_engine.cpp"
+#include "../../src/model_registry.cpp"
+#include "../../src/prefix_cache.cpp"
+#include "../../src/prompt_cache.cpp"
+#include "../../src/response_cache.cpp"
+#include "../../src/session_file.cpp"
+#include "../../src/session_swap.cpp"
+#include "../../src/stop_matcher.cpp"
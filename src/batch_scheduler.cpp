@@ -0,0 +1,1712 @@
+/*
+ * Flutter Llama - continuous-batching scheduler
+ */
+
+#include "batch_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+
+#include "flutter_llama_log.h"
+
+namespace flutter_llama {
+
+void SchedulerWakeup::raise() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        raised_ = true;
+    }
+    cv_.notify_one();
+}
+
+void SchedulerWakeup::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return raised_; });
+    raised_ = false;
+}
+
+void GenerationRequest::wait() {
+    std::unique_lock<std::mutex> lock(signal_mutex);
+    signal_cv.wait(lock, [this] { return done.load(std::memory_order_acquire); });
+}
+
+bool GenerationRequest::next_event(StreamEvent& event) {
+    std::unique_lock<std::mutex> lock(signal_mutex);
+    for (;;) {
+        if (events.try_pop(event)) {
+            // The scheduler may be holding the request back for the room
+            if (wakeup) {
+                wakeup->raise();
+            }
+            return true;
+        }
+        if (done.load(std::memory_order_acquire)) {
+            // The scheduler may have pushed its last event just before finishing
+            if (events.try_pop(event)) {
+                return true;
+            }
+            if (replayed.empty()) {
+                return false;
+            }
+            event = std::move(replayed.front());
+            replayed.pop_front();
+            return true;
+        }
+        if (cancelled.load(std::memory_order_acquire)) {
+            return false;
+        }
+        signal_cv.wait(lock);
+    }
+}
+
+void GenerationRequest::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(signal_mutex);
+        cancelled.store(true, std::memory_order_release);
+    }
+    signal_cv.notify_all();
+    if (wakeup) {
+        wakeup->raise();
+    }
+}
+
+void GenerationRequest::notify() {
+    // Taking the mutex orders the push before the consumer's next check, so
+    // the wakeup cannot fall between its check and its wait
+    {
+        std::lock_guard<std::mutex> lock(signal_mutex);
+    }
+    signal_cv.notify_all();
+}
+
+void GenerationRequest::mark_done() {
+    {
+        std::lock_guard<std::mutex> lock(signal_mutex);
+        done.store(true, std::memory_order_release);
+    }
+    signal_cv.notify_all();
+}
+
+static llama_sampler* make_sampler(const GenerationParams& params) {
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler* sampler = llama_sampler_chain_init(sparams);
+    llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_p(params.top_p, 1));
+    llama_sampler_chain_add(sampler, llama_sampler_init_top_k(params.top_k));
+    llama_sampler_chain_add(sampler, llama_sampler_init_dist(1234));
+    return sampler;
+}
+
+bool tokenize(const llama_vocab* vocab, const std::string& text, std::vector<llama_token>& tokens,
+              bool add_special) {
+    const int n_tokens = -llama_tokenize(vocab, text.c_str(), text.size(), NULL, 0, add_special, true);
+    tokens.resize(n_tokens);
+
+    if (llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), add_special, true) < 0) {
+        LOGE("Failed to tokenize prompt");
+        return false;
+    }
+    return true;
+}
+
+static size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Run of n tokens at old_tokens[from] that reappears at new_tokens[to]
+struct MovedRun {
+    size_t from;
+    size_t to;
+    size_t n;
+};
+
+static uint64_t hash_tokens(const llama_token* tokens, size_t n) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (uint32_t)tokens[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Runs of at least n_min tokens of old_tokens[head_c, ...) found again in
+// new_tokens[head_p, end), in the same order in both. Each run is matched to
+// its earliest occurrence still ahead, which skips over text removed from the
+// old tokens as well as text inserted into the new ones.
+static std::vector<MovedRun> find_moved_runs(const std::vector<llama_token>& old_tokens, size_t head_c,
+                                             const std::vector<llama_token>& new_tokens, size_t head_p,
+                                             size_t end, size_t n_min) {
+    std::vector<MovedRun> runs;
+    if (n_min == 0 || head_c + n_min > old_tokens.size()) {
+        return runs;
+    }
+
+    // Start positions of every n_min-token window of the old tokens, ascending
+    std::unordered_map<uint64_t, std::vector<size_t>> windows;
+    for (size_t c = head_c; c + n_min <= old_tokens.size(); c++) {
+        windows[hash_tokens(old_tokens.data() + c, n_min)].push_back(c);
+    }
+
+    size_t p = head_p;
+    while (p + n_min <= end) {
+        auto it = windows.find(hash_tokens(new_tokens.data() + p, n_min));
+        size_t from = old_tokens.size();
+        if (it != windows.end()) {
+            for (auto c = std::lower_bound(it->second.begin(), it->second.end(), head_c); c != it->second.end(); ++c) {
+                if (std::equal(new_tokens.begin() + p, new_tokens.begin() + p + n_min, old_tokens.begin() + *c)) {
+                    from = *c;
+                    break;
+                }
+            }
+        }
+        if (from == old_tokens.size()) {
+            p++;
+            continue;
+        }
+
+        size_t n = n_min;
+        while (p + n < end && from + n < old_tokens.size() && new_tokens[p + n] == old_tokens[from + n]) {
+            n++;
+        }
+        runs.push_back({from, p, n});
+        head_c = from + n;
+        p += n;
+    }
+    return runs;
+}
+
+static void batch_add(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+    const int32_t i = batch.n_tokens++;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq_id;
+    batch.logits[i] = logits;
+}
+
+BatchScheduler::BatchScheduler(llama_context* context, const llama_context_params& context_params,
+                               const llama_vocab* vocab, const ContextParams& params,
+                               std::unique_ptr<PromptCache> prompt_cache, std::unique_ptr<SessionSwap> session_swap,
+                               std::shared_ptr<ResponseCache> response_cache)
+    : context_(context), context_params_(context_params), vocab_(vocab), n_batch_((int32_t)llama_n_batch(context)),
+      cache_reuse_(params.cache_reuse), n_ctx_(llama_n_ctx(context)), min_n_ctx_(llama_n_ctx(context)),
+      max_n_ctx_(std::max((size_t)std::max(params.context_size, 0), min_n_ctx_)), sink_tokens_(params.sink_tokens),
+      scratch_seq_(std::max(params.max_sequences, 1)),
+      prefix_cache_(context, scratch_seq_ + 1 + (llama_seq_id)params.pinned_prefixes.size(), kPrefixCacheSequences),
+      prompt_cache_(std::move(prompt_cache)), swap_(std::move(session_swap)),
+      response_cache_(std::move(response_cache)) {
+    step_budget_ = params.step_budget > 0 ? std::min(params.step_budget, n_batch_) : n_batch_;
+
+    // A slide has to leave room for at least a few tokens
+    recent_window_ = params.recent_window > 0 ? (size_t)params.recent_window : max_n_ctx_ / 2;
+    if (sink_tokens_ >= 0 && (size_t)sink_tokens_ + kMinPrefillTokens < min_n_ctx_) {
+        recent_window_ = std::min(recent_window_, max_n_ctx_ - sink_tokens_ - kMinPrefillTokens);
+    } else {
+        sink_tokens_ = -1;
+    }
+    if (sink_tokens_ >= 0 && !llama_memory_can_shift(llama_get_memory(context_))) {
+        LOGI("KV cache cannot shift; sequences will not slide");
+        sink_tokens_ = -1;
+    }
+    batch_ = llama_batch_init(n_batch_, 0, 1);
+
+    slots_.resize(std::max(params.max_sequences, 1));
+    for (size_t i = 0; i < slots_.size(); i++) {
+        slots_[i].seq_id = (llama_seq_id)i;
+    }
+
+    // Lets cancellation interrupt a long llama_decode within milliseconds
+    llama_set_abort_callback(context_, abort_callback, this);
+
+    // Paid once here instead of on the critical path of every request
+    for (size_t i = 0; i < params.pinned_prefixes.size(); i++) {
+        pin_prefix(params.pinned_prefixes[i], scratch_seq_ + 1 + (llama_seq_id)i);
+    }
+
+    thread_ = std::thread(&BatchScheduler::run, this);
+}
+
+BatchScheduler::~BatchScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_.store(true, std::memory_order_relaxed);
+    }
+    cv_.notify_all();
+    wakeup_->raise();
+    thread_.join();
+
+    llama_set_abort_callback(context_, nullptr, nullptr);
+
+    for (auto& slot : slots_) {
+        if (slot.sampler) {
+            llama_sampler_free(slot.sampler);
+        }
+    }
+    for (auto& request : in_flight_) {
+        request->cancel();
+        request->mark_done();
+    }
+    llama_batch_free(batch_);
+    llama_free(context_);
+}
+
+int32_t BatchScheduler::sequences_needed(int32_t n_slots, int32_t n_pinned) {
+    return std::max(n_slots, 1) + 1 + n_pinned + kPrefixCacheSequences;
+}
+
+// Runs before the scheduler thread starts, so it has the context to itself
+void BatchScheduler::pin_prefix(const std::string& text, llama_seq_id seq_id) {
+    PinnedPrefix pinned;
+    pinned.seq_id = seq_id;
+    if (!tokenize(vocab_, text, pinned.tokens) || pinned.tokens.empty() ||
+        pinned.tokens.size() >= max_n_ctx_) {
+        LOGE("Cannot pin prefix of %zu characters", text.size());
+        return;
+    }
+    if (pinned.tokens.size() >= n_ctx_ && !grow_context(pinned.tokens.size() + 1)) {
+        return;
+    }
+
+    if (prompt_cache_ && prompt_cache_->match(pinned.tokens, pinned.tokens.size()) == pinned.tokens.size() &&
+        load_stored_prefix(pinned.tokens, pinned.tokens.size(), seq_id)) {
+        LOGI("Loaded %zu-token pinned prefix into seq %d from prompt cache", pinned.tokens.size(), seq_id);
+        pinned_.push_back(std::move(pinned));
+        return;
+    }
+
+    for (size_t pos = 0; pos < pinned.tokens.size();) {
+        batch_.n_tokens = 0;
+        for (; pos < pinned.tokens.size() && batch_.n_tokens < n_batch_; pos++) {
+            batch_add(batch_, pinned.tokens[pos], pos, seq_id, false);
+        }
+        if (llama_decode(context_, batch_) != 0) {
+            LOGE("Failed to prefill pinned prefix (seq %d)", seq_id);
+            llama_memory_seq_rm(llama_get_memory(context_), seq_id, -1, -1);
+            return;
+        }
+    }
+
+    LOGI("Pinned %zu-token prefix in seq %d", pinned.tokens.size(), seq_id);
+    store_prefix(pinned.tokens, pinned.tokens.size(), seq_id);
+    pinned_.push_back(std::move(pinned));
+}
+
+void BatchScheduler::submit(std::shared_ptr<GenerationRequest> request) {
+    request->wakeup = wakeup_;
+    if (!request->background && request->params.max_tokens > 0) {
+        // On the caller's thread rather than the scheduler's; an empty key
+        // fails the request at admission
+        if (request->prompt_tokens.empty() && !tokenize(vocab_, request->params.prompt, request->prompt_tokens)) {
+            request->prompt_tokens.clear();
+        }
+        request->key = request->prompt_tokens;
+        request->stop = StopMatcher(request->params.stop_sequences);
+        if (serve_cached(*request)) {
+            return;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::string& session_id = request->params.session_id;
+        if (!session_id.empty()) {
+            // The session's earlier prepare has done its job, or is outdated
+            auto it = prepared_.find(session_id);
+            if (it != prepared_.end()) {
+                it->second->cancel();
+                prepared_.erase(it);
+            }
+            if (request->background) {
+                prepared_[session_id] = request;
+            }
+        }
+        if (!stopping_.load(std::memory_order_relaxed)) {
+            last_active_ = std::chrono::steady_clock::now();
+            pending_.push_back(request);
+            in_flight_.push_back(request);
+            request.reset();
+        }
+    }
+    if (request) {
+        request->cancel();
+        request->mark_done();
+        return;
+    }
+    cv_.notify_one();
+    wakeup_->raise();
+}
+
+// Answer a greedy request from the response cache, on the caller's thread
+bool BatchScheduler::serve_cached(GenerationRequest& request) {
+    const std::vector<llama_token>& prompt = request.key;
+    std::vector<llama_token> reply;
+    bool complete = false;
+    if (!response_cache_ || request.params.temperature > 0.0f || prompt.empty() ||
+        !response_cache_->find(prompt, reply, complete)) {
+        return false;
+    }
+
+    // The request ends at max_tokens, its first stop sequence or the end of
+    // the reply, whichever comes first; the cache has to know up to there
+    StopMatcher stop = request.stop;
+    std::vector<std::string> pieces;
+    size_t n_reply = 0;
+    bool stopped = false;
+    while (n_reply < reply.size() && n_reply < (size_t)request.params.max_tokens && !stopped) {
+        char token_str[256] = {0};
+        const int n = llama_token_to_piece(vocab_, reply[n_reply++], token_str, sizeof(token_str) - 1, 0, true);
+        std::string text;
+        stopped = n > 0 && stop.feed(std::string(token_str, n), text);
+        pieces.push_back(std::move(text));
+    }
+    if (!stopped && !complete && n_reply < (size_t)request.params.max_tokens) {
+        return false;
+    }
+    if (!stopped) {
+        pieces.push_back(stop.flush());
+    }
+    reply.resize(n_reply);
+
+    if (request.streaming) {
+        StreamEvent event;
+        event.type = StreamEventType::PrefillProgress;
+        event.n_prefilled = event.n_total = (int32_t)prompt.size();
+        request.replayed.push_back(std::move(event));
+    }
+    for (std::string& piece : pieces) {
+        if (piece.empty()) {
+            continue;
+        }
+        if (request.streaming) {
+            StreamEvent event;
+            event.type = StreamEventType::Token;
+            event.text = std::move(piece);
+            request.replayed.push_back(std::move(event));
+        } else {
+            request.text += piece;
+        }
+    }
+    request.generated = std::move(reply);
+    request.n_generated = (int32_t)request.generated.size();
+    request.ok = true;
+    LOGI("Served %d tokens from the response cache", request.n_generated);
+    request.mark_done();
+    return true;
+}
+
+// The request ran to its end: at end-of-generation (complete), max_tokens or
+// a stop sequence
+void BatchScheduler::cache_reply(Slot& slot, bool complete) {
+    GenerationRequest& request = *slot.request;
+    if (response_cache_ && request.params.temperature <= 0.0f && !request.key.empty()) {
+        response_cache_->insert(request.key, request.generated, complete);
+    }
+}
+
+void BatchScheduler::prepare(const std::string& session_id, const std::string& text) {
+    auto request = std::make_shared<GenerationRequest>();
+    request->params.prompt = text;
+    request->params.session_id = session_id;
+    request->params.max_tokens = 0;
+    request->background = true;
+    submit(std::move(request));
+}
+
+void BatchScheduler::cancel_all() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& request : in_flight_) {
+        request->cancel();
+    }
+}
+
+bool BatchScheduler::abort_callback(void* data) {
+    auto* self = static_cast<BatchScheduler*>(data);
+    if (self->stopping_.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    // Only abort when nobody in the batch wants the result any more
+    for (GenerationRequest* request : self->step_requests_) {
+        if (!request->cancelled.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        for (const auto& follower : request->followers) {
+            if (!follower->cancelled.load(std::memory_order_relaxed)) {
+                return false;
+            }
+        }
+    }
+    return !self->step_requests_.empty();
+}
+
+// The session's own sequence if it is free, else the free slot whose cached
+// tokens share the longest prefix with prompt, least recently used first. A
+// session coming back from the swap replaces all cells of its sequence, so
+// it takes an empty one if there is one.
+BatchScheduler::Slot* BatchScheduler::pick_slot(const std::vector<llama_token>& prompt, const std::string& session_id) {
+    const bool swapped = swap_ && !session_id.empty() && swap_->contains(session_id);
+    Slot* best = nullptr;
+    size_t best_common = 0;
+    for (auto& slot : slots_) {
+        if (slot.request) {
+            continue;
+        }
+        if (!session_id.empty() && slot.session == session_id) {
+            return &slot;
+        }
+        const size_t n_common = swapped ? (slot.cached.empty() ? 1 : 0) : common_prefix(slot.cached, prompt);
+        if (!best || n_common > best_common ||
+            (n_common == best_common && slot.last_used < best->last_used)) {
+            best = &slot;
+            best_common = n_common;
+        }
+    }
+    return best;
+}
+
+// slot.prompt holds the tokenized prompt of request
+void BatchScheduler::admit(Slot& slot, std::shared_ptr<GenerationRequest> request) {
+    const std::string& session_id = request->params.session_id;
+    if (slot.session != session_id) {
+        swap_out(slot);
+    }
+    swap_in(slot, session_id);
+    compact_prompt(slot);
+
+    // At least one prompt token has to be decoded to get logits to sample from
+    const size_t n_reusable = slot.prompt.size() - 1;
+    size_t n_common = std::min(common_prefix(slot.cached, slot.prompt), n_reusable);
+
+    // The prefix cache (another request's history) or a pinned prefix may
+    // hold a longer match
+    llama_seq_id source = -1;
+    size_t n_source = prefix_cache_.match(slot.prompt, source);
+    bool pinned_source = false;
+    for (const auto& pinned : pinned_) {
+        const size_t n_pinned = common_prefix(pinned.tokens, slot.prompt);
+        if (n_pinned > n_source) {
+            source = pinned.seq_id;
+            n_source = n_pinned;
+            pinned_source = true;
+        }
+    }
+    // A tree match that ends inside the other history is a prefix two prompts
+    // share but then leave (instructions, tool descriptions): a template worth
+    // keeping on disk for the next cold start. Slid histories never reach the
+    // tree (see release_slot), so neither do they reach the disk.
+    llama_memory_t mem = llama_get_memory(context_);
+    if (n_source < n_reusable && n_source > 0 && !pinned_source &&
+        (llama_pos)n_source <= llama_memory_seq_pos_max(mem, source)) {
+        store_prefix(slot.prompt, n_source, source);
+    }
+    n_source = std::min(n_source, n_reusable);
+
+    // Right after a cold start only the prompt cache directory may have it
+    size_t n_stored = prompt_cache_ ? prompt_cache_->match(slot.prompt, n_reusable) : 0;
+    if (n_stored <= std::max(n_common, n_source)) {
+        n_stored = 0;
+    }
+
+    // Before the history past the divergence point is removed
+    stash_reusable_chunks(slot, n_common, std::max({n_common, n_source, n_stored}));
+    add_document_chunks(slot, std::max({n_common, n_source, n_stored}));
+
+    if (n_stored > 0 && load_stored_prefix(slot.prompt, n_stored, scratch_seq_)) {
+        llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+        llama_memory_seq_cp(mem, scratch_seq_, slot.seq_id, -1, -1);
+        llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+        slot.cached.assign(slot.prompt.begin(), slot.prompt.begin() + n_stored);
+    } else {
+        if (n_common < slot.cached.size()) {
+            if (!llama_memory_seq_rm(mem, slot.seq_id, n_common, -1)) {
+                // Partial removal is not supported by every memory type (e.g. recurrent)
+                drop_seq(slot);
+                n_common = 0;
+            } else {
+                slot.cached.resize(n_common);
+            }
+        }
+
+        if (n_source > n_common) {
+            llama_memory_seq_cp(mem, source, slot.seq_id, n_common, n_source);
+            slot.cached.assign(slot.prompt.begin(), slot.prompt.begin() + n_source);
+        }
+    }
+    place_reused_chunks(slot);
+
+    if (slot.cached.size() < (size_t)std::max(sink_tokens_, 0)) {
+        slot.dropped.clear();
+    }
+
+    size_t n_kept = slot.cached.size();
+    for (const auto& chunk : slot.reused) {
+        n_kept += chunk.n_tokens;
+    }
+    if (n_kept > 0) {
+        LOGI("Reusing %zu of %zu prompt tokens from KV cache (seq %d)", n_kept, slot.prompt.size(), slot.seq_id);
+    }
+
+    slot.request = std::move(request);
+    slot.session = slot.request->params.session_id;
+    slot.last_used = ++clock_;
+    slot.sampler = make_sampler(slot.request->params);
+    slot.decoding = false;
+    slot.draining = false;
+}
+
+// A slid sequence continues a prompt that repeats its history including the
+// dropped tokens: the prompt drops them too. Any other prompt keeps the sinks
+// only.
+void BatchScheduler::compact_prompt(Slot& slot) {
+    if (slot.dropped.empty()) {
+        return;
+    }
+    const size_t n_sinks = (size_t)sink_tokens_;
+    const size_t n_end = n_sinks + slot.dropped.size();
+    if (slot.prompt.size() > n_end && slot.cached.size() >= n_sinks &&
+        std::equal(slot.cached.begin(), slot.cached.begin() + n_sinks, slot.prompt.begin()) &&
+        std::equal(slot.dropped.begin(), slot.dropped.end(), slot.prompt.begin() + n_sinks)) {
+        slot.prompt.erase(slot.prompt.begin() + n_sinks, slot.prompt.begin() + n_end);
+        LOGI("Prompt continues slid seq %d: dropping %zu tokens", slot.seq_id, slot.dropped.size());
+        return;
+    }
+    // Past the sinks the cells were computed over the dropped tokens, which
+    // this prompt does not have
+    if (slot.cached.size() > n_sinks) {
+        if (llama_memory_seq_rm(llama_get_memory(context_), slot.seq_id, (llama_pos)n_sinks, -1)) {
+            slot.cached.resize(n_sinks);
+        } else {
+            drop_seq(slot);
+        }
+    }
+    slot.dropped.clear();
+}
+
+// Make room in a sequence that reached the context size: drop the tokens
+// between the sinks and the recent window and shift the recent ones down.
+// Like stashed runs, the recent cells are copied out and put back shifted,
+// as they may be shared with the prefix cache or a pinned prefix. Returns
+// false if the sequence cannot slide; if the copy fails, the request ends.
+bool BatchScheduler::slide_window(Slot& slot) {
+    if (sink_tokens_ < 0 || (size_t)sink_tokens_ + kMinPrefillTokens >= n_ctx_) {
+        return false;
+    }
+    // An elastic context that could not grow may still be smaller than the window
+    const size_t n_sinks = (size_t)sink_tokens_;
+    const size_t n_recent = std::min(recent_window_, n_ctx_ - n_sinks - kMinPrefillTokens);
+    if (slot.cached.size() <= n_sinks + n_recent) {
+        return false;
+    }
+    const size_t n_discard = slot.cached.size() - n_sinks - n_recent;
+    const llama_pos p0 = (llama_pos)n_sinks;
+    const llama_pos p1 = (llama_pos)(n_sinks + n_discard);
+
+    llama_memory_t mem = llama_get_memory(context_);
+    llama_memory_seq_cp(mem, slot.seq_id, scratch_seq_, p1, -1);
+    std::vector<uint8_t> state(llama_state_seq_get_size(context_, scratch_seq_));
+    bool ok = llama_state_seq_get_data(context_, state.data(), state.size(), scratch_seq_) != 0;
+    llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+    if (ok) {
+        ok = llama_memory_seq_rm(mem, slot.seq_id, p0, -1) &&
+             llama_state_seq_set_data(context_, state.data(), state.size(), scratch_seq_) != 0;
+        if (ok) {
+            llama_memory_seq_add(mem, scratch_seq_, -1, -1, -(llama_pos)n_discard);
+            llama_memory_seq_cp(mem, scratch_seq_, slot.seq_id, -1, -1);
+        }
+        llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+    }
+    if (!ok) {
+        LOGE("Failed to slide seq %d past %zu tokens", slot.seq_id, slot.cached.size());
+        drop_seq(slot);
+        retire(slot);
+        return false;
+    }
+
+    LOGI("Slid seq %d: dropped %zu tokens after the first %zu", slot.seq_id, n_discard, n_sinks);
+    slot.dropped.insert(slot.dropped.end(), slot.cached.begin() + p0, slot.cached.begin() + p1);
+    slot.cached.erase(slot.cached.begin() + p0, slot.cached.begin() + p1);
+    if (!slot.decoding) {
+        // Still prefilling: cached is a prefix of the prompt
+        slot.prompt.erase(slot.prompt.begin() + p0, slot.prompt.begin() + p1);
+        for (auto& chunk : slot.reused) {
+            chunk.pos -= n_discard;
+        }
+    }
+    return true;
+}
+
+// Out of KV cells with nothing left to evict: the running sequence holding
+// the most tokens slides
+bool BatchScheduler::slide_longest_window() {
+    Slot* longest = nullptr;
+    for (auto& slot : slots_) {
+        if (slot.request && !slot.draining && (!longest || slot.cached.size() > longest->cached.size())) {
+            longest = &slot;
+        }
+    }
+    return longest && slide_window(*longest);
+}
+
+// Move every sequence into a new context of n_ctx cells and free the old one
+bool BatchScheduler::resize_context(size_t n_ctx) {
+    llama_context_params params = context_params_;
+    params.n_ctx = (uint32_t)n_ctx;
+    llama_context* context = llama_init_from_model(const_cast<llama_model*>(llama_get_model(context_)), params);
+    if (!context) {
+        LOGE("Failed to create context of %zu cells", n_ctx);
+        return false;
+    }
+    std::vector<uint8_t> state(llama_state_get_size(context_));
+    const bool ok = llama_state_get_data(context_, state.data(), state.size()) == state.size() &&
+                    llama_state_set_data(context, state.data(), state.size()) == state.size();
+    if (!ok) {
+        // E.g. the cells in use do not fit a smaller context
+        llama_free(context);
+        return false;
+    }
+
+    LOGI("Resized context from %zu to %u cells (%zu bytes of state moved)", n_ctx_.load(), llama_n_ctx(context),
+         state.size());
+    llama_set_abort_callback(context, abort_callback, this);
+    llama_free(context_);
+    context_ = context;
+    prefix_cache_.set_context(context);
+    n_ctx_ = llama_n_ctx(context);
+    return true;
+}
+
+// Double an elastic context until it holds n_needed cells, up to max_n_ctx_
+bool BatchScheduler::grow_context(size_t n_needed) {
+    if (n_ctx_ >= max_n_ctx_) {
+        return false;
+    }
+    size_t n_ctx = n_ctx_;
+    while (n_ctx < n_needed && n_ctx < max_n_ctx_) {
+        n_ctx *= 2;
+    }
+    return resize_context(std::min(std::max(n_ctx, n_ctx_ + 1), max_n_ctx_));
+}
+
+// Called when no request is running. Shrinking waits until the longest
+// sequence uses a quarter of the context, so a chat near a boundary does not
+// make it grow and shrink on every turn.
+void BatchScheduler::shrink_idle_context() {
+    if (n_ctx_ <= min_n_ctx_ || longest_sequence() * 4 > n_ctx_) {
+        return;
+    }
+    fit_context(min_n_ctx_);
+}
+
+// Shrink to the smallest n_floor * 2^k cells holding twice the longest
+// sequence. Cells of several sequences that do not fit the smaller context
+// keep the current one.
+void BatchScheduler::fit_context(size_t n_floor) {
+    const size_t n_used = longest_sequence();
+    size_t n_ctx = n_floor;
+    while (n_ctx < n_used * 2 && n_ctx < max_n_ctx_) {
+        n_ctx *= 2;
+    }
+    if (n_ctx < n_ctx_) {
+        resize_context(n_ctx);
+    }
+}
+
+size_t BatchScheduler::longest_sequence() {
+    llama_memory_t mem = llama_get_memory(context_);
+    size_t n_used = 0;
+    for (llama_seq_id seq_id = 0; seq_id < (llama_seq_id)context_params_.n_seq_max; seq_id++) {
+        n_used = std::max(n_used, (size_t)(llama_memory_seq_pos_max(mem, seq_id) + 1));
+    }
+    return n_used;
+}
+
+// Copy out the cells of runs of slot.cached past n_common that the prompt
+// repeats past n_prefix. Prefill has to continue a sequence at the position
+// after its last cell, and the cells may also belong to the prefix cache or
+// a pinned prefix, where shifting them in place would move them too; so the
+// copies wait outside the KV cache until prefill reaches their new position.
+void BatchScheduler::stash_reusable_chunks(Slot& slot, size_t n_common, size_t n_prefix) {
+    slot.reused.clear();
+    llama_memory_t mem = llama_get_memory(context_);
+    if (cache_reuse_ <= 0 || !llama_memory_can_shift(mem)) {
+        return;
+    }
+
+    const std::vector<MovedRun> runs =
+        find_moved_runs(slot.cached, n_common, slot.prompt, n_prefix, slot.prompt.size() - 1, cache_reuse_);
+    for (const auto& run : runs) {
+        llama_memory_seq_cp(mem, slot.seq_id, scratch_seq_, run.from, run.from + run.n);
+        ReusedChunk chunk;
+        chunk.pos = run.to;
+        chunk.n_tokens = run.n;
+        chunk.from = (llama_pos)run.from;
+        chunk.state.resize(llama_state_seq_get_size(context_, scratch_seq_));
+        const bool ok = llama_state_seq_get_data(context_, chunk.state.data(), chunk.state.size(), scratch_seq_) != 0;
+        llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+        if (!ok) {
+            LOGE("Failed to copy %zu reusable tokens of seq %d", run.n, slot.seq_id);
+            break;
+        }
+        slot.reused.push_back(std::move(chunk));
+    }
+}
+
+// Runs of library documents in the parts of the prompt past n_prefix that no
+// stashed run covers, merged into slot.reused in position order
+void BatchScheduler::add_document_chunks(Slot& slot, size_t n_prefix) {
+    if (!documents_ || cache_reuse_ <= 0 || !llama_memory_can_shift(llama_get_memory(context_))) {
+        return;
+    }
+
+    std::deque<ReusedChunk> merged;
+    size_t begin = n_prefix;
+    auto add_runs = [&](size_t end) {
+        for (const auto& run : documents_->find(slot.prompt, begin, end, cache_reuse_)) {
+            ReusedChunk chunk;
+            chunk.pos = run.to;
+            chunk.n_tokens = run.n;
+            chunk.from = (llama_pos)run.from;
+            chunk.library = documents_;
+            chunk.doc = run.doc;
+            merged.push_back(std::move(chunk));
+        }
+    };
+    for (auto& chunk : slot.reused) {
+        add_runs(chunk.pos);
+        begin = chunk.pos + chunk.n_tokens;
+        merged.push_back(std::move(chunk));
+    }
+    add_runs(slot.prompt.size() - 1);
+    slot.reused.swap(merged);
+}
+
+// Put back the stashed and document runs that continue slot.cached, shifted
+// to their positions in the prompt
+void BatchScheduler::place_reused_chunks(Slot& slot) {
+    llama_memory_t mem = llama_get_memory(context_);
+    while (!slot.reused.empty() && slot.reused.front().pos == slot.cached.size()) {
+        const ReusedChunk& chunk = slot.reused.front();
+        const llama_pos shift = (llama_pos)chunk.pos - chunk.from;
+        const uint8_t* state = chunk.state.data();
+        size_t state_size = chunk.state.size();
+        if (chunk.library) {
+            const Document& document = chunk.library->document(chunk.doc);
+            state = document.state;
+            state_size = document.state_size;
+        }
+
+        const bool ok = llama_state_seq_set_data(context_, state, state_size, scratch_seq_) != 0;
+        if (ok) {
+            // A document run may be only part of the document
+            llama_memory_seq_rm(mem, scratch_seq_, 0, chunk.from);
+            llama_memory_seq_rm(mem, scratch_seq_, chunk.from + (llama_pos)chunk.n_tokens, -1);
+            llama_memory_seq_add(mem, scratch_seq_, -1, -1, shift);
+            llama_memory_seq_cp(mem, scratch_seq_, slot.seq_id, -1, -1);
+        }
+        llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+        if (!ok) {
+            // No room for the cells: the rest of the prompt is prefilled
+            LOGE("Failed to place %zu reused tokens in seq %d", chunk.n_tokens, slot.seq_id);
+            slot.reused.clear();
+            return;
+        }
+
+        if (chunk.library) {
+            LOGI("Spliced %zu tokens of library document %zu at position %zu (seq %d)", chunk.n_tokens, chunk.doc,
+                 chunk.pos, slot.seq_id);
+        } else {
+            LOGI("Moved %zu cached tokens by %d positions (seq %d)", chunk.n_tokens, shift, slot.seq_id);
+        }
+        slot.cached.insert(slot.cached.end(), slot.prompt.begin() + chunk.pos,
+                           slot.prompt.begin() + chunk.pos + chunk.n_tokens);
+        slot.reused.pop_front();
+    }
+}
+
+// Load the prompt cache file of tokens[0, n_tokens) into seq_id, which has no
+// cells yet
+bool BatchScheduler::load_stored_prefix(const std::vector<llama_token>& tokens, size_t n_tokens,
+                                        llama_seq_id seq_id) {
+    std::vector<uint8_t> state;
+    if (!prompt_cache_->load(tokens, n_tokens, state)) {
+        return false;
+    }
+    llama_memory_t mem = llama_get_memory(context_);
+    if (llama_state_seq_set_data(context_, state.data(), state.size(), seq_id) == 0 ||
+        llama_memory_seq_pos_max(mem, seq_id) + 1 != (llama_pos)n_tokens) {
+        // E.g. written by a context with another KV cache type
+        LOGE("Prompt cache state of %zu tokens does not fit this context", n_tokens);
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        return false;
+    }
+    LOGI("Loaded %zu prompt tokens from prompt cache (seq %d)", n_tokens, seq_id);
+    return true;
+}
+
+// Queue the cells of tokens[0, n_tokens), which seq_id holds, to be written to
+// the prompt cache. The copy is made here; the file is written on the cache's
+// thread.
+void BatchScheduler::store_prefix(const std::vector<llama_token>& tokens, size_t n_tokens, llama_seq_id seq_id) {
+    if (!prompt_cache_ || n_tokens < kPromptCacheMinTokens || prompt_cache_->contains(tokens, n_tokens)) {
+        return;
+    }
+    llama_memory_t mem = llama_get_memory(context_);
+    llama_memory_seq_cp(mem, seq_id, scratch_seq_, 0, (llama_pos)n_tokens);
+    std::vector<uint8_t> state(llama_state_seq_get_size(context_, scratch_seq_));
+    const bool ok = llama_state_seq_get_data(context_, state.data(), state.size(), scratch_seq_) != 0;
+    llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+    if (ok) {
+        prompt_cache_->store(std::vector<llama_token>(tokens.begin(), tokens.begin() + n_tokens), std::move(state));
+    }
+}
+
+// Stop scheduling the request; it is handed back once its events are delivered
+void BatchScheduler::retire(Slot& slot) {
+    if (slot.request->cancelled.load(std::memory_order_acquire)) {
+        promote_follower(slot);
+    }
+
+    // Bytes held back for a stop sequence that did not complete
+    StreamEvent tail;
+    tail.type = StreamEventType::Token;
+    tail.text = slot.request->stop.flush();
+    if (!tail.text.empty() && !slot.request->cancelled.load(std::memory_order_acquire)) {
+        emit(slot, std::move(tail));
+    }
+
+    if (slot.sampler) {
+        llama_sampler_free(slot.sampler);
+        slot.sampler = nullptr;
+    }
+    slot.decoding = false;
+    slot.prompt.clear();
+    slot.reused.clear();
+    slot.draining = true;
+
+    if (slot.request->cancelled.load(std::memory_order_acquire) || flush_backlog(slot)) {
+        release_slot(slot);
+    }
+}
+
+void BatchScheduler::release_slot(Slot& slot) {
+    std::shared_ptr<GenerationRequest> request = std::move(slot.request);
+    std::vector<std::shared_ptr<GenerationRequest>> followers = std::move(request->followers);
+    for (auto& follower : followers) {
+        follower->generated = request->generated;
+        follower->n_generated = request->n_generated;
+        follower->ok = request->ok;
+    }
+    request->backlog.clear();
+    slot.draining = false;
+    slot.last_used = ++clock_;
+
+    // Keep the history for later requests sharing any part of it, even once
+    // this sequence is taken by an unrelated prompt. Not once it slid: its
+    // cells were computed over the dropped tokens, which their keys leave out.
+    if (!slot.cached.empty() && slot.dropped.empty()) {
+        prefix_cache_.insert(slot.cached, slot.seq_id);
+    }
+
+    LOGI("Request finished on seq %d: %d tokens", slot.seq_id, request->n_generated);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_.erase(std::remove(in_flight_.begin(), in_flight_.end(), request), in_flight_.end());
+        for (const auto& follower : followers) {
+            in_flight_.erase(std::remove(in_flight_.begin(), in_flight_.end(), follower), in_flight_.end());
+        }
+        last_active_ = std::chrono::steady_clock::now();
+        auto it = prepared_.find(slot.session);
+        if (it != prepared_.end() && it->second == request) {
+            prepared_.erase(it);
+        }
+    }
+    request->mark_done();
+    for (auto& follower : followers) {
+        follower->backlog.clear();
+        follower->mark_done();
+    }
+}
+
+void BatchScheduler::drop_seq(Slot& slot) {
+    llama_memory_seq_rm(llama_get_memory(context_), slot.seq_id, -1, -1);
+    slot.cached.clear();
+    slot.dropped.clear();
+    slot.reused.clear();
+}
+
+// An aborted or failed llama_decode may keep the ubatches it finished; drop
+// them so the KV cache matches slot.cached again
+void BatchScheduler::drop_uncached_cells(Slot& slot) {
+    if (!llama_memory_seq_rm(llama_get_memory(context_), slot.seq_id, slot.cached.size(), -1)) {
+        drop_seq(slot);
+    }
+}
+
+// Queue event for a stream, or append the text of a token for a blocking
+// request; progress is only reported to streams
+static void deliver(GenerationRequest& request, StreamEvent event) {
+    if (!request.streaming) {
+        if (event.type == StreamEventType::Token) {
+            request.text += event.text;
+        }
+        return;
+    }
+    if (!request.backlog.empty() || !request.events.try_push(std::move(event))) {
+        request.backlog.push_back(std::move(event));
+        return;
+    }
+    request.notify();
+}
+
+static bool flush_request_backlog(GenerationRequest& request) {
+    bool pushed = false;
+    while (!request.backlog.empty() && request.events.try_push(std::move(request.backlog.front()))) {
+        request.backlog.pop_front();
+        pushed = true;
+    }
+    if (pushed) {
+        request.notify();
+    }
+    return request.backlog.empty();
+}
+
+void BatchScheduler::emit(Slot& slot, StreamEvent&& event) {
+    for (auto& follower : slot.request->followers) {
+        if (!follower->cancelled.load(std::memory_order_acquire)) {
+            deliver(*follower, event);
+        }
+    }
+    deliver(*slot.request, std::move(event));
+}
+
+// Returns true once every held-back event of the request and its followers
+// still listening reached their consumer's queue
+bool BatchScheduler::flush_backlog(Slot& slot) {
+    bool flushed = flush_request_backlog(*slot.request);
+    for (auto& follower : slot.request->followers) {
+        if (!follower->cancelled.load(std::memory_order_acquire)) {
+            flushed = flush_request_backlog(*follower) && flushed;
+        }
+    }
+    return flushed;
+}
+
+// Same prompt tokens and sampling settings: with the sampler's fixed seed,
+// the same tokens generated. A follower's history stays in the leader's
+// sequence, so both have to belong to the same session (or none).
+static bool identical(const GenerationRequest& a, const GenerationRequest& b) {
+    if (a.background || b.background || a.key.empty() || a.key != b.key ||
+        a.params.session_id != b.params.session_id) {
+        return false;
+    }
+    const GenerationParams& p = a.params;
+    const GenerationParams& q = b.params;
+    return p.temperature == q.temperature && p.top_p == q.top_p && p.top_k == q.top_k &&
+           p.max_tokens == q.max_tokens && p.repeat_penalty == q.repeat_penalty &&
+           p.stop_sequences == q.stop_sequences;
+}
+
+// The sequence running a request identical to request, if any
+BatchScheduler::Slot* BatchScheduler::find_leader(const GenerationRequest& request) {
+    for (auto& slot : slots_) {
+        // A draining request already flushed the tail its stop matcher held
+        // back, which a follower's matcher would hold back for good
+        if (slot.request && !slot.draining && identical(*slot.request, request)) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+// Attach follower to the request of slot, replaying the finished prefill and
+// what it generated so far (up to the bytes its stop matcher holds back)
+void BatchScheduler::follow(Slot& slot, std::shared_ptr<GenerationRequest> follower) {
+    if (slot.decoding) {
+        StreamEvent event;
+        event.type = StreamEventType::PrefillProgress;
+        event.n_prefilled = event.n_total = (int32_t)follower->key.size();
+        deliver(*follower, std::move(event));
+    }
+    for (llama_token token : slot.request->generated) {
+        char token_str[256] = {0};
+        const int n = llama_token_to_piece(vocab_, token, token_str, sizeof(token_str) - 1, 0, true);
+        StreamEvent event;
+        event.type = StreamEventType::Token;
+        if (n > 0) {
+            follower->stop.feed(std::string(token_str, n), event.text);
+        }
+        if (!event.text.empty()) {
+            deliver(*follower, std::move(event));
+        }
+    }
+    LOGI("Request joined the identical one on seq %d after %zu tokens", slot.seq_id,
+         slot.request->generated.size());
+    slot.request->followers.push_back(std::move(follower));
+}
+
+// The request of slot was cancelled: hand the sequence to a follower still
+// listening. Returns false if there is none.
+bool BatchScheduler::promote_follower(Slot& slot) {
+    auto& followers = slot.request->followers;
+    auto it = std::find_if(followers.begin(), followers.end(), [](const std::shared_ptr<GenerationRequest>& f) {
+        return !f->cancelled.load(std::memory_order_acquire);
+    });
+    if (it == followers.end()) {
+        return false;
+    }
+    std::shared_ptr<GenerationRequest> leader = std::move(*it);
+    followers.erase(it);
+    leader->followers = std::move(followers);
+    leader->generated = slot.request->generated;
+    leader->n_generated = slot.request->n_generated;
+    leader->ok = slot.request->ok;
+    leader->stop = std::move(slot.request->stop);
+
+    std::shared_ptr<GenerationRequest> cancelled = std::move(slot.request);
+    slot.request = std::move(leader);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_.erase(std::remove(in_flight_.begin(), in_flight_.end(), cancelled), in_flight_.end());
+    }
+    cancelled->mark_done();
+    return true;
+}
+
+void BatchScheduler::sample(Slot& slot) {
+    GenerationRequest& request = *slot.request;
+
+    const llama_token token = llama_sampler_sample(slot.sampler, context_, slot.batch_index);
+    if (llama_vocab_is_eog(vocab_, token)) {
+        LOGI("EOS token reached (seq %d)", slot.seq_id);
+        cache_reply(slot, true);
+        retire(slot);
+        return;
+    }
+
+    request.generated.push_back(token);
+
+    char token_str[256] = {0};
+    int n = llama_token_to_piece(vocab_, token, token_str, sizeof(token_str) - 1, 0, true);
+    StreamEvent event;
+    event.type = StreamEventType::Token;
+    const bool stopped = n > 0 && request.stop.feed(std::string(token_str, n), event.text);
+    if (!event.text.empty()) {
+        emit(slot, std::move(event));
+    }
+    if (stopped) {
+        // Ends without decoding the token; the tokens kept by the cache are
+        // the start of the reply, which goes on past the stop sequence
+        LOGI("Stop sequence reached (seq %d)", slot.seq_id);
+        request.n_generated++;
+        cache_reply(slot, false);
+        retire(slot);
+        return;
+    }
+
+    slot.next_token = token;
+    slot.decoding = true;
+}
+
+// One sequence at a time, so the branches of a conversation used last (and
+// the sessions of other conversations) outlive the ones left behind
+bool BatchScheduler::evict_lru_slot() {
+    Slot* victim = nullptr;
+    for (auto& slot : slots_) {
+        if (!slot.request && !slot.cached.empty() && (!victim || slot.last_used < victim->last_used)) {
+            victim = &slot;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+    LOGI("Evicting idle sequence %d (%zu tokens)", victim->seq_id, victim->cached.size());
+    swap_out(*victim);
+    drop_seq(*victim);
+    return true;
+}
+
+// Copy the tokens and cells of an idle slot's session into the swap, before
+// they are dropped or the slot goes to another session
+void BatchScheduler::swap_out(Slot& slot) {
+    if (!swap_ || slot.session.empty() || slot.cached.empty()) {
+        return;
+    }
+    SwappedSession swapped;
+    swapped.state.resize(llama_state_seq_get_size(context_, slot.seq_id));
+    if (llama_state_seq_get_data(context_, swapped.state.data(), swapped.state.size(), slot.seq_id) == 0) {
+        LOGE("Failed to copy state of seq %d", slot.seq_id);
+        return;
+    }
+    swapped.tokens = slot.cached;
+    swapped.dropped = slot.dropped;
+    LOGI("Swapped out session %s from seq %d: %zu tokens, %zu bytes", slot.session.c_str(), slot.seq_id,
+         swapped.tokens.size(), swapped.state.size());
+    swap_->put(slot.session, std::move(swapped));
+}
+
+// Load session_id from the swap into slot, whose cells are dropped. Makes
+// room for it like a decode running out of cells would; if there is none,
+// the session stays in the swap and its request prefills.
+bool BatchScheduler::swap_in(Slot& slot, const std::string& session_id) {
+    SwappedSession swapped;
+    if (!swap_ || session_id.empty() || !swap_->take(session_id, swapped)) {
+        return false;
+    }
+    if (swapped.tokens.size() >= n_ctx_) {
+        grow_context(swapped.tokens.size() + 1);
+    }
+    drop_seq(slot);
+    for (;;) {
+        llama_memory_t mem = llama_get_memory(context_);
+        if (llama_state_seq_set_data(context_, swapped.state.data(), swapped.state.size(), slot.seq_id) != 0 &&
+            llama_memory_seq_pos_max(mem, slot.seq_id) + 1 == (llama_pos)swapped.tokens.size()) {
+            break;
+        }
+        llama_memory_seq_rm(mem, slot.seq_id, -1, -1);
+        if (!prefix_cache_.evict_lru() && !evict_lru_slot()) {
+            LOGE("No room to swap in session %s (%zu tokens)", session_id.c_str(), swapped.tokens.size());
+            swap_->put(session_id, std::move(swapped));
+            return false;
+        }
+    }
+    LOGI("Swapped in session %s into seq %d: %zu tokens", session_id.c_str(), slot.seq_id, swapped.tokens.size());
+    slot.cached = std::move(swapped.tokens);
+    slot.dropped = std::move(swapped.dropped);
+    slot.session = session_id;
+    return true;
+}
+
+void BatchScheduler::run_on_thread(std::function<void()> fn) {
+    std::packaged_task<void()> task(std::move(fn));
+    std::future<void> done = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+    wakeup_->raise();
+    done.wait();
+}
+
+bool BatchScheduler::save_session(const std::string& session_id, const std::vector<llama_token>& stored,
+                                  SessionSnapshot& snapshot) {
+    bool ok = false;
+    run_on_thread([&] {
+        for (auto& slot : slots_) {
+            if (slot.session != session_id || slot.cached.empty()) {
+                continue;
+            }
+
+            SessionFrame frame;
+            if (stored.size() <= slot.cached.size() &&
+                std::equal(stored.begin(), stored.end(), slot.cached.begin())) {
+                frame.base = (uint32_t)stored.size();
+            }
+            snapshot.model_params = llama_model_n_params(llama_get_model(context_));
+            snapshot.tokens = slot.cached;
+            if (frame.base == slot.cached.size()) {
+                // Nothing new since the last save
+                snapshot.frames.push_back(std::move(frame));
+                ok = true;
+                return;
+            }
+
+            // Cells before base are already on disk: copy only the ones after
+            // it into the scratch sequence and serialize that
+            llama_memory_t mem = llama_get_memory(context_);
+            llama_seq_id seq_id = slot.seq_id;
+            if (frame.base > 0) {
+                llama_memory_seq_cp(mem, slot.seq_id, scratch_seq_, frame.base, -1);
+                seq_id = scratch_seq_;
+            }
+            const size_t n_state = llama_state_seq_get_size(context_, seq_id);
+            frame.state.resize(n_state);
+            ok = llama_state_seq_get_data(context_, frame.state.data(), n_state, seq_id) != 0;
+            llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+            if (!ok) {
+                LOGE("Failed to copy state of seq %d", slot.seq_id);
+                return;
+            }
+            snapshot.frames.push_back(std::move(frame));
+            return;
+        }
+
+        // Swapped out: its whole state is at hand as a keyframe
+        SwappedSession swapped;
+        if (swap_ && swap_->copy(session_id, swapped)) {
+            SessionFrame frame;
+            frame.state = std::move(swapped.state);
+            snapshot.model_params = llama_model_n_params(llama_get_model(context_));
+            snapshot.tokens = std::move(swapped.tokens);
+            snapshot.frames.push_back(std::move(frame));
+            ok = true;
+            return;
+        }
+        LOGE("No sequence holds session %s", session_id.c_str());
+    });
+    return ok;
+}
+
+bool BatchScheduler::restore_session(const std::string& session_id, const SessionSnapshot& snapshot) {
+    bool ok = false;
+    run_on_thread([&] {
+        Slot* target = nullptr;
+        for (auto& slot : slots_) {
+            if (slot.request) {
+                continue;
+            }
+            if (slot.session == session_id) {
+                target = &slot;
+                break;
+            }
+            if (!target || slot.last_used < target->last_used) {
+                target = &slot;
+            }
+        }
+        if (!target) {
+            LOGE("No idle sequence to restore session %s into", session_id.c_str());
+            return;
+        }
+        // The snapshot supersedes what the swap keeps of the session
+        if (swap_) {
+            swap_->forget(session_id);
+        }
+        if (target->session != session_id) {
+            swap_out(*target);
+        }
+        if (snapshot.tokens.size() >= n_ctx_) {
+            grow_context(snapshot.tokens.size() + 1);
+        }
+
+        // The keyframe goes straight into the sequence; each delta is loaded
+        // into the scratch sequence and its cells are then shared with it
+        drop_seq(*target);
+        llama_memory_t mem = llama_get_memory(context_);
+        bool loaded = true;
+        for (size_t i = 0; loaded && i < snapshot.frames.size(); i++) {
+            const SessionFrame& frame = snapshot.frames[i];
+            const llama_seq_id seq_id = i == 0 ? target->seq_id : scratch_seq_;
+            loaded = llama_state_seq_set_data(context_, frame.state.data(), frame.state.size(), seq_id) != 0;
+            if (loaded && i > 0) {
+                llama_memory_seq_cp(mem, scratch_seq_, target->seq_id, -1, -1);
+            }
+            llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+        }
+        if (!loaded || llama_memory_seq_pos_max(mem, target->seq_id) + 1 != (llama_pos)snapshot.tokens.size()) {
+            LOGE("Failed to load state of session %s", session_id.c_str());
+            drop_seq(*target);
+            return;
+        }
+        target->cached = snapshot.tokens;
+        target->session = session_id;
+        target->last_used = ++clock_;
+        ok = true;
+
+        LOGI("Restored session %s into seq %d: %zu tokens", session_id.c_str(), target->seq_id, target->cached.size());
+    });
+    return ok;
+}
+
+bool BatchScheduler::compute_document(const std::vector<llama_token>& tokens, std::vector<uint8_t>& state) {
+    bool ok = false;
+    run_on_thread([&] {
+        if (tokens.size() >= n_ctx_) {
+            grow_context(tokens.size() + 1);
+        }
+        llama_memory_t mem = llama_get_memory(context_);
+        for (size_t pos = 0; pos < tokens.size();) {
+            batch_.n_tokens = 0;
+            for (; pos < tokens.size() && batch_.n_tokens < n_batch_; pos++) {
+                batch_add(batch_, tokens[pos], pos, scratch_seq_, false);
+            }
+            if (llama_decode(context_, batch_) != 0) {
+                LOGE("Failed to prefill document of %zu tokens", tokens.size());
+                llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+                return;
+            }
+        }
+        state.resize(llama_state_seq_get_size(context_, scratch_seq_));
+        ok = llama_state_seq_get_data(context_, state.data(), state.size(), scratch_seq_) != 0;
+        llama_memory_seq_rm(mem, scratch_seq_, -1, -1);
+    });
+    return ok;
+}
+
+void BatchScheduler::forget_session(const std::string& session_id) {
+    if (swap_) {
+        swap_->forget(session_id);
+    }
+}
+
+bool BatchScheduler::idle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_flight_.empty();
+}
+
+int64_t BatchScheduler::idle_ms() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!in_flight_.empty()) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                 last_active_).count();
+}
+
+void BatchScheduler::trim(int32_t level) {
+    run_on_thread([&] {
+        while (prefix_cache_.evict_lru()) {
+        }
+        if (level >= kTrimSessions) {
+            for (auto& slot : slots_) {
+                if (!slot.request && !slot.cached.empty()) {
+                    swap_out(slot);
+                    drop_seq(slot);
+                }
+            }
+        }
+        if (swap_) {
+            swap_->spill_all();
+        }
+        fit_context(level >= kTrimSessions ? std::min(min_n_ctx_, kTrimmedContextSize) : min_n_ctx_);
+    });
+}
+
+std::unique_ptr<SessionSwap> BatchScheduler::suspend() {
+    std::unique_ptr<SessionSwap> swap;
+    run_on_thread([&] {
+        for (auto& slot : slots_) {
+            if (!slot.request) {
+                swap_out(slot);
+            }
+        }
+        swap = std::move(swap_);
+    });
+    return swap;
+}
+
+void BatchScheduler::set_document_library(std::shared_ptr<DocumentLibrary> library) {
+    // Slots keep the library of their pending document runs alive
+    run_on_thread([&] { documents_ = std::move(library); });
+}
+
+void BatchScheduler::run() {
+    for (;;) {
+        std::vector<std::shared_ptr<GenerationRequest>> admitted;
+        std::deque<std::packaged_task<void()>> tasks;
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] {
+                if (stopping_.load(std::memory_order_relaxed) || !pending_.empty() || !tasks_.empty()) {
+                    return true;
+                }
+                for (const auto& slot : slots_) {
+                    if (slot.request) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+            tasks.swap(tasks_);
+            stopping = stopping_.load(std::memory_order_relaxed);
+
+            size_t n_free = 0;
+            for (const auto& slot : slots_) {
+                n_free += slot.request ? 0 : 1;
+            }
+
+            // Waiting requests go before background prefills, and take over
+            // their sequences (with the tokens prefilled so far) if need be
+            auto waiting_end = std::stable_partition(pending_.begin(), pending_.end(),
+                [](const std::shared_ptr<GenerationRequest>& request) { return !request->background; });
+            size_t n_preempt = (size_t)(waiting_end - pending_.begin());
+            n_preempt = n_preempt > n_free ? n_preempt - n_free : 0;
+            for (auto& slot : slots_) {
+                if (n_preempt > 0 && slot.request && slot.request->background) {
+                    slot.request->cancel();
+                    n_preempt--;
+                }
+            }
+            for (auto it = pending_.begin(); it != pending_.end();) {
+                // Requests identical to a running or just admitted one need
+                // no sequence of their own
+                const GenerationRequest& request = **it;
+                const bool follows = find_leader(request) ||
+                    std::any_of(admitted.begin(), admitted.end(), [&](const std::shared_ptr<GenerationRequest>& other) {
+                        return identical(*other, request);
+                    });
+                if (follows) {
+                    admitted.push_back(std::move(*it));
+                    it = pending_.erase(it);
+                    continue;
+                }
+                if (n_free == 0) {
+                    ++it;
+                    continue;
+                }
+                // A prepare waits while its session's sequence is busy rather
+                // than prefilling the history into another one
+                const std::string& session_id = (*it)->params.session_id;
+                const bool session_busy = (*it)->background &&
+                    std::any_of(slots_.begin(), slots_.end(), [&](const Slot& slot) {
+                        return slot.request && slot.session == session_id;
+                    });
+                if (session_busy) {
+                    ++it;
+                    continue;
+                }
+                admitted.push_back(std::move(*it));
+                it = pending_.erase(it);
+                n_free--;
+            }
+        }
+
+        // Session snapshots run between steps, when every sequence's cells
+        // match its cached tokens
+        for (auto& task : tasks) {
+            task();
+        }
+        if (stopping) {
+            // Requests still in in_flight_ are marked done by the destructor
+            break;
+        }
+
+        // A superseded prepare hands its sequence to the request of its
+        // session admitted right below
+        for (auto& slot : slots_) {
+            if (slot.request && slot.request->background && slot.request->cancelled.load(std::memory_order_acquire)) {
+                retire(slot);
+            }
+        }
+
+        // Admit waiting requests into free sequences
+        for (auto& request : admitted) {
+            std::vector<llama_token> prompt = std::move(request->prompt_tokens);
+            if (request->cancelled.load(std::memory_order_acquire) ||
+                (prompt.empty() && !tokenize(vocab_, request->params.prompt, prompt)) || prompt.empty()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                in_flight_.erase(std::remove(in_flight_.begin(), in_flight_.end(), request), in_flight_.end());
+                request->mark_done();
+                continue;
+            }
+            if (Slot* leader = find_leader(*request)) {
+                follow(*leader, std::move(request));
+                continue;
+            }
+            Slot* slot = pick_slot(prompt, request->params.session_id);
+            if (!slot) {
+                // The request it was to follow was cancelled before admission
+                request->prompt_tokens = std::move(prompt);
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.push_front(std::move(request));
+                continue;
+            }
+            slot->prompt = std::move(prompt);
+            admit(*slot, std::move(request));
+        }
+
+        // Retire cancelled requests and deliver held-back events
+        bool any_active = false;
+        for (auto& slot : slots_) {
+            slot.batch_index = -1;
+            slot.n_batched = 0;
+            if (!slot.request) {
+                continue;
+            }
+            if (slot.request->cancelled.load(std::memory_order_acquire) && !promote_follower(slot)) {
+                retire(slot);
+                continue;
+            }
+            if (slot.draining) {
+                if (flush_backlog(slot)) {
+                    release_slot(slot);
+                }
+                continue;
+            }
+            any_active = true;
+        }
+        if (!any_active) {
+            shrink_idle_context();
+            // Finished requests still delivering wait for their consumers
+            if (std::any_of(slots_.begin(), slots_.end(), [](const Slot& slot) { return slot.request != nullptr; })) {
+                wakeup_->wait();
+            }
+            continue;
+        }
+
+        // An elastic context grows before a sequence runs out of it: to hold
+        // a whole prompt, or by doubling while decoding
+        if (n_ctx_ < max_n_ctx_) {
+            size_t n_needed = 0;
+            for (const auto& slot : slots_) {
+                if (slot.request && !slot.draining) {
+                    n_needed = std::max(n_needed, slot.decoding ? slot.cached.size() + 1 : slot.prompt.size());
+                }
+            }
+            if (n_needed > n_ctx_) {
+                grow_context(n_needed);
+            }
+        }
+
+        // One token for every decoding sequence, then prompt chunks up to the
+        // step budget
+        batch_.n_tokens = 0;
+        step_requests_.clear();
+
+        for (auto& slot : slots_) {
+            if (!slot.request || slot.draining || !slot.decoding || !flush_backlog(slot)) {
+                continue;
+            }
+            if (slot.cached.size() >= n_ctx_ && !slide_window(slot) && (!slot.request || slot.draining)) {
+                continue;
+            }
+            slot.batch_index = batch_.n_tokens;
+            slot.n_batched = 1;
+            batch_add(batch_, slot.next_token, slot.cached.size(), slot.seq_id, true);
+            step_requests_.push_back(slot.request.get());
+        }
+
+        // A prefill-only step may fill the whole batch; with streams running it
+        // is held to the budget so their next token is not delayed
+        int32_t n_prefill_max = n_batch_ - batch_.n_tokens;
+        if (batch_.n_tokens > 0) {
+            n_prefill_max = std::min(n_prefill_max, std::max(step_budget_ - batch_.n_tokens, kMinPrefillTokens));
+        }
+        const int32_t n_prefill_end = batch_.n_tokens + n_prefill_max;
+
+        // Start from a different prefilling slot each step, so a short prompt
+        // admitted behind a long one does not wait for it to finish.
+        // Background prefills come second and only get what is left of the
+        // step budget.
+        const size_t first = prefill_cursor_;
+        bool any_prefill = false;
+        for (int pass = 0; pass < 2; pass++) {
+            const bool background = pass == 1;
+            const int32_t n_end_max = !background || batch_.n_tokens == 0
+                ? n_prefill_end : std::min(n_prefill_end, step_budget_);
+            for (size_t k = 0; k < slots_.size() && batch_.n_tokens < n_end_max; k++) {
+                Slot& slot = slots_[(first + k) % slots_.size()];
+                if (!slot.request || slot.request->background != background || slot.draining || slot.decoding ||
+                    !flush_backlog(slot)) {
+                    continue;
+                }
+                if (!any_prefill) {
+                    prefill_cursor_ = (first + k + 1) % slots_.size();
+                    any_prefill = true;
+                }
+                if (slot.cached.size() >= n_ctx_ && !slide_window(slot) && (!slot.request || slot.draining)) {
+                    continue;
+                }
+                // Up to the next stashed run, which is put back after this step,
+                // and the end of the context, where the sequence slides
+                const size_t n_end = slot.reused.empty() ? slot.prompt.size() : slot.reused.front().pos;
+                const size_t n_left = n_end - slot.cached.size();
+                size_t n_chunk = std::min(n_left, (size_t)(n_end_max - batch_.n_tokens));
+                if (sink_tokens_ >= 0) {
+                    n_chunk = std::min(n_chunk, n_ctx_ - slot.cached.size());
+                }
+                for (size_t i = 0; i < n_chunk; i++) {
+                    const size_t pos = slot.cached.size() + i;
+                    const bool last = pos + 1 == slot.prompt.size();
+                    if (last) {
+                        slot.batch_index = batch_.n_tokens;
+                    }
+                    batch_add(batch_, slot.prompt[pos], pos, slot.seq_id, last);
+                }
+                slot.n_batched = n_chunk;
+                step_requests_.push_back(slot.request.get());
+            }
+        }
+
+        if (batch_.n_tokens == 0) {
+            // Every running request waits for its consumer to catch up
+            wakeup_->wait();
+            continue;
+        }
+
+        const int32_t ret = llama_decode(context_, batch_);
+        step_requests_.clear();
+
+        if (ret != 0) {
+            if (ret == 2) {
+                LOGI("Decode aborted");
+            } else {
+                LOGE("Failed to decode batch of %d tokens (%d)", batch_.n_tokens, ret);
+            }
+
+            // Out of KV space: drop the least recently used prefix cache leaf,
+            // once the cache is empty the least recently used idle sequence,
+            // and retry
+            bool retry = ret == 1 && (prefix_cache_.evict_lru() || evict_lru_slot());
+
+            for (auto& slot : slots_) {
+                if (slot.n_batched > 0) {
+                    drop_uncached_cells(slot);
+                }
+            }
+            // Then an elastic context grows, and at its largest the longest
+            // running sequence slides
+            if (ret == 1 && !retry) {
+                retry = grow_context(n_ctx_ + 1) || slide_longest_window();
+            }
+
+            for (auto& slot : slots_) {
+                if (slot.n_batched == 0 || !slot.request || slot.draining) {
+                    continue;
+                }
+                if (ret != 2 && !retry) {
+                    drop_seq(slot);
+                    retire(slot);
+                }
+            }
+            continue;
+        }
+
+        for (auto& slot : slots_) {
+            if (slot.n_batched == 0) {
+                continue;
+            }
+            GenerationRequest& request = *slot.request;
+
+            if (slot.decoding) {
+                slot.cached.push_back(slot.next_token);
+                request.n_generated++;
+                if (request.n_generated >= request.params.max_tokens) {
+                    cache_reply(slot, false);
+                    retire(slot);
+                } else {
+                    sample(slot);
+                }
+                continue;
+            }
+
+            slot.cached.insert(slot.cached.end(),
+                               slot.prompt.begin() + slot.cached.size(),
+                               slot.prompt.begin() + slot.cached.size() + slot.n_batched);
+            place_reused_chunks(slot);
+
+            StreamEvent event;
+            event.type = StreamEventType::PrefillProgress;
+            event.n_prefilled = (int32_t)(slot.dropped.size() + slot.cached.size());
+            event.n_total = (int32_t)(slot.dropped.size() + slot.prompt.size());
+            emit(slot, std::move(event));
+
+            if (slot.cached.size() == slot.prompt.size()) {
+                request.ok = true;
+                if (request.params.max_tokens <= 0) {
+                    retire(slot);
+                } else {
+                    sample(slot);
+                }
+            }
+        }
+    }
+}
+
+} // namespace flutter_llama
@@ -0,0 +1,409 @@
+/*
+ * Flutter Llama - continuous-batching scheduler
+ *
+ * Serves all generation requests of one llama_context. Every running request
+ * owns a sequence id; each step packs one sampled token per decoding sequence
+ * plus prompt chunks of newly admitted ones into a single llama_batch, so
+ * concurrent requests share each pass over the weights instead of queueing
+ * behind each other. A request retires as soon as it finishes and its
+ * sequence is handed to the next waiting request.
+ *
+ * While any sequence is decoding, prompt chunks are capped so a step never
+ * exceeds step_budget tokens: a long prompt is prefilled over many steps
+ * and running streams keep getting a token per step in the meantime.
+ *
+ * Runs of a sequence's earlier history that reappear in a new prompt after
+ * the point where the two diverge (an edited or deleted message in the
+ * middle of a chat) are copied out, shifted to their new positions and put
+ * back when prefill reaches them, so only the changed tokens are decoded.
+ * Runs of the documents of a DocumentLibrary are spliced in the same way.
+ *
+ * Background requests (prepare) only prefill a prompt into a session's
+ * sequence. They get the prefill tokens a step has left over, give up their
+ * sequence to any request waiting for one, and are superseded by the next
+ * request of their session, which finds the prefilled tokens in the cache.
+ *
+ * A sequence that reaches the context size slides: its first sink_tokens
+ * (the attention sinks) and last recent_window tokens are kept, the ones in
+ * between are dropped and the recent ones shifted down, and decoding goes on.
+ * The next prompt repeating the dropped tokens drops them as well, so a chat
+ * continues in the slid sequence at a fixed memory ceiling.
+ *
+ * An elastic context starts below context_size and is replaced by one twice
+ * as large when a sequence reaches its end or its cells run out, up to
+ * context_size (where sequences slide); once idle sequences use a quarter of
+ * it, it shrinks back. The whole KV state moves over at once, so cells shared
+ * between sequences stay shared.
+ *
+ * With a SessionSwap, an idle session's cells are copied out before its
+ * sequence goes to another session or is evicted, and loaded back into a
+ * free sequence when the session's next request comes, so far more sessions
+ * than sequences keep their history without prefilling it again.
+ *
+ * Greedy requests whose prompt a ResponseCache has seen are answered from it
+ * in submit, without being queued at all. A request identical to one
+ * running (same session, prompt tokens and sampling settings; the
+ * sampler's seed is fixed, so they would generate the same tokens) follows
+ * it instead of taking a sequence: it gets the tokens generated so far,
+ * then every event of the running one, and its result. If the running
+ * request is cancelled, a follower takes over its sequence.
+ *
+ * Sampled text goes through the request's StopMatcher before it is handed
+ * out, and a request ends on the token that completes one of its stop
+ * sequences instead of running on to max_tokens.
+ */
+
+#ifndef FLUTTER_LLAMA_BATCH_SCHEDULER_H
+#define FLUTTER_LLAMA_BATCH_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+
+#include "document_library.h"
+#include "llama_engine.h"
+#include "prefix_cache.h"
+#include "prompt_cache.h"
+#include "response_cache.h"
+#include "session_file.h"
+#include "session_swap.h"
+#include "spsc_queue.h"
+#include "stop_matcher.h"
+
+namespace flutter_llama {
+
+// Events buffered between the scheduler and a stream consumer before the
+// request stops being scheduled until the consumer catches up
+static constexpr size_t kStreamQueueCapacity = 256;
+
+// Prompt tokens a step takes even when decoding sequences use up the whole
+// step budget, so prefill never starves
+static constexpr int32_t kMinPrefillTokens = 16;
+
+// Leaves of the prefix cache, each holding one sequence id
+static constexpr int32_t kPrefixCacheSequences = 8;
+
+// Shortest prefix worth a prompt cache file: below this, prefilling costs
+// about as much as reading the file back
+static constexpr size_t kPromptCacheMinTokens = 256;
+
+// Cells trim(kTrimSessions) cuts a KV cache down to when what is left fits;
+// it grows back like an elastic context
+static constexpr size_t kTrimmedContextSize = 256;
+
+// Raised when the scheduler may be able to go on: a consumer made room in its
+// queue, a request was cancelled or queued, or a task is waiting. Shared with
+// the requests, so a consumer can raise it after the scheduler is gone.
+class SchedulerWakeup {
+public:
+    void raise();
+
+    // Blocks until raised since the last wait returned
+    void wait();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool raised_ = false;
+};
+
+struct GenerationRequest {
+    GenerationParams params;
+
+    // Used instead of tokenizing params.prompt when not empty
+    std::vector<llama_token> prompt_tokens;
+
+    // Streaming requests hand events to the thread calling stream_next;
+    // blocking ones accumulate text
+    bool streaming = false;
+    SpscQueue<StreamEvent> events{kStreamQueueCapacity};
+    std::string text;
+    int32_t n_generated = 0;
+
+    // Sampled tokens, in order; the end-of-generation token is not included
+    std::vector<llama_token> generated;
+
+    // params.stop_sequences, fed the text of every sampled token; it holds
+    // back the bytes a stop sequence may still start with
+    StopMatcher stop;
+
+    // Prompt tokens as submitted: what the response cache stores replies
+    // under and identical requests are coalesced on
+    std::vector<llama_token> key;
+
+    // Events of a reply served from the response cache, handed out after
+    // those of the queue once done
+    std::deque<StreamEvent> replayed;
+
+    // Events that did not fit the queue; scheduler thread only
+    std::deque<StreamEvent> backlog;
+
+    // Of the scheduler the request was submitted to, raised when the
+    // consumer pops an event or cancels
+    std::shared_ptr<SchedulerWakeup> wakeup;
+
+    // Identical requests that joined this one's decode instead of running
+    // their own; each gets the same events and result. Scheduler thread only.
+    std::vector<std::shared_ptr<GenerationRequest>> followers;
+
+    // False if the prompt could not be processed
+    bool ok = false;
+
+    // Prefill only, at low priority; see BatchScheduler::prepare
+    bool background = false;
+
+    // Set through cancel by the owner (stream_end, stop_generation); the
+    // scheduler retires the request at the next step and aborts a decode only
+    // it is part of
+    std::atomic<bool> cancelled{false};
+
+    // Set by the scheduler once it no longer touches the request
+    std::atomic<bool> done{false};
+
+    // Blocks until done
+    void wait();
+
+    // Streaming requests: the next event, blocking until the scheduler queues
+    // one. False once the request is done or cancelled and nothing is left.
+    bool next_event(StreamEvent& event);
+
+    // Sets cancelled and wakes a thread blocked in next_event
+    void cancel();
+
+    // Wakes a thread blocked in next_event after events were queued
+    void notify();
+
+private:
+    friend class BatchScheduler;
+    void mark_done();
+
+    // Signalled when events are queued, on cancel and once done
+    std::mutex signal_mutex;
+    std::condition_variable signal_cv;
+};
+
+// Tokenize with special tokens and, unless add_special is false (text to be
+// found inside prompts), with BOS as every prompt is
+bool tokenize(const llama_vocab* vocab, const std::string& text, std::vector<llama_token>& tokens,
+              bool add_special = true);
+
+class BatchScheduler {
+public:
+    // params.max_sequences concurrent sequences; the context needs n_seq_max
+    // of sequences_needed(max_sequences, pinned_prefixes.size()). Takes over
+    // context, created with context_params, which larger or smaller contexts
+    // are created with as well. The pinned prefixes are prefilled (or loaded
+    // from prompt_cache, which may be null) before the constructor returns.
+    // session_swap and response_cache may be null too.
+    BatchScheduler(llama_context* context, const llama_context_params& context_params, const llama_vocab* vocab,
+                   const ContextParams& params, std::unique_ptr<PromptCache> prompt_cache,
+                   std::unique_ptr<SessionSwap> session_swap, std::shared_ptr<ResponseCache> response_cache);
+
+    // Request slots, then a scratch sequence for moving cells between
+    // sequences, then one per pinned prefix, then the prefix cache's
+    static int32_t sequences_needed(int32_t n_slots, int32_t n_pinned);
+    ~BatchScheduler();
+
+    BatchScheduler(const BatchScheduler&) = delete;
+    BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+    // Cells of the KV cache now, and the most an elastic context grows to
+    uint32_t n_ctx() const { return (uint32_t)n_ctx_.load(std::memory_order_relaxed); }
+    uint32_t max_n_ctx() const { return (uint32_t)max_n_ctx_; }
+
+    // Queue a request; it is admitted as soon as a sequence is free. A hit
+    // of the response cache is done on return.
+    void submit(std::shared_ptr<GenerationRequest> request);
+
+    // Cancel every queued and running request
+    void cancel_all();
+
+    // Prefill text into the sequence of session_id in the background, rolling
+    // back only what differs from the text prepared before. Returns at once;
+    // the next request of the session (prepare or not) supersedes this one.
+    void prepare(const std::string& session_id, const std::string& text);
+
+    // Copy the tokens of the sequence last used by session_id and, as a single
+    // frame, its KV cells. If stored (the tokens already saved) is a prefix of
+    // the sequence, the frame only holds the cells after it. Returns false if
+    // no sequence holds the session.
+    bool save_session(const std::string& session_id, const std::vector<llama_token>& stored,
+                      SessionSnapshot& snapshot);
+
+    // Load the frames of snapshot into an idle sequence (the session's own one
+    // if it has one, else the least recently used) and tag it with session_id
+    bool restore_session(const std::string& session_id, const SessionSnapshot& snapshot);
+
+    // Drop what the swap keeps of a session that will not come back
+    void forget_session(const std::string& session_id);
+
+    // No request is queued or running
+    bool idle();
+
+    // Milliseconds since a request was last queued or finished; 0 while any
+    // is queued or running
+    int64_t idle_ms();
+
+    // Give back memory the context can do without for now, at kTrimCaches
+    // or kTrimSessions (see trim_memory); running requests are not touched
+    void trim(int32_t level);
+
+    // Swap out every idle session and hand over the swap (null if there is
+    // none), for it to outlive this scheduler while the model is unloaded
+    std::unique_ptr<SessionSwap> suspend();
+
+    // Prefill tokens on their own at positions [0, tokens.size()) and copy
+    // out their cells for a document library
+    bool compute_document(const std::vector<llama_token>& tokens, std::vector<uint8_t>& state);
+
+    // Splice runs of library's documents into later prompts; null stops
+    void set_document_library(std::shared_ptr<DocumentLibrary> library);
+
+private:
+    // Cells of tokens matching prompt[pos, pos + n_tokens), decoded at
+    // positions [from, from + n_tokens): a run of an earlier history copied out
+    // of the KV cache, or one of a library document
+    struct ReusedChunk {
+        size_t pos = 0;
+        size_t n_tokens = 0;
+        llama_pos from = 0;
+        std::vector<uint8_t> state;
+
+        // Set for document runs, whose cells are those of the whole document
+        std::shared_ptr<DocumentLibrary> library;
+        size_t doc = 0;
+    };
+
+    struct Slot {
+        llama_seq_id seq_id = 0;
+
+        // Session of the request that last used the sequence, if it had one
+        std::string session;
+        uint64_t last_used = 0;
+
+        // Tokens held in the KV cache for seq_id, in position order. Kept after
+        // the request retires so the next one can reuse the shared prefix.
+        std::vector<llama_token> cached;
+
+        // Tokens slid out after the first sink_tokens_ of cached, in order
+        std::vector<llama_token> dropped;
+
+        std::shared_ptr<GenerationRequest> request;
+        llama_sampler* sampler = nullptr;
+        std::vector<llama_token> prompt;
+
+        // Runs of the previous history found further on in prompt, in
+        // position order; each is put back once cached reaches it
+        std::deque<ReusedChunk> reused;
+
+        llama_token next_token = 0;     // sampled, waiting to be decoded
+        bool decoding = false;          // prompt done, next_token is valid
+        bool draining = false;          // finished, delivering the backlogs
+        int32_t batch_index = -1;       // logits row in the current batch
+        size_t n_batched = 0;           // tokens of this slot in the current batch
+    };
+
+    // Prompt prefix whose cells a sequence of its own keeps for the whole
+    // lifetime of the context
+    struct PinnedPrefix {
+        llama_seq_id seq_id = 0;
+        std::vector<llama_token> tokens;
+    };
+
+    void run();
+    void run_on_thread(std::function<void()> fn);
+    void pin_prefix(const std::string& text, llama_seq_id seq_id);
+    Slot* pick_slot(const std::vector<llama_token>& prompt, const std::string& session_id);
+    void admit(Slot& slot, std::shared_ptr<GenerationRequest> request);
+    void stash_reusable_chunks(Slot& slot, size_t n_common, size_t n_prefix);
+    void add_document_chunks(Slot& slot, size_t n_prefix);
+    void place_reused_chunks(Slot& slot);
+    void compact_prompt(Slot& slot);
+    bool slide_window(Slot& slot);
+    bool slide_longest_window();
+    bool resize_context(size_t n_ctx);
+    bool grow_context(size_t n_needed);
+    void shrink_idle_context();
+    void fit_context(size_t n_floor);
+    size_t longest_sequence();
+    bool load_stored_prefix(const std::vector<llama_token>& tokens, size_t n_tokens, llama_seq_id seq_id);
+    void store_prefix(const std::vector<llama_token>& tokens, size_t n_tokens, llama_seq_id seq_id);
+    void retire(Slot& slot);
+    void release_slot(Slot& slot);
+    void drop_seq(Slot& slot);
+    void drop_uncached_cells(Slot& slot);
+    void emit(Slot& slot, StreamEvent&& event);
+    bool flush_backlog(Slot& slot);
+    Slot* find_leader(const GenerationRequest& request);
+    void follow(Slot& slot, std::shared_ptr<GenerationRequest> follower);
+    bool promote_follower(Slot& slot);
+    void sample(Slot& slot);
+    bool serve_cached(GenerationRequest& request);
+    void cache_reply(Slot& slot, bool complete);
+    bool evict_lru_slot();
+    void swap_out(Slot& slot);
+    bool swap_in(Slot& slot, const std::string& session_id);
+
+    static bool abort_callback(void* data);
+
+    llama_context* context_;
+    llama_context_params context_params_;
+    const llama_vocab* vocab_;
+    llama_batch batch_;
+    int32_t n_batch_;
+    int32_t step_budget_;
+    int32_t cache_reuse_;
+    std::atomic<size_t> n_ctx_;
+    size_t min_n_ctx_;          // the size an elastic context starts at
+    size_t max_n_ctx_;
+    int32_t sink_tokens_;       // < 0: sequences do not slide
+    size_t recent_window_;
+
+    // Slot the next step starts handing out prompt tokens from, so several
+    // long prompts advance together
+    size_t prefill_cursor_ = 0;
+
+    std::vector<Slot> slots_;
+    llama_seq_id scratch_seq_;
+    std::vector<PinnedPrefix> pinned_;
+    PrefixCache prefix_cache_;
+    std::unique_ptr<PromptCache> prompt_cache_;
+    std::unique_ptr<SessionSwap> swap_;
+    std::shared_ptr<ResponseCache> response_cache_;
+    std::shared_ptr<DocumentLibrary> documents_;
+    uint64_t clock_ = 0;
+
+    // Requests taking part in the llama_decode call running right now
+    std::vector<GenerationRequest*> step_requests_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<GenerationRequest>> pending_;
+
+    // Waited on instead of cv_ while every running request waits for its
+    // consumer; raised wherever cv_ is notified as well
+    std::shared_ptr<SchedulerWakeup> wakeup_ = std::make_shared<SchedulerWakeup>();
+    std::deque<std::packaged_task<void()>> tasks_;
+    std::vector<std::shared_ptr<GenerationRequest>> in_flight_;
+    std::unordered_map<std::string, std::shared_ptr<GenerationRequest>> prepared_; // session -> prepare
+    std::chrono::steady_clock::time_point last_active_ = std::chrono::steady_clock::now();
+    std::atomic<bool> stopping_{false};
+
+    std::thread thread_;
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_BATCH_SCHEDULER_H
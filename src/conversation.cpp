@@ -0,0 +1,104 @@
+/*
+ * Flutter Llama - natively kept chat history
+ */
+
+#include "conversation.h"
+
+#include "batch_scheduler.h"
+#include "flutter_llama_log.h"
+
+namespace flutter_llama {
+
+Conversation::Conversation(const llama_vocab* vocab, const char* chat_template)
+    : vocab_(vocab), template_(chat_template ? chat_template : ""), has_template_(chat_template != nullptr) {}
+
+void Conversation::append_message(const std::string& role, const std::string& content) {
+    messages_.push_back({role, content});
+}
+
+bool Conversation::apply_template(std::string& text) const {
+    std::vector<llama_chat_message> chat;
+    size_t n_chars = 0;
+    chat.reserve(messages_.size());
+    for (const auto& message : messages_) {
+        chat.push_back({message.role.c_str(), message.content.c_str()});
+        n_chars += message.role.size() + message.content.size();
+    }
+
+    const char* tmpl = has_template_ ? template_.c_str() : nullptr;
+    text.resize(2 * n_chars + 256);
+    int32_t n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, &text[0], (int32_t)text.size());
+    if (n > (int32_t)text.size()) {
+        text.resize(n);
+        n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), true, &text[0], (int32_t)text.size());
+    }
+    if (n < 0) {
+        LOGE("Chat template of the model is not supported");
+        return false;
+    }
+    text.resize(n);
+    return true;
+}
+
+bool Conversation::prompt_tokens(std::vector<llama_token>& tokens) {
+    std::string text;
+    if (!apply_template(text)) {
+        return false;
+    }
+
+    if (!tokens_.empty() && text.size() >= rendered_.size() && text.compare(0, rendered_.size(), rendered_) == 0) {
+        // Without BOS: the text continues the history
+        std::vector<llama_token> delta;
+        if (!tokenize(vocab_, text.substr(rendered_.size()), delta, false)) {
+            return false;
+        }
+        tokens_.insert(tokens_.end(), delta.begin(), delta.end());
+    } else {
+        marks_.clear();
+        // The first turn, or a template that rewrites earlier turns (e.g.
+        // drops the reasoning of past replies): start over
+        if (!tokens_.empty()) {
+            LOGI("Chat template changed earlier turns, tokenizing %zu messages again", messages_.size());
+        }
+        if (!tokenize(vocab_, text, tokens_)) {
+            tokens_.clear();
+            rendered_.clear();
+            return false;
+        }
+    }
+    rendered_ = std::move(text);
+    add_mark();
+    tokens = tokens_;
+    return true;
+}
+
+void Conversation::add_reply(const std::string& text, const std::vector<llama_token>& tokens) {
+    messages_.push_back({"assistant", text});
+    rendered_ += text;
+    tokens_.insert(tokens_.end(), tokens.begin(), tokens.end());
+    add_mark();
+}
+
+void Conversation::add_mark() {
+    while (!marks_.empty() && marks_.back().n_messages >= messages_.size()) {
+        marks_.pop_back();
+    }
+    marks_.push_back({messages_.size(), rendered_.size(), tokens_.size()});
+}
+
+void Conversation::rollback(size_t n_messages) {
+    if (n_messages >= messages_.size()) {
+        return;
+    }
+    messages_.resize(n_messages);
+    while (!marks_.empty() && marks_.back().n_messages > n_messages) {
+        marks_.pop_back();
+    }
+    // The next prompt_tokens continues from the mark, or starts over if
+    // there is none
+    const Mark mark = marks_.empty() ? Mark{0, 0, 0} : marks_.back();
+    rendered_.resize(mark.rendered_size);
+    tokens_.resize(mark.n_tokens);
+}
+
+} // namespace flutter_llama
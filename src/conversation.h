@@ -0,0 +1,81 @@
+/*
+ * Flutter Llama - natively kept chat history
+ *
+ * Formats a conversation with the model's chat template
+ * (llama_chat_apply_template) and keeps the tokens of everything formatted
+ * so far. Each turn only the text the template adds after them (the new
+ * messages and the opening of the assistant's reply) is tokenized, and the
+ * reply enters the history as the tokens that were sampled, so the prompt
+ * of every turn continues the KV cache of the previous one token for token.
+ *
+ * Rolling back to an earlier message count keeps the tokens formatted up to
+ * there, so regenerating a reply or resending an edited message continues
+ * the shared prefix as well; copies of a Conversation are forks of it.
+ */
+
+#ifndef FLUTTER_LLAMA_CONVERSATION_H
+#define FLUTTER_LLAMA_CONVERSATION_H
+
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+class Conversation {
+public:
+    // chat_template as returned by llama_model_chat_template; null picks the
+    // template llama_chat_apply_template falls back to (chatml)
+    Conversation(const llama_vocab* vocab, const char* chat_template);
+
+    void append_message(const std::string& role, const std::string& content);
+
+    // Tokens of the whole history followed by the opening of an assistant
+    // message. Returns false if the template cannot be applied.
+    bool prompt_tokens(std::vector<llama_token>& tokens);
+
+    // Append the reply generated for the last prompt_tokens: text as message,
+    // tokens (as sampled) as its part of the history
+    void add_reply(const std::string& text, const std::vector<llama_token>& tokens);
+
+    // Keep only the first n_messages messages, with the tokens of the
+    // longest formatted part of them
+    void rollback(size_t n_messages);
+
+    size_t size() const { return messages_.size(); }
+
+    // The vocab of the same model loaded again
+    void set_vocab(const llama_vocab* vocab) { vocab_ = vocab; }
+
+private:
+    struct Message {
+        std::string role;
+        std::string content;
+    };
+
+    // Formatted text and tokens up to a point where the history had
+    // n_messages messages
+    struct Mark {
+        size_t n_messages;
+        size_t rendered_size;
+        size_t n_tokens;
+    };
+
+    bool apply_template(std::string& text) const;
+    void add_mark();
+
+    const llama_vocab* vocab_;
+    std::string template_;
+    bool has_template_;
+    std::vector<Message> messages_;
+
+    // Formatted text and the tokens it was turned into
+    std::string rendered_;
+    std::vector<llama_token> tokens_;
+    std::vector<Mark> marks_;           // ascending
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_CONVERSATION_H
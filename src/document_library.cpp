@@ -0,0 +1,252 @@
+/*
+ * Flutter Llama - precomputed document KV library
+ */
+
+#include "document_library.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flutter_llama_log.h"
+
+namespace flutter_llama {
+
+static constexpr uint32_t kLibraryMagic = 0x4c444c46;  // "FLDL"
+static constexpr uint32_t kLibraryVersion = 1;
+static constexpr uint32_t kDocumentMagic = 0x43444c46; // "FLDC"
+
+// Documents and their states start at multiples of this in the file, and so
+// in the mapping
+static constexpr size_t kDocumentAlignment = 64;
+
+// Places of one window checked per prompt position; windows repeated across
+// many documents (boilerplate) would otherwise make lookups quadratic
+static constexpr size_t kMaxWindowCandidates = 8;
+
+struct LibraryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_params;
+};
+
+struct DocumentHeader {
+    uint32_t magic;
+    uint32_t n_tokens;
+    uint64_t state_size;
+};
+
+static size_t align_up(size_t offset) {
+    return (offset + kDocumentAlignment - 1) / kDocumentAlignment * kDocumentAlignment;
+}
+
+static uint64_t hash_window(const llama_token* tokens) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < kDocumentWindow; i++) {
+        h = (h ^ (uint32_t)tokens[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+std::shared_ptr<DocumentLibrary> DocumentLibrary::open(const std::string& path, uint64_t model_params) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LibraryHeader)) {
+        close(fd);
+        LOGE("Not a document library: %s", path.c_str());
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        LOGE("Cannot map document library: %s", path.c_str());
+        return nullptr;
+    }
+
+    std::shared_ptr<DocumentLibrary> library(new DocumentLibrary());
+    library->path_ = path;
+    library->mapping_ = mapping;
+    library->mapping_size_ = (size_t)st.st_size;
+
+    const auto* data = static_cast<const uint8_t*>(mapping);
+    LibraryHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != kLibraryMagic || header.version != kLibraryVersion) {
+        LOGE("Not a document library: %s", path.c_str());
+        return nullptr;
+    }
+    if (header.model_params != model_params) {
+        LOGE("Document library %s was built with a different model", path.c_str());
+        return nullptr;
+    }
+
+    // Stop at the first document that does not read back whole: the last
+    // one of a build cut short
+    size_t offset = align_up(sizeof(LibraryHeader));
+    while (offset + sizeof(DocumentHeader) <= library->mapping_size_) {
+        DocumentHeader head;
+        memcpy(&head, data + offset, sizeof(head));
+        const size_t tokens_offset = offset + sizeof(DocumentHeader);
+        const size_t state_offset = align_up(tokens_offset + (size_t)head.n_tokens * sizeof(llama_token));
+        if (head.magic != kDocumentMagic || head.state_size > library->mapping_size_ ||
+            state_offset + head.state_size > library->mapping_size_) {
+            break;
+        }
+
+        Document document;
+        document.tokens = reinterpret_cast<const llama_token*>(data + tokens_offset);
+        document.n_tokens = head.n_tokens;
+        document.state = data + state_offset;
+        document.state_size = (size_t)head.state_size;
+
+        const uint32_t index = (uint32_t)library->documents_.size();
+        for (size_t i = 0; i + kDocumentWindow <= document.n_tokens; i++) {
+            library->windows_.emplace(hash_window(document.tokens + i), std::make_pair(index, (uint32_t)i));
+        }
+        library->documents_.push_back(document);
+        offset = align_up(state_offset + (size_t)head.state_size);
+    }
+    offset = std::min(offset, library->mapping_size_);
+    library->valid_size_ = offset;
+    if (offset < library->mapping_size_) {
+        LOGE("Ignoring %zu torn bytes at the end of %s", library->mapping_size_ - offset, path.c_str());
+    }
+
+    LOGI("Opened document library %s: %zu documents", path.c_str(), library->documents_.size());
+    return library;
+}
+
+DocumentLibrary::~DocumentLibrary() {
+    if (mapping_) {
+        munmap(mapping_, mapping_size_);
+    }
+}
+
+bool DocumentLibrary::contains(const std::vector<llama_token>& tokens) const {
+    if (tokens.size() < kDocumentWindow) {
+        return false;
+    }
+    auto range = windows_.equal_range(hash_window(tokens.data()));
+    for (auto it = range.first; it != range.second; ++it) {
+        const Document& document = documents_[it->second.first];
+        if (it->second.second == 0 && document.n_tokens == tokens.size() &&
+            std::equal(tokens.begin(), tokens.end(), document.tokens)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<DocumentRun> DocumentLibrary::find(const std::vector<llama_token>& tokens, size_t begin, size_t end,
+                                               size_t n_min) const {
+    std::vector<DocumentRun> runs;
+    n_min = std::max(n_min, kDocumentWindow);
+
+    size_t p = begin;
+    while (p + n_min <= end) {
+        DocumentRun best = {0, 0, p, 0};
+        auto range = windows_.equal_range(hash_window(tokens.data() + p));
+        size_t n_checked = 0;
+        for (auto it = range.first; it != range.second && n_checked < kMaxWindowCandidates; ++it, n_checked++) {
+            const Document& document = documents_[it->second.first];
+            const size_t from = it->second.second;
+            size_t n = 0;
+            while (p + n < end && from + n < document.n_tokens && tokens[p + n] == document.tokens[from + n]) {
+                n++;
+            }
+            if (n > best.n) {
+                best = {it->second.first, from, p, n};
+            }
+        }
+        if (best.n < n_min) {
+            p++;
+            continue;
+        }
+        runs.push_back(best);
+        p += best.n;
+    }
+    return runs;
+}
+
+DocumentLibraryWriter::~DocumentLibraryWriter() {
+    close();
+}
+
+bool DocumentLibraryWriter::open(const std::string& path, uint64_t model_params) {
+    close();
+    ok_ = true;
+
+    struct stat st = {};
+    if (stat(path.c_str(), &st) == 0 && st.st_size > 0) {
+        auto library = DocumentLibrary::open(path, model_params);
+        if (!library) {
+            return false;
+        }
+        const size_t valid_size = library->valid_size();
+        library.reset();
+        if (valid_size < (size_t)st.st_size && truncate(path.c_str(), (off_t)valid_size) != 0) {
+            LOGE("Cannot cut torn documents off %s", path.c_str());
+            return false;
+        }
+        file_ = fopen(path.c_str(), "ab");
+        if (!file_) {
+            LOGE("Cannot open document library for writing: %s", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_) {
+        LOGE("Cannot create document library: %s", path.c_str());
+        return false;
+    }
+    const LibraryHeader header = {kLibraryMagic, kLibraryVersion, model_params};
+    ok_ = fwrite(&header, sizeof(header), 1, file_) == 1;
+    return ok_;
+}
+
+bool DocumentLibraryWriter::add(const std::vector<llama_token>& tokens, const std::vector<uint8_t>& state) {
+    if (!file_ || !ok_) {
+        return false;
+    }
+
+    // The padding is computed from the offset in the file, which in append
+    // mode is the end of it. Padding in front of the header rather than after
+    // the state keeps the next document aligned even if a write was torn.
+    fseek(file_, 0, SEEK_END);
+    const long end = ftell(file_);
+    const size_t offset = align_up((size_t)end);
+    const DocumentHeader head = {kDocumentMagic, (uint32_t)tokens.size(), (uint64_t)state.size()};
+    const size_t tokens_end = offset + sizeof(head) + tokens.size() * sizeof(llama_token);
+    static const uint8_t zeros[kDocumentAlignment] = {0};
+
+    ok_ = end >= 0 &&
+          fwrite(zeros, 1, offset - (size_t)end, file_) == offset - (size_t)end &&
+          fwrite(&head, sizeof(head), 1, file_) == 1 &&
+          fwrite(tokens.data(), sizeof(llama_token), tokens.size(), file_) == tokens.size() &&
+          fwrite(zeros, 1, align_up(tokens_end) - tokens_end, file_) == align_up(tokens_end) - tokens_end &&
+          fwrite(state.data(), 1, state.size(), file_) == state.size();
+    if (!ok_) {
+        LOGE("Failed to write document of %zu tokens", tokens.size());
+    }
+    return ok_;
+}
+
+bool DocumentLibraryWriter::close() {
+    if (!file_) {
+        return ok_;
+    }
+    ok_ = fclose(file_) == 0 && ok_;
+    file_ = nullptr;
+    return ok_;
+}
+
+} // namespace flutter_llama
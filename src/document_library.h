@@ -0,0 +1,122 @@
+/*
+ * Flutter Llama - precomputed document KV library
+ *
+ * Document chunks that retrieval-augmented prompts inject again and again
+ * are prefilled once, each on its own at positions [0, n), and their KV
+ * cells are appended to a library file. The file is memory-mapped when in
+ * use: states are stored uncompressed and aligned, so they go straight from
+ * the mapping to llama_state_seq_set_data. The scheduler looks up runs of
+ * library tokens in every prompt and splices their cells in, shifted to
+ * their positions, instead of prefilling them.
+ *
+ * The cells of a chunk were computed without the text in front of it, so a
+ * spliced chunk attends only to itself; answers stay close to those over a
+ * full prefill, but are not identical to them.
+ *
+ * Layout (native endianness, the file never leaves the device):
+ *   magic "FLDL", version, model_params
+ *   documents until the end of the file, each:
+ *     zero padding to kDocumentAlignment,
+ *     magic "FLDC", n_tokens, state size, tokens,
+ *     zero padding to kDocumentAlignment, state
+ */
+
+#ifndef FLUTTER_LLAMA_DOCUMENT_LIBRARY_H
+#define FLUTTER_LLAMA_DOCUMENT_LIBRARY_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+// Documents are found in prompts through windows of this many tokens, so
+// shorter runs are never spliced
+static constexpr size_t kDocumentWindow = 16;
+
+struct Document {
+    const llama_token* tokens = nullptr;
+    size_t n_tokens = 0;
+    const uint8_t* state = nullptr;
+    size_t state_size = 0;
+};
+
+// n tokens of document doc, starting at from, found at prompt position to
+struct DocumentRun {
+    size_t doc;
+    size_t from;
+    size_t to;
+    size_t n;
+};
+
+class DocumentLibrary {
+public:
+    // Map the library at path. Returns null if it is missing, is not a
+    // library or was written for another model; a torn last document is
+    // left out.
+    static std::shared_ptr<DocumentLibrary> open(const std::string& path, uint64_t model_params);
+
+    ~DocumentLibrary();
+
+    DocumentLibrary(const DocumentLibrary&) = delete;
+    DocumentLibrary& operator=(const DocumentLibrary&) = delete;
+
+    const std::string& path() const { return path_; }
+    size_t size() const { return documents_.size(); }
+    const Document& document(size_t i) const { return documents_[i]; }
+
+    // Bytes from the start of the file up to the end of the last whole document
+    size_t valid_size() const { return valid_size_; }
+
+    bool contains(const std::vector<llama_token>& tokens) const;
+
+    // Runs of at least n_min tokens of the documents in tokens[begin, end),
+    // in prompt order and not overlapping; the longest run wins at each point
+    std::vector<DocumentRun> find(const std::vector<llama_token>& tokens, size_t begin, size_t end,
+                                  size_t n_min) const;
+
+private:
+    DocumentLibrary() = default;
+
+    std::string path_;
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    size_t valid_size_ = 0;
+    std::vector<Document> documents_;
+
+    // Hash of every kDocumentWindow-token window -> (document, offset)
+    std::unordered_multimap<uint64_t, std::pair<uint32_t, uint32_t>> windows_;
+};
+
+// Appends documents to a library file, creating it if needed
+class DocumentLibraryWriter {
+public:
+    DocumentLibraryWriter() = default;
+    ~DocumentLibraryWriter();
+
+    DocumentLibraryWriter(const DocumentLibraryWriter&) = delete;
+    DocumentLibraryWriter& operator=(const DocumentLibraryWriter&) = delete;
+
+    // Fails if path exists but is not a library of the same model. A torn
+    // last document is cut off.
+    bool open(const std::string& path, uint64_t model_params);
+
+    // tokens' cells at positions [0, tokens.size()), from llama_state_seq_get_data
+    bool add(const std::vector<llama_token>& tokens, const std::vector<uint8_t>& state);
+
+    // Flushes and closes; false if anything failed to reach the file
+    bool close();
+
+private:
+    FILE* file_ = nullptr;
+    bool ok_ = true;
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_DOCUMENT_LIBRARY_H
@@ -0,0 +1,27 @@
+/*
+ * Flutter Llama - logging for the shared native core
+ *
+ * Routes to logcat on Android and to stderr (Xcode console) on Apple platforms.
+ */
+
+#ifndef FLUTTER_LLAMA_LOG_H
+#define FLUTTER_LLAMA_LOG_H
+
+#if defined(__ANDROID__)
+
+#include <android/log.h>
+
+#define LOG_TAG "FlutterLlamaCore"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+#else
+
+#include <cstdio>
+
+#define LOGI(...) do { fprintf(stderr, "[flutter_llama] " __VA_ARGS__); fputc('\n', stderr); } while (0)
+#define LOGE(...) do { fprintf(stderr, "[flutter_llama] ERROR: " __VA_ARGS__); fputc('\n', stderr); } while (0)
+
+#endif
+
+#endif // FLUTTER_LLAMA_LOG_H
@@ -0,0 +1,1102 @@
+/*
+ * Flutter Llama - shared llama.cpp engine
+ *
+ * Owns the handle table of loaded models and the table of running streams.
+ * Generation itself runs on each context's BatchScheduler.
+ */
+
+#include "llama_engine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "llama.h"
+
+#include "batch_scheduler.h"
+#include "conversation.h"
+#include "document_library.h"
+#include "flutter_llama_log.h"
+#include "model_registry.h"
+#include "prompt_cache.h"
+#include "response_cache.h"
+#include "session_file.h"
+#include "session_swap.h"
+
+namespace flutter_llama {
+
+// One loaded model: a context over (possibly shared) weights plus the
+// scheduler serving its generation requests
+struct Instance {
+    ModelHandle handle = kInvalidHandle;
+    ContextParams params;
+    std::string model_path;
+    int32_t n_gpu_layers = 0;
+    bool embeddings = false;
+
+    // Taken at load, so it is answered without reloading an unloaded handle
+    ModelInfo info;
+
+    // Held shared by every call that uses the members below (see wake), and
+    // exclusively to unload or reload them
+    std::shared_mutex lifecycle;
+    bool unloaded = false;
+    std::atomic<int64_t> last_used_ms{0};
+
+    std::shared_ptr<ModelWeights> weights;
+
+    // Embedding contexts only
+    llama_context* context = nullptr;
+
+    // Generation contexts only. Owns the context and the only thread that
+    // decodes on it.
+    std::unique_ptr<BatchScheduler> scheduler;
+
+    // Kept while unloaded, and handed to the next scheduler
+    std::unique_ptr<SessionSwap> swap;
+    std::shared_ptr<ResponseCache> responses;
+    std::shared_ptr<DocumentLibrary> documents;
+
+    // Latest text per session prepared while unloaded, handed to the
+    // scheduler once the lifecycle thread has reloaded the handle
+    std::mutex pending_mutex;
+    std::unordered_map<std::string, std::string> pending_prepares;
+
+    // Held by embed for a whole encode, and to change documents
+    std::mutex mutex;
+
+    Instance() = default;
+    Instance(const Instance&) = delete;
+    Instance& operator=(const Instance&) = delete;
+    ~Instance();
+};
+
+// Handle table
+static std::mutex g_instances_mutex;
+static std::unordered_map<ModelHandle, std::shared_ptr<Instance>> g_instances;
+static ModelHandle g_next_handle = 1;
+
+// Numbers the swap directories of contexts sharing a prompt cache directory
+static std::atomic<int32_t> g_next_swap{0};
+
+// Prompt cache directories already cleared of an earlier run's swap directories
+static std::mutex g_swept_dirs_mutex;
+static std::unordered_set<std::string> g_swept_dirs;
+
+// Streams in progress. Entries own the request only, never the instance, so
+// the last reference to an instance is never dropped on its scheduler thread.
+static std::mutex g_streams_mutex;
+static std::unordered_map<RequestId, std::shared_ptr<GenerationRequest>> g_streams;
+static RequestId g_next_request = 1;
+
+// A conversation runs in a session of its own on the handle it was created
+// on; one reply at a time
+struct ConversationEntry {
+    ModelHandle handle = kInvalidHandle;
+    std::string session_id;
+    std::unique_ptr<Conversation> chat;
+    std::mutex mutex;
+};
+
+static std::mutex g_conversations_mutex;
+static std::unordered_map<ConversationId, std::shared_ptr<ConversationEntry>> g_conversations;
+static ConversationId g_next_conversation = 1;
+
+static std::shared_ptr<Instance> find_instance(ModelHandle handle) {
+    std::lock_guard<std::mutex> lock(g_instances_mutex);
+    auto it = g_instances.find(handle);
+    if (it == g_instances.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+static std::shared_ptr<GenerationRequest> find_stream(RequestId request) {
+    std::lock_guard<std::mutex> lock(g_streams_mutex);
+    auto it = g_streams.find(request);
+    if (it == g_streams.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+static std::shared_ptr<ConversationEntry> find_conversation(ConversationId conversation) {
+    std::lock_guard<std::mutex> lock(g_conversations_mutex);
+    auto it = g_conversations.find(conversation);
+    if (it == g_conversations.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+Instance::~Instance() {
+    // Joins the decode thread before the context goes away
+    scheduler.reset();
+    if (context) {
+        llama_free(context);
+    }
+}
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Each context spills to a swap-<n> directory of its own under dir, removed
+// when it is freed; those of a run that was killed stay behind. The first
+// context of this process using dir deletes them, before any other can
+// create its own (every context passes through here first).
+static void remove_stale_swaps(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(g_swept_dirs_mutex);
+    if (!g_swept_dirs.insert(dir).second) {
+        return;
+    }
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (dirent* item = readdir(d)) {
+        const std::string name = item->d_name;
+        if (name.compare(0, 5, "swap-") != 0) {
+            continue;
+        }
+        const std::string swap_dir = dir + '/' + name;
+        if (DIR* swap = opendir(swap_dir.c_str())) {
+            while (dirent* file = readdir(swap)) {
+                const std::string file_name = file->d_name;
+                if (file_name != "." && file_name != "..") {
+                    remove((swap_dir + '/' + file_name).c_str());
+                }
+            }
+            closedir(swap);
+        }
+        if (rmdir(swap_dir.c_str()) == 0) {
+            LOGI("Removed stale session swap directory: %s", swap_dir.c_str());
+        }
+    }
+    closedir(d);
+}
+
+// Create the context (and scheduler) of inst over inst.weights
+static bool open_context(Instance& inst) {
+    const ContextParams& params = inst.params;
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = params.context_size;
+    if (!params.embeddings && params.initial_context_size > 0 && params.initial_context_size < params.context_size) {
+        ctx_params.n_ctx = params.initial_context_size;
+    }
+    ctx_params.n_batch = params.batch_size;
+    ctx_params.n_threads = params.n_threads;
+    ctx_params.n_threads_batch = params.n_threads;
+    if (params.embeddings) {
+        // Non-causal embedding models need the whole input in one ubatch
+        ctx_params.n_ubatch = params.batch_size;
+        ctx_params.embeddings = true;
+    } else {
+        // One sequence per concurrent request, all drawing on the full n_ctx,
+        // plus the scheduler's own
+        ctx_params.n_seq_max = BatchScheduler::sequences_needed(params.max_sequences,
+                                                                (int32_t)params.pinned_prefixes.size());
+        ctx_params.kv_unified = true;
+    }
+
+    llama_context* context = llama_init_from_model(inst.weights->model, ctx_params);
+    if (!context) {
+        LOGE("Failed to create context");
+        return false;
+    }
+
+    if (params.embeddings) {
+        inst.context = context;
+        return true;
+    }
+
+    std::unique_ptr<PromptCache> prompt_cache;
+    if (!params.prompt_cache_dir.empty()) {
+        remove_stale_swaps(params.prompt_cache_dir);
+        prompt_cache.reset(new PromptCache(params.prompt_cache_dir,
+                                           (uint64_t)std::max(params.prompt_cache_budget_mb, 0) << 20,
+                                           inst.weights->path, inst.weights->model));
+    }
+
+    // Spilled sessions go next to the prompt cache, held to a budget of their own
+    if (!inst.swap && params.session_swap_mb > 0) {
+        const std::string swap_dir = params.prompt_cache_dir.empty() ? std::string() :
+            params.prompt_cache_dir + "/swap-" + std::to_string(g_next_swap++);
+        inst.swap.reset(new SessionSwap((uint64_t)params.session_swap_mb << 20, swap_dir,
+                                        (uint64_t)std::max(params.session_swap_disk_mb, 0) << 20,
+                                        llama_model_n_params(inst.weights->model)));
+    }
+
+    // Prefills the pinned prefixes before returning
+    inst.scheduler.reset(new BatchScheduler(context, ctx_params, inst.weights->vocab, params,
+                                            std::move(prompt_cache), std::move(inst.swap), inst.responses));
+    if (inst.documents) {
+        inst.scheduler->set_document_library(inst.documents);
+    }
+    return true;
+}
+
+// Create an unregistered instance with its own context over weights
+static std::shared_ptr<Instance> create_instance(std::shared_ptr<ModelWeights> weights, const ContextParams& params) {
+    auto inst = std::make_shared<Instance>();
+    inst->params = params;
+    inst->model_path = weights->path;
+    inst->n_gpu_layers = weights->n_gpu_layers;
+    inst->embeddings = params.embeddings;
+    inst->weights = std::move(weights);
+    inst->last_used_ms = now_ms();
+    if (!params.embeddings && params.response_cache_entries > 0) {
+        inst->responses = std::make_shared<ResponseCache>((size_t)params.response_cache_entries);
+    }
+    if (!open_context(*inst)) {
+        return nullptr;
+    }
+    // An elastic context reports the size it may grow to
+    inst->info.n_params = llama_model_n_params(inst->weights->model);
+    inst->info.n_layers = llama_model_n_layer(inst->weights->model);
+    inst->info.context_size = inst->scheduler ? inst->scheduler->max_n_ctx() : (int32_t)llama_n_ctx(inst->context);
+    return inst;
+}
+
+// Called with inst.lifecycle held exclusively. Sessions go to the swap, which
+// outlives the context, and the weights are freed unless another handle
+// shares them. Fails while requests are running.
+static bool unload_instance(Instance& inst) {
+    if (inst.unloaded) {
+        return true;
+    }
+    if (inst.scheduler) {
+        if (!inst.scheduler->idle()) {
+            return false;
+        }
+        inst.swap = inst.scheduler->suspend();
+        inst.scheduler.reset();
+        if (inst.swap) {
+            inst.swap->spill_all();
+        }
+    }
+    if (inst.context) {
+        llama_free(inst.context);
+        inst.context = nullptr;
+    }
+    inst.weights.reset();
+    inst.unloaded = true;
+    LOGI("Unloaded model %d", inst.handle);
+    return true;
+}
+
+// Called with inst.lifecycle held exclusively
+static bool reload_instance(Instance& inst) {
+    const int64_t t0 = now_ms();
+    inst.weights = acquire_model_weights(inst.model_path, inst.n_gpu_layers);
+    if (!inst.weights || !open_context(inst)) {
+        inst.weights.reset();
+        return false;
+    }
+    inst.unloaded = false;
+    LOGI("Reloaded model %d in %lld ms", inst.handle, (long long)(now_ms() - t0));
+    return true;
+}
+
+// A shared hold on the weights and context of inst, reloading them first if
+// trim_memory or the idle timeout unloaded them. Owns no lock if that fails.
+static std::shared_lock<std::shared_mutex> wake(Instance& inst) {
+    std::shared_lock<std::shared_mutex> lock(inst.lifecycle);
+    while (inst.unloaded) {
+        lock.unlock();
+        {
+            std::unique_lock<std::shared_mutex> exclusive(inst.lifecycle);
+            if (inst.unloaded && !reload_instance(inst)) {
+                LOGE("Failed to reload model %d", inst.handle);
+                return std::shared_lock<std::shared_mutex>();
+            }
+        }
+        lock.lock();
+    }
+    inst.last_used_ms = now_ms();
+    return lock;
+}
+
+static std::vector<std::shared_ptr<Instance>> all_instances() {
+    std::lock_guard<std::mutex> lock(g_instances_mutex);
+    std::vector<std::shared_ptr<Instance>> instances;
+    for (const auto& item : g_instances) {
+        instances.push_back(item.second);
+    }
+    return instances;
+}
+
+// Unload every handle idle for longer than its idle_timeout_s
+static void unload_idle_instances() {
+    for (const auto& inst : all_instances()) {
+        if (inst->params.idle_timeout_s <= 0 ||
+            now_ms() - inst->last_used_ms < (int64_t)inst->params.idle_timeout_s * 1000) {
+            continue;
+        }
+        std::unique_lock<std::shared_mutex> exclusive(inst->lifecycle, std::try_to_lock);
+        if (!exclusive || inst->unloaded) {
+            continue;
+        }
+        // A stream finishing resets the clock
+        const int64_t idle_ms = inst->scheduler ? inst->scheduler->idle_ms() : INT64_MAX;
+        if (idle_ms >= (int64_t)inst->params.idle_timeout_s * 1000) {
+            LOGI("Model %d idle for %d s", inst->handle, inst->params.idle_timeout_s);
+            unload_instance(*inst);
+        }
+    }
+}
+
+// Reload handle and hand it the prepares that came in while it was unloaded
+static void reload_for_prepares(ModelHandle handle) {
+    auto inst = find_instance(handle);
+    if (!inst) {
+        return;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return;
+    }
+    std::unordered_map<std::string, std::string> pending;
+    {
+        std::lock_guard<std::mutex> lock(inst->pending_mutex);
+        pending.swap(inst->pending_prepares);
+    }
+    for (const auto& item : pending) {
+        inst->scheduler->prepare(item.first, item.second);
+    }
+}
+
+// Unloads idle handles (see unload_idle_instances) and reloads the ones
+// prepare asked for, off the caller's thread. Started with the first handle
+// that needs it; stopped at exit, before the handle table goes.
+struct LifecycleThread {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+    std::vector<ModelHandle> reloads;
+    bool stopping = false;
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!thread.joinable()) {
+            thread = std::thread(&LifecycleThread::run, this);
+        }
+    }
+
+    void reload(ModelHandle handle) {
+        start();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (std::find(reloads.begin(), reloads.end(), handle) == reloads.end()) {
+                reloads.push_back(handle);
+            }
+        }
+        cv.notify_all();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            cv.wait_for(lock, std::chrono::seconds(1), [this] { return stopping || !reloads.empty(); });
+            if (stopping) {
+                break;
+            }
+            std::vector<ModelHandle> handles;
+            handles.swap(reloads);
+            lock.unlock();
+            for (ModelHandle handle : handles) {
+                reload_for_prepares(handle);
+            }
+            unload_idle_instances();
+            lock.lock();
+        }
+    }
+
+    ~LifecycleThread() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
+static LifecycleThread g_lifecycle;
+
+static ModelHandle register_instance(std::shared_ptr<Instance> inst) {
+    if (inst->params.idle_timeout_s > 0) {
+        g_lifecycle.start();
+    }
+    std::lock_guard<std::mutex> lock(g_instances_mutex);
+    inst->handle = g_next_handle++;
+    g_instances[inst->handle] = inst;
+    return inst->handle;
+}
+
+ModelHandle load_model(const ModelParams& params) {
+    LOGI("Initializing model: %s", params.model_path.c_str());
+    LOGI("Threads: %d, GPU layers: %d, Context: %d, Sequences: %d",
+         params.n_threads, params.n_gpu_layers, params.context_size, params.max_sequences);
+
+    auto weights = acquire_model_weights(params.model_path, params.use_gpu ? params.n_gpu_layers : 0);
+    if (!weights) {
+        return kInvalidHandle;
+    }
+
+    ContextParams ctx_params;
+    ctx_params.n_threads = params.n_threads;
+    ctx_params.context_size = params.context_size;
+    ctx_params.initial_context_size = params.initial_context_size;
+    ctx_params.batch_size = params.batch_size;
+    ctx_params.max_sequences = params.max_sequences;
+    ctx_params.step_budget = params.step_budget;
+    ctx_params.cache_reuse = params.cache_reuse;
+    ctx_params.sink_tokens = params.sink_tokens;
+    ctx_params.recent_window = params.recent_window;
+    ctx_params.pinned_prefixes = params.pinned_prefixes;
+    ctx_params.prompt_cache_dir = params.prompt_cache_dir;
+    ctx_params.prompt_cache_budget_mb = params.prompt_cache_budget_mb;
+    ctx_params.session_swap_mb = params.session_swap_mb;
+    ctx_params.session_swap_disk_mb = params.session_swap_disk_mb;
+    ctx_params.idle_timeout_s = params.idle_timeout_s;
+    ctx_params.response_cache_entries = params.response_cache_entries;
+
+    auto inst = create_instance(std::move(weights), ctx_params);
+    if (!inst) {
+        return kInvalidHandle;
+    }
+
+    const ModelHandle handle = register_instance(inst);
+
+    LOGI("Model loaded successfully as handle %d", handle);
+    LOGI("Context size: %u", inst->scheduler->n_ctx());
+
+    return handle;
+}
+
+ModelHandle create_context(ModelHandle source, const ContextParams& params) {
+    auto source_inst = find_instance(source);
+    if (!source_inst) {
+        LOGE("Model %d not loaded", source);
+        return kInvalidHandle;
+    }
+    auto source_hold = wake(*source_inst);
+    if (!source_hold) {
+        return kInvalidHandle;
+    }
+
+    LOGI("Creating %s context over model %d: %s, Threads: %d, Context: %d",
+         params.embeddings ? "embedding" : "generation", source,
+         source_inst->weights->path.c_str(), params.n_threads, params.context_size);
+
+    auto inst = create_instance(source_inst->weights, params);
+    if (!inst) {
+        return kInvalidHandle;
+    }
+
+    const ModelHandle handle = register_instance(inst);
+    LOGI("Context created as handle %d", handle);
+    return handle;
+}
+
+bool release_model(ModelHandle handle) {
+    std::shared_ptr<Instance> inst;
+    {
+        std::lock_guard<std::mutex> lock(g_instances_mutex);
+        auto it = g_instances.find(handle);
+        if (it == g_instances.end()) {
+            return false;
+        }
+        inst = std::move(it->second);
+        g_instances.erase(it);
+    }
+
+    LOGI("Releasing model %d", handle);
+
+    // A blocking generate still holding the instance returns early and frees
+    // it on its own thread; streams see their requests cancelled. The lock is
+    // only held exclusively to unload or reload, when nothing runs to cancel.
+    std::shared_lock<std::shared_mutex> hold(inst->lifecycle, std::try_to_lock);
+    if (hold && inst->scheduler) {
+        inst->scheduler->cancel_all();
+    }
+    return true;
+}
+
+int32_t embedding_size(ModelHandle handle) {
+    auto inst = find_instance(handle);
+    if (!inst) {
+        return 0;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return 0;
+    }
+    return llama_model_n_embd(inst->weights->model);
+}
+
+bool embed(ModelHandle handle, const std::string& text, std::vector<float>& embedding) {
+    embedding.clear();
+
+    auto inst = find_instance(handle);
+    if (!inst) {
+        LOGE("Model %d not loaded", handle);
+        return false;
+    }
+    if (!inst->embeddings) {
+        LOGE("Model %d is not an embedding context", handle);
+        return false;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(inst->mutex);
+
+    std::vector<llama_token> tokens;
+    if (!tokenize(inst->weights->vocab, text, tokens) || tokens.empty()) {
+        return false;
+    }
+    if (tokens.size() > llama_n_batch(inst->context)) {
+        LOGE("Text too long for embedding context (%zu > %u tokens)", tokens.size(), llama_n_batch(inst->context));
+        return false;
+    }
+
+    // Every input is embedded on its own
+    llama_memory_clear(llama_get_memory(inst->context), true);
+
+    llama_batch batch = llama_batch_get_one(tokens.data(), tokens.size());
+    if (llama_decode(inst->context, batch) != 0) {
+        LOGE("Failed to decode embedding input");
+        return false;
+    }
+
+    const int32_t n_embd = llama_model_n_embd(inst->weights->model);
+    embedding.assign(n_embd, 0.0f);
+
+    if (llama_pooling_type(inst->context) != LLAMA_POOLING_TYPE_NONE) {
+        const float* pooled = llama_get_embeddings_seq(inst->context, 0);
+        if (!pooled) {
+            LOGE("Failed to get sequence embedding");
+            embedding.clear();
+            return false;
+        }
+        std::copy(pooled, pooled + n_embd, embedding.begin());
+    } else {
+        // Per-token outputs: mean-pool them
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const float* token_embd = llama_get_embeddings_ith(inst->context, (int32_t)i);
+            if (!token_embd) {
+                LOGE("Failed to get token embedding %zu", i);
+                embedding.clear();
+                return false;
+            }
+            for (int32_t j = 0; j < n_embd; j++) {
+                embedding[j] += token_embd[j];
+            }
+        }
+        for (float& v : embedding) {
+            v /= (float)tokens.size();
+        }
+    }
+
+    double norm = 0.0;
+    for (float v : embedding) {
+        norm += (double)v * v;
+    }
+    if (norm > 0.0) {
+        const float scale = (float)(1.0 / std::sqrt(norm));
+        for (float& v : embedding) {
+            v *= scale;
+        }
+    }
+
+    return true;
+}
+
+bool generate(ModelHandle handle, const GenerationParams& params, std::string& text, int32_t& n_generated) {
+    text.clear();
+    n_generated = 0;
+
+    auto inst = find_instance(handle);
+    if (!inst) {
+        LOGE("Model %d not loaded", handle);
+        return false;
+    }
+    if (inst->embeddings) {
+        LOGE("Model %d is an embedding context", handle);
+        return false;
+    }
+
+    auto hold = wake(*inst);
+    if (!hold) {
+        return false;
+    }
+
+    LOGI("Generating with prompt: %.50s...", params.prompt.c_str());
+
+    auto request = std::make_shared<GenerationRequest>();
+    request->params = params;
+    inst->scheduler->submit(request);
+    request->wait();
+
+    if (!request->ok) {
+        return false;
+    }
+
+    text = std::move(request->text);
+    n_generated = request->n_generated;
+    LOGI("Generated %d tokens", n_generated);
+    return true;
+}
+
+bool prepare(ModelHandle handle, const std::string& session_id, const std::string& text) {
+    auto inst = find_instance(handle);
+    if (!inst) {
+        LOGE("Model %d not loaded", handle);
+        return false;
+    }
+    if (inst->embeddings) {
+        LOGE("Model %d is an embedding context", handle);
+        return false;
+    }
+    // Called on every keystroke: a handle unloaded under memory pressure is
+    // reloaded in the background rather than on the caller's thread
+    std::shared_lock<std::shared_mutex> hold(inst->lifecycle);
+    if (inst->unloaded) {
+        {
+            std::lock_guard<std::mutex> lock(inst->pending_mutex);
+            inst->pending_prepares[session_id] = text;
+        }
+        hold.unlock();
+        g_lifecycle.reload(handle);
+        return true;
+    }
+    inst->last_used_ms = now_ms();
+    inst->scheduler->prepare(session_id, text);
+    return true;
+}
+
+RequestId stream_start(ModelHandle handle, const GenerationParams& params) {
+    LOGI("Initializing stream generation");
+
+    auto inst = find_instance(handle);
+    if (!inst) {
+        LOGE("Model %d not loaded", handle);
+        return kInvalidRequest;
+    }
+
+    if (inst->embeddings) {
+        LOGE("Model %d is an embedding context", handle);
+        return kInvalidRequest;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return kInvalidRequest;
+    }
+
+    auto request = std::make_shared<GenerationRequest>();
+    request->params = params;
+    request->streaming = true;
+
+    RequestId id;
+    {
+        std::lock_guard<std::mutex> lock(g_streams_mutex);
+        id = g_next_request++;
+        g_streams[id] = request;
+    }
+    inst->scheduler->submit(request);
+    return id;
+}
+
+bool stream_next(RequestId request_id, StreamEvent& event) {
+    auto request = find_stream(request_id);
+    if (!request) {
+        return false;
+    }
+    return request->next_event(event);
+}
+
+void stream_end(RequestId request_id) {
+    std::shared_ptr<GenerationRequest> request;
+    {
+        std::lock_guard<std::mutex> lock(g_streams_mutex);
+        auto it = g_streams.find(request_id);
+        if (it == g_streams.end()) {
+            return;
+        }
+        request = std::move(it->second);
+        g_streams.erase(it);
+    }
+
+    // The scheduler drops the request at its next step
+    LOGI("Ending stream %d", request_id);
+    request->cancel();
+}
+
+ConversationId create_conversation(ModelHandle handle) {
+    auto inst = find_instance(handle);
+    if (!inst) {
+        LOGE("Model %d not loaded", handle);
+        return kInvalidConversation;
+    }
+    if (inst->embeddings) {
+        LOGE("Model %d is an embedding context", handle);
+        return kInvalidConversation;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return kInvalidConversation;
+    }
+
+    auto entry = std::make_shared<ConversationEntry>();
+    entry->handle = handle;
+    entry->chat.reset(new Conversation(inst->weights->vocab, llama_model_chat_template(inst->weights->model, nullptr)));
+
+    std::lock_guard<std::mutex> lock(g_conversations_mutex);
+    const ConversationId id = g_next_conversation++;
+    // Not a valid sessionId from the platform side, so it never collides
+    entry->session_id = "\x01conversation-" + std::to_string(id);
+    g_conversations[id] = std::move(entry);
+    return id;
+}
+
+bool append_message(ConversationId conversation, const std::string& role, const std::string& content) {
+    auto entry = find_conversation(conversation);
+    if (!entry) {
+        LOGE("Unknown conversation %d", conversation);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    entry->chat->append_message(role, content);
+    return true;
+}
+
+bool generate_reply(ConversationId conversation, const GenerationParams& params, std::string& text,
+                    int32_t& n_generated) {
+    text.clear();
+    n_generated = 0;
+
+    auto entry = find_conversation(conversation);
+    if (!entry) {
+        LOGE("Unknown conversation %d", conversation);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    auto inst = find_instance(entry->handle);
+    if (!inst) {
+        LOGE("Model %d not loaded", entry->handle);
+        return false;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return false;
+    }
+
+    auto request = std::make_shared<GenerationRequest>();
+    request->params = params;
+    request->params.prompt.clear();
+    request->params.session_id = entry->session_id;
+    entry->chat->set_vocab(inst->weights->vocab);
+    if (!entry->chat->prompt_tokens(request->prompt_tokens)) {
+        return false;
+    }
+
+    LOGI("Replying in conversation %d: %zu messages, %zu prompt tokens", conversation, entry->chat->size(),
+         request->prompt_tokens.size());
+    inst->scheduler->submit(request);
+    request->wait();
+
+    if (!request->ok) {
+        return false;
+    }
+    entry->chat->add_reply(request->text, request->generated);
+    text = std::move(request->text);
+    n_generated = request->n_generated;
+    return true;
+}
+
+int32_t checkpoint_conversation(ConversationId conversation) {
+    auto entry = find_conversation(conversation);
+    if (!entry) {
+        LOGE("Unknown conversation %d", conversation);
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    return (int32_t)entry->chat->size();
+}
+
+bool rollback_conversation(ConversationId conversation, int32_t checkpoint) {
+    auto entry = find_conversation(conversation);
+    if (!entry) {
+        LOGE("Unknown conversation %d", conversation);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (checkpoint < 0 || (size_t)checkpoint > entry->chat->size()) {
+        LOGE("Invalid checkpoint %d of conversation %d", checkpoint, conversation);
+        return false;
+    }
+    entry->chat->rollback((size_t)checkpoint);
+    return true;
+}
+
+ConversationId fork_conversation(ConversationId conversation, int32_t checkpoint) {
+    auto entry = find_conversation(conversation);
+    if (!entry) {
+        LOGE("Unknown conversation %d", conversation);
+        return kInvalidConversation;
+    }
+
+    auto fork = std::make_shared<ConversationEntry>();
+    {
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        if (checkpoint < -1 || checkpoint > (int32_t)entry->chat->size()) {
+            LOGE("Invalid checkpoint %d of conversation %d", checkpoint, conversation);
+            return kInvalidConversation;
+        }
+        fork->handle = entry->handle;
+        fork->chat.reset(new Conversation(*entry->chat));
+    }
+    if (checkpoint != -1) {
+        fork->chat->rollback((size_t)checkpoint);
+    }
+
+    std::lock_guard<std::mutex> lock(g_conversations_mutex);
+    const ConversationId id = g_next_conversation++;
+    fork->session_id = "\x01conversation-" + std::to_string(id);
+    g_conversations[id] = std::move(fork);
+    LOGI("Forked conversation %d from %d", id, conversation);
+    return id;
+}
+
+void free_conversation(ConversationId conversation) {
+    std::shared_ptr<ConversationEntry> entry;
+    {
+        std::lock_guard<std::mutex> lock(g_conversations_mutex);
+        auto it = g_conversations.find(conversation);
+        if (it == g_conversations.end()) {
+            return;
+        }
+        entry = std::move(it->second);
+        g_conversations.erase(it);
+    }
+    // Waits for a reply still being generated
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    auto inst = find_instance(entry->handle);
+    if (!inst) {
+        return;
+    }
+    std::shared_lock<std::shared_mutex> hold(inst->lifecycle);
+    if (inst->scheduler) {
+        inst->scheduler->forget_session(entry->session_id);
+    } else if (inst->swap) {
+        inst->swap->forget(entry->session_id);
+    }
+}
+
+bool save_session(ModelHandle handle, const std::string& session_id, const std::string& path) {
+    auto inst = find_instance(handle);
+    if (!inst || inst->embeddings) {
+        LOGE("Model %d not loaded", handle);
+        return false;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return false;
+    }
+
+    // Extend the existing file with a delta if it holds an earlier state of
+    // this session; past the keyframe interval, or for anything else, start over
+    SessionFileIndex index;
+    std::vector<llama_token> stored;
+    if (read_session_index(path, index) &&
+        index.model_params == llama_model_n_params(inst->weights->model) &&
+        index.n_frames <= kSessionKeyframeInterval) {
+        stored = std::move(index.tokens);
+    }
+
+    SessionSnapshot snapshot;
+    if (!inst->scheduler->save_session(session_id, stored, snapshot)) {
+        return false;
+    }
+
+    // File I/O stays off the scheduler thread
+    const SessionFrame& frame = snapshot.frames.back();
+    if (frame.base == snapshot.tokens.size()) {
+        return true;
+    }
+    if (!(frame.base == 0 ? write_session_file(path, snapshot) : append_session_frame(path, snapshot))) {
+        return false;
+    }
+    LOGI("Saved session %s: %zu tokens, %zu bytes of state from position %u", session_id.c_str(),
+         snapshot.tokens.size(), frame.state.size(), frame.base);
+    return true;
+}
+
+bool restore_session(ModelHandle handle, const std::string& session_id, const std::string& path) {
+    auto inst = find_instance(handle);
+    if (!inst || inst->embeddings) {
+        LOGE("Model %d not loaded", handle);
+        return false;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return false;
+    }
+
+    SessionSnapshot snapshot;
+    if (!read_session_file(path, snapshot)) {
+        return false;
+    }
+    if (snapshot.model_params != llama_model_n_params(inst->weights->model)) {
+        LOGE("Session file %s was saved with a different model", path.c_str());
+        return false;
+    }
+    if (snapshot.tokens.size() >= inst->scheduler->max_n_ctx()) {
+        LOGE("Session %s does not fit the context (%zu tokens)", session_id.c_str(), snapshot.tokens.size());
+        return false;
+    }
+
+    return inst->scheduler->restore_session(session_id, snapshot);
+}
+
+int32_t add_documents(ModelHandle handle, const std::string& path, const std::vector<std::string>& texts) {
+    auto inst = find_instance(handle);
+    if (!inst || inst->embeddings) {
+        LOGE("Model %d not loaded", handle);
+        return -1;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return -1;
+    }
+
+    const uint64_t model_params = llama_model_n_params(inst->weights->model);
+    std::shared_ptr<DocumentLibrary> existing = DocumentLibrary::open(path, model_params);
+    DocumentLibraryWriter writer;
+    if (!writer.open(path, model_params)) {
+        return -1;
+    }
+
+    std::vector<std::vector<llama_token>> added;
+    for (const auto& text : texts) {
+        // Without BOS: the tokens are looked for in the middle of prompts
+        std::vector<llama_token> tokens;
+        if (!tokenize(inst->weights->vocab, text, tokens, false) || tokens.size() < kDocumentWindow ||
+            tokens.size() >= inst->scheduler->max_n_ctx()) {
+            LOGE("Skipping document of %zu tokens", tokens.size());
+            continue;
+        }
+        if ((existing && existing->contains(tokens)) ||
+            std::find(added.begin(), added.end(), tokens) != added.end()) {
+            continue;
+        }
+
+        // Decoding runs on the scheduler thread, file I/O stays off it
+        std::vector<uint8_t> state;
+        if (!inst->scheduler->compute_document(tokens, state) || !writer.add(tokens, state)) {
+            return -1;
+        }
+        added.push_back(std::move(tokens));
+    }
+    existing.reset();
+    hold.unlock();
+
+    if (!writer.close() || !use_document_library(handle, path)) {
+        return -1;
+    }
+    LOGI("Added %zu of %zu documents to %s", added.size(), texts.size(), path.c_str());
+    return (int32_t)added.size();
+}
+
+bool use_document_library(ModelHandle handle, const std::string& path) {
+    auto inst = find_instance(handle);
+    if (!inst || inst->embeddings) {
+        LOGE("Model %d not loaded", handle);
+        return false;
+    }
+    auto hold = wake(*inst);
+    if (!hold) {
+        return false;
+    }
+
+    std::shared_ptr<DocumentLibrary> library;
+    if (!path.empty()) {
+        library = DocumentLibrary::open(path, llama_model_n_params(inst->weights->model));
+        if (!library) {
+            LOGE("Cannot use document library %s", path.c_str());
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> lock(inst->mutex);
+    inst->documents = library;
+    inst->scheduler->set_document_library(std::move(library));
+    return true;
+}
+
+bool get_model_info(ModelHandle handle, ModelInfo& info) {
+    info = ModelInfo();
+
+    auto inst = find_instance(handle);
+    if (!inst) {
+        return false;
+    }
+    info = inst->info;
+    return true;
+}
+
+void stop_generation(ModelHandle handle) {
+    auto inst = find_instance(handle);
+    if (!inst) {
+        return;
+    }
+
+    LOGI("Stopping generation for model %d", handle);
+    std::shared_lock<std::shared_mutex> hold(inst->lifecycle, std::try_to_lock);
+    if (hold && inst->scheduler) {
+        inst->scheduler->cancel_all();
+    }
+}
+
+void trim_memory(int32_t level) {
+    LOGI("Trimming memory (level %d)", level);
+    for (const auto& inst : all_instances()) {
+        if (inst->responses) {
+            inst->responses->clear();
+        }
+        if (level >= kTrimUnload) {
+            std::unique_lock<std::shared_mutex> exclusive(inst->lifecycle, std::try_to_lock);
+            if (exclusive && unload_instance(*inst)) {
+                continue;
+            }
+        }
+        // Busy handles stay loaded and only give up what they can spare
+        std::shared_lock<std::shared_mutex> hold(inst->lifecycle);
+        if (inst->scheduler) {
+            inst->scheduler->trim(std::min(level, kTrimSessions));
+        } else if (inst->swap) {
+            inst->swap->spill_all();
+        }
+    }
+}
+
+} // namespace flutter_llama
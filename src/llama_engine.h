@@ -0,0 +1,263 @@
+/*
+ * Flutter Llama - shared llama.cpp engine
+ *
+ * Platform-neutral inference core. The Android JNI bridge and the
+ * iOS/macOS Objective-C++ bridges only marshal arguments into these calls.
+ *
+ * Every loaded model is addressed by a handle. Handles are independent (own
+ * context and KV cache) but share the weights of a GGUF file when they load
+ * the same path. create_context adds further handles over the weights of an
+ * existing one. Each handle serves up to max_sequences generation requests
+ * at once, batched into shared decode steps.
+ */
+
+#ifndef FLUTTER_LLAMA_ENGINE_H
+#define FLUTTER_LLAMA_ENGINE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace flutter_llama {
+
+using ModelHandle = int32_t;
+
+// Never returned by load_model; identifies "no model"
+constexpr ModelHandle kInvalidHandle = 0;
+
+using RequestId = int32_t;
+
+// Never returned by stream_start
+constexpr RequestId kInvalidRequest = 0;
+
+using ConversationId = int32_t;
+
+// Never returned by create_conversation
+constexpr ConversationId kInvalidConversation = 0;
+
+struct ModelParams {
+    std::string model_path;
+    int32_t n_threads = 4;
+    int32_t n_gpu_layers = 0;
+    int32_t context_size = 2048;
+    int32_t batch_size = 512;
+    int32_t max_sequences = 4;   // concurrent generation requests
+    int32_t step_budget = 128;   // tokens per decode step while streams run, <= 0: batch_size
+
+    // When > 0 and below context_size, the KV cache starts at this many cells
+    // and doubles (up to context_size) when a sequence needs more; it shrinks
+    // back once idle sequences use a quarter of it
+    int32_t initial_context_size = 0;
+
+    // Shortest run of an earlier history, past the point a prompt diverges
+    // from it, that is moved to its new position instead of prefilled again
+    // (like llama-server's n_cache_reuse); 0 disables
+    int32_t cache_reuse = 32;
+
+    // A sequence reaching context_size keeps its first sink_tokens tokens and
+    // its last recent_window ones (<= 0: half the context), drops those in
+    // between and goes on generating; sink_tokens < 0 ends the request instead
+    int32_t sink_tokens = 4;
+    int32_t recent_window = 0;
+
+    // Prompt prefixes (e.g. system prompts) prefilled at load into sequences
+    // of their own; requests starting with one copy its cells
+    std::vector<std::string> pinned_prefixes;
+
+    // Directory keeping the KV cells of recurring prompt prefixes across app
+    // launches, held to prompt_cache_budget_mb; empty disables
+    std::string prompt_cache_dir;
+    int32_t prompt_cache_budget_mb = 512;
+
+    // Memory for the KV cells of idle sessions whose sequence is taken by
+    // another session; their next request loads them back instead of
+    // prefilling. Past it the least recently used spill to a directory under
+    // prompt_cache_dir (when set), held to session_swap_disk_mb. 0 disables.
+    int32_t session_swap_mb = 0;
+    // Counted apart from prompt_cache_budget_mb, so prompt_cache_dir can hold
+    // up to the sum of both
+    int32_t session_swap_disk_mb = 512;
+
+    // Unload the handle (as trim_memory(kTrimUnload) does) after this many
+    // seconds without a request; the next one loads it again. 0 disables.
+    int32_t idle_timeout_s = 0;
+
+    // Greedy (temperature <= 0) requests repeating one of the last this many
+    // prompts get the reply generated for it before, without decoding; 0
+    // disables
+    int32_t response_cache_entries = 64;
+
+    bool use_gpu = true;
+    bool verbose = false;
+};
+
+// Per-context settings; weights come from the handle the context is created from
+struct ContextParams {
+    int32_t n_threads = 4;
+    int32_t context_size = 2048;
+    int32_t initial_context_size = 0; // see ModelParams
+    int32_t batch_size = 512;
+    int32_t max_sequences = 4;   // concurrent generation requests
+    int32_t step_budget = 128;   // tokens per decode step while streams run, <= 0: batch_size
+    int32_t cache_reuse = 32;    // see ModelParams
+    int32_t sink_tokens = 4;     // see ModelParams
+    int32_t recent_window = 0;   // see ModelParams
+    std::vector<std::string> pinned_prefixes; // see ModelParams
+    std::string prompt_cache_dir;             // see ModelParams
+    int32_t prompt_cache_budget_mb = 512;
+    int32_t session_swap_mb = 0; // see ModelParams
+    int32_t session_swap_disk_mb = 512;
+    int32_t idle_timeout_s = 0;  // see ModelParams
+    int32_t response_cache_entries = 64; // see ModelParams
+    bool embeddings = false;     // embedding-only context, see embed()
+};
+
+struct GenerationParams {
+    std::string prompt;
+    float temperature = 0.8f;
+    float top_p = 0.95f;
+    int32_t top_k = 40;
+    int32_t max_tokens = 512;
+    float repeat_penalty = 1.1f;
+
+    // Requests of one session reuse its sequence (and KV cache) when it is
+    // free; also the key for save_session/restore_session
+    std::string session_id;
+
+    // Generation ends as soon as the text contains one of these; the text
+    // returned ends right before it
+    std::vector<std::string> stop_sequences;
+};
+
+enum class StreamEventType {
+    Token,
+    PrefillProgress,
+};
+
+struct StreamEvent {
+    StreamEventType type = StreamEventType::Token;
+    std::string text;          // Token: detokenized piece
+    int32_t n_prefilled = 0;   // PrefillProgress: prompt tokens in the KV cache so far
+    int32_t n_total = 0;       // PrefillProgress: prompt length in tokens
+};
+
+struct ModelInfo {
+    int64_t n_params = 0;
+    int32_t n_layers = 0;
+    int32_t context_size = 0;
+};
+
+// Load a GGUF model and create its context. Returns kInvalidHandle on failure.
+ModelHandle load_model(const ModelParams& params);
+
+// Drop a handle, stopping its generation. The weights are freed once no
+// other handle uses them. Returns false for unknown handles.
+bool release_model(ModelHandle handle);
+
+// Create another context over the weights of source. The new handle has its
+// own KV cache and stays valid after source is released.
+// Returns kInvalidHandle on failure.
+ModelHandle create_context(ModelHandle source, const ContextParams& params);
+
+// Embedding contexts only. Writes the L2-normalized embedding of text (pooled
+// by the model's pooling type, mean pooling if it has none).
+bool embed(ModelHandle handle, const std::string& text, std::vector<float>& embedding);
+
+// Length of the vectors embed() returns, 0 for unknown handles
+int32_t embedding_size(ModelHandle handle);
+
+// Blocking generation. Safe to call from several threads at once; requests
+// beyond max_sequences wait for a free sequence.
+bool generate(ModelHandle handle, const GenerationParams& params, std::string& text, int32_t& n_generated);
+
+// Prefill text (the prompt as typed so far) into the sequence of session_id
+// in the background while the user is still typing; a later call rolls back
+// only the tokens that changed. The request of the session that follows has
+// just the rest of its prompt left to decode. A handle unloaded by
+// trim_memory or its idle timeout is reloaded in the background first, so
+// this never waits for the weights. Returns false for unknown and embedding
+// handles.
+bool prepare(ModelHandle handle, const std::string& session_id, const std::string& text);
+
+// Streaming generation. stream_start queues a request and returns its id
+// (kInvalidRequest on failure); stream_next blocks until the next event (a
+// prefill chunk finished or a piece was sampled) and returns false once
+// generation has finished; stream_end cancels and forgets the request and may
+// be called from any thread. Any number of streams may run on one handle.
+RequestId stream_start(ModelHandle handle, const GenerationParams& params);
+bool stream_next(RequestId request, StreamEvent& event);
+void stream_end(RequestId request);
+
+// Start a chat history kept natively and formatted with the model's chat
+// template. Each reply tokenizes only the text added since the previous one
+// and continues the KV cache of the conversation's own session. Returns
+// kInvalidConversation for unknown and embedding handles.
+ConversationId create_conversation(ModelHandle handle);
+
+// Append a message (role "system", "user", ...) to be sent with the next reply
+bool append_message(ConversationId conversation, const std::string& role, const std::string& content);
+
+// Blocking generation of the assistant's next message, which is appended to
+// the conversation. params.prompt and params.session_id are not used.
+bool generate_reply(ConversationId conversation, const GenerationParams& params, std::string& text,
+                    int32_t& n_generated);
+
+// The conversation's message count, to roll back or fork at later; -1 for
+// unknown conversations
+int32_t checkpoint_conversation(ConversationId conversation);
+
+// Drop the messages after checkpoint. The next reply continues the KV cache
+// up to there, so regenerating an answer or resending an edited message
+// prefills only what changed.
+bool rollback_conversation(ConversationId conversation, int32_t checkpoint);
+
+// A new conversation with the history of conversation up to checkpoint (-1:
+// all of it) and a session of its own. Its replies start from the cells of
+// the shared history (see PrefixCache), so several alternative answers can
+// be generated side by side without prefilling it again.
+ConversationId fork_conversation(ConversationId conversation, int32_t checkpoint);
+
+// Forget a conversation; its tokens stay in the KV cache like any history,
+// but not in the session swap
+void free_conversation(ConversationId conversation);
+
+// Write the KV cache and token history of a session's sequence to path.
+// Restoring it later (even after a restart) skips prefill of that history.
+bool save_session(ModelHandle handle, const std::string& session_id, const std::string& path);
+
+// Load a file written by save_session into an idle sequence of handle. The
+// next request of the session reuses it like a freshly prefilled prefix.
+bool restore_session(ModelHandle handle, const std::string& session_id, const std::string& path);
+
+// Prefill each text (a document chunk prompts will quote verbatim) on its
+// own and append its KV cells to the document library at path, creating it if
+// needed; texts the library already holds are skipped. Then use the library
+// as use_document_library does. Returns the number of documents added, -1 on
+// failure.
+int32_t add_documents(ModelHandle handle, const std::string& path, const std::vector<std::string>& texts);
+
+// Splice the cells of the documents of the library at path into every later
+// prompt quoting them instead of prefilling those tokens; an empty path stops
+bool use_document_library(ModelHandle handle, const std::string& path);
+
+bool get_model_info(ModelHandle handle, ModelInfo& info);
+
+// Cancel every queued and running request on handle
+void stop_generation(ModelHandle handle);
+
+// Levels of trim_memory, each doing what the ones below it do as well
+constexpr int32_t kTrimCaches = 1;   // drop cached prefixes and replies, move swapped sessions to disk
+constexpr int32_t kTrimSessions = 2; // swap out idle sessions, shrink KV caches to what is left
+constexpr int32_t kTrimUnload = 3;   // unload idle handles, weights included
+
+// Give memory back under pressure (onTrimMemory, memory warnings), on every
+// handle. Nothing is lost for good: a trimmed session is swapped back in or
+// prefilled by its next request, and an unloaded handle stays valid and is
+// loaded again (its sessions from the swap) by the next call using it.
+// Handles with requests running are trimmed up to kTrimSessions only.
+// Blocks while sessions are copied out; not for the UI thread.
+void trim_memory(int32_t level);
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_ENGINE_H
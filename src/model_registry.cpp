@@ -0,0 +1,60 @@
+/*
+ * Flutter Llama - loaded model weights registry
+ */
+
+#include "model_registry.h"
+
+#include <map>
+#include <mutex>
+
+#include "flutter_llama_log.h"
+
+namespace flutter_llama {
+
+static std::mutex g_weights_mutex;
+static std::map<std::string, std::weak_ptr<ModelWeights>> g_weights;
+
+ModelWeights::~ModelWeights() {
+    if (model) {
+        LOGI("Freeing model weights: %s", path.c_str());
+        llama_model_free(model);
+    }
+}
+
+std::shared_ptr<ModelWeights> acquire_model_weights(const std::string& path, int32_t n_gpu_layers) {
+    static std::once_flag backends_loaded;
+    std::call_once(backends_loaded, [] {
+        // Load dynamic backends
+        ggml_backend_load_all();
+    });
+
+    // Held across the load so concurrent loads of one path map it only once
+    std::lock_guard<std::mutex> lock(g_weights_mutex);
+
+    auto it = g_weights.find(path);
+    if (it != g_weights.end()) {
+        if (auto weights = it->second.lock()) {
+            LOGI("Sharing already loaded weights: %s", path.c_str());
+            return weights;
+        }
+        g_weights.erase(it);
+    }
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = n_gpu_layers;
+
+    auto weights = std::make_shared<ModelWeights>();
+    weights->path = path;
+    weights->n_gpu_layers = n_gpu_layers;
+    weights->model = llama_model_load_from_file(path.c_str(), model_params);
+    if (!weights->model) {
+        LOGE("Failed to load model from: %s", path.c_str());
+        return nullptr;
+    }
+    weights->vocab = llama_model_get_vocab(weights->model);
+
+    g_weights[path] = weights;
+    return weights;
+}
+
+} // namespace flutter_llama
@@ -0,0 +1,37 @@
+/*
+ * Flutter Llama - loaded model weights registry
+ *
+ * Every GGUF file is mapped at most once per process. Handles that load the
+ * same path share one ModelWeights; the weights are freed with the last handle.
+ */
+
+#ifndef FLUTTER_LLAMA_MODEL_REGISTRY_H
+#define FLUTTER_LLAMA_MODEL_REGISTRY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+struct ModelWeights {
+    std::string path;
+    llama_model* model = nullptr;
+    const llama_vocab* vocab = nullptr;
+    int32_t n_gpu_layers = 0;
+
+    ModelWeights() = default;
+    ModelWeights(const ModelWeights&) = delete;
+    ModelWeights& operator=(const ModelWeights&) = delete;
+    ~ModelWeights();
+};
+
+// Returns the weights already loaded from path, or loads them. n_gpu_layers
+// only applies to the first load of a path.
+std::shared_ptr<ModelWeights> acquire_model_weights(const std::string& path, int32_t n_gpu_layers);
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_MODEL_REGISTRY_H
@@ -0,0 +1,163 @@
+/*
+ * Flutter Llama - radix-tree prefix cache
+ */
+
+#include "prefix_cache.h"
+
+#include <algorithm>
+
+#include "flutter_llama_log.h"
+
+namespace flutter_llama {
+
+PrefixCache::PrefixCache(llama_context* context, llama_seq_id first_seq, int32_t n_seqs)
+    : context_(context) {
+    for (int32_t i = n_seqs - 1; i >= 0; i--) {
+        free_seqs_.push_back(first_seq + i);
+    }
+}
+
+size_t PrefixCache::match(const std::vector<llama_token>& tokens, llama_seq_id& seq_id) {
+    clock_++;
+    Node* node = &root_;
+    size_t n = 0;
+    while (n < tokens.size()) {
+        auto it = node->children.find(tokens[n]);
+        if (it == node->children.end()) {
+            break;
+        }
+        node = it->second.get();
+        node->last_used = clock_;
+        size_t i = 0;
+        while (i < node->edge.size() && n < tokens.size() && node->edge[i] == tokens[n]) {
+            i++;
+            n++;
+        }
+        if (i < node->edge.size()) {
+            break;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    // Every leaf below the match holds the whole matched path
+    while (!node->children.empty()) {
+        node = node->children.begin()->second.get();
+        node->last_used = clock_;
+    }
+    seq_id = node->seq_id;
+    return n;
+}
+
+void PrefixCache::insert(const std::vector<llama_token>& tokens, llama_seq_id seq_id) {
+    llama_memory_t mem = llama_get_memory(context_);
+    for (;;) {
+        clock_++;
+        Node* node = &root_;
+        size_t off = 0; // tokens of node->edge matched
+        size_t n = 0;
+        while (n < tokens.size() && off == node->edge.size()) {
+            auto it = node->children.find(tokens[n]);
+            if (it == node->children.end()) {
+                break;
+            }
+            node = it->second.get();
+            node->last_used = clock_;
+            off = 0;
+            while (off < node->edge.size() && n < tokens.size() && node->edge[off] == tokens[n]) {
+                off++;
+                n++;
+            }
+        }
+        if (n == tokens.size()) {
+            return;
+        }
+
+        // A history continuing a leaf (the next turn of a conversation) grows
+        // that leaf instead of taking another sequence
+        if (node != &root_ && node->children.empty() && off == node->edge.size()) {
+            llama_memory_seq_cp(mem, seq_id, node->seq_id, (llama_pos)n, -1);
+            node->edge.insert(node->edge.end(), tokens.begin() + n, tokens.end());
+            return;
+        }
+
+        if (free_seqs_.empty()) {
+            // The walk is redone over the smaller tree
+            if (!evict_lru()) {
+                return;
+            }
+            continue;
+        }
+
+        if (off < node->edge.size()) {
+            // Split the edge where the histories diverge
+            auto mid = std::unique_ptr<Node>(new Node());
+            mid->edge.assign(node->edge.begin(), node->edge.begin() + off);
+            mid->parent = node->parent;
+            mid->last_used = clock_;
+            std::unique_ptr<Node>& link = node->parent->children[node->edge[0]];
+            node->edge.erase(node->edge.begin(), node->edge.begin() + off);
+            node->parent = mid.get();
+            mid->children[node->edge[0]] = std::move(link);
+            link = std::move(mid);
+            node = link.get();
+        }
+
+        auto leaf = std::unique_ptr<Node>(new Node());
+        leaf->edge.assign(tokens.begin() + n, tokens.end());
+        leaf->parent = node;
+        leaf->seq_id = free_seqs_.back();
+        leaf->last_used = clock_;
+        free_seqs_.pop_back();
+
+        llama_memory_seq_cp(mem, seq_id, leaf->seq_id, 0, (llama_pos)tokens.size());
+        node->children[leaf->edge[0]] = std::move(leaf);
+        return;
+    }
+}
+
+PrefixCache::Node* PrefixCache::lru_leaf(Node& node) {
+    if (node.children.empty()) {
+        return &node == &root_ ? nullptr : &node;
+    }
+    Node* best = nullptr;
+    for (auto& child : node.children) {
+        Node* leaf = lru_leaf(*child.second);
+        if (!best || leaf->last_used < best->last_used) {
+            best = leaf;
+        }
+    }
+    return best;
+}
+
+bool PrefixCache::evict_lru() {
+    Node* leaf = lru_leaf(root_);
+    if (!leaf) {
+        return false;
+    }
+
+    LOGI("Evicting prefix cache leaf (seq %d, %zu tokens)", leaf->seq_id, leaf->edge.size());
+
+    // Cells of the path above the leaf stay held by its siblings' sequences
+    llama_memory_seq_rm(llama_get_memory(context_), leaf->seq_id, -1, -1);
+    free_seqs_.push_back(leaf->seq_id);
+    Node* parent = leaf->parent;
+    const llama_token key = leaf->edge[0];
+    parent->children.erase(key);
+
+    // Keep the tree compressed: an inner node left with one child absorbs it
+    if (parent != &root_ && parent->children.size() == 1) {
+        std::unique_ptr<Node> child = std::move(parent->children.begin()->second);
+        parent->children = std::move(child->children);
+        for (auto& grandchild : parent->children) {
+            grandchild.second->parent = parent;
+        }
+        parent->edge.insert(parent->edge.end(), child->edge.begin(), child->edge.end());
+        parent->seq_id = child->seq_id;
+        parent->last_used = std::max(parent->last_used, child->last_used);
+    }
+    return true;
+}
+
+} // namespace flutter_llama
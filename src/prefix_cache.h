@@ -0,0 +1,66 @@
+/*
+ * Flutter Llama - radix-tree prefix cache
+ *
+ * Keeps the KV cells of finished requests in a radix tree of token
+ * sequences. Every leaf owns a sequence id of the shared (kv_unified) cache
+ * holding the cells of its whole path from the root, so leaves that branch
+ * off a common system prompt or few-shot block share those cells instead of
+ * holding copies. A new request forks the deepest match into its own
+ * sequence with llama_memory_seq_cp instead of prefilling it again.
+ */
+
+#ifndef FLUTTER_LLAMA_PREFIX_CACHE_H
+#define FLUTTER_LLAMA_PREFIX_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+class PrefixCache {
+public:
+    // Leaves use sequences [first_seq, first_seq + n_seqs) of context
+    PrefixCache(llama_context* context, llama_seq_id first_seq, int32_t n_seqs);
+
+    PrefixCache(const PrefixCache&) = delete;
+    PrefixCache& operator=(const PrefixCache&) = delete;
+
+    // Length of the longest cached prefix of tokens; seq_id is set to a
+    // sequence whose cells cover it
+    size_t match(const std::vector<llama_token>& tokens, llama_seq_id& seq_id);
+
+    // Add tokens, whose cells seq_id holds at positions [0, tokens.size()).
+    // Takes the least recently used leaf's sequence if all are in use.
+    void insert(const std::vector<llama_token>& tokens, llama_seq_id seq_id);
+
+    // Drop the least recently used leaf and the cells only it holds. Returns
+    // false if the tree is empty.
+    bool evict_lru();
+
+    // The cells moved to context, which replaced the previous one
+    void set_context(llama_context* context) { context_ = context; }
+
+private:
+    struct Node {
+        std::vector<llama_token> edge;  // tokens between the parent and this node
+        Node* parent = nullptr;
+        std::map<llama_token, std::unique_ptr<Node>> children; // by first edge token
+        llama_seq_id seq_id = -1;       // leaves only
+        uint64_t last_used = 0;
+    };
+
+    Node* lru_leaf(Node& node);
+
+    llama_context* context_;
+    Node root_;
+    std::vector<llama_seq_id> free_seqs_;
+    uint64_t clock_ = 0;
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_PREFIX_CACHE_H
@@ -0,0 +1,262 @@
+/*
+ * Flutter Llama - on-disk prompt cache
+ */
+
+#include "prompt_cache.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include "flutter_llama_log.h"
+#include "session_file.h"
+
+namespace flutter_llama {
+
+static constexpr uint64_t kFnvOffset = 14695981039346656037ull;
+static constexpr uint64_t kFnvPrime = 1099511628211ull;
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * kFnvPrime;
+    }
+    return h;
+}
+
+// Path, size and modification time of the model file: a model replaced at
+// the same path (an update) gets a cache of its own
+static std::string model_identity(const std::string& model_path, const llama_model* model) {
+    struct stat st = {};
+    stat(model_path.c_str(), &st);
+    char desc[128] = {0};
+    llama_model_desc(model, desc, sizeof(desc));
+    return model_path + '\n' + std::to_string((long long)st.st_size) + '\n' +
+           std::to_string((long long)st.st_mtime) + '\n' + desc + '\n' +
+           std::to_string((unsigned long long)llama_model_n_params(model));
+}
+
+PromptCache::PromptCache(const std::string& dir, uint64_t budget_bytes, const std::string& model_path,
+                         const llama_model* model)
+    : dir_(dir), budget_bytes_(budget_bytes), model_params_(llama_model_n_params(model)) {
+    const std::string identity = model_identity(model_path, model);
+    seed_ = fnv1a(kFnvOffset, identity.data(), identity.size());
+
+    mkdir(dir_.c_str(), 0755);
+    scan();
+    LOGI("Prompt cache %s: %zu files, %" PRIu64 " of %" PRIu64 " bytes",
+         dir_.c_str(), entries_.size(), total_bytes_, budget_bytes_);
+
+    thread_ = std::thread(&PromptCache::run, this);
+}
+
+PromptCache::~PromptCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+uint64_t PromptCache::key_of(const std::vector<llama_token>& tokens, size_t n_tokens) const {
+    return fnv1a(seed_, tokens.data(), n_tokens * sizeof(llama_token));
+}
+
+std::string PromptCache::file_path(uint64_t key, size_t n_tokens) const {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016" PRIx64 "-%zu.flpc", key, n_tokens);
+    return dir_ + name;
+}
+
+// Index the files already in the directory by their names alone
+void PromptCache::scan() {
+    DIR* dir = opendir(dir_.c_str());
+    if (!dir) {
+        LOGE("Cannot open prompt cache directory: %s", dir_.c_str());
+        return;
+    }
+    while (dirent* item = readdir(dir)) {
+        const std::string name = item->d_name;
+        const std::string path = dir_ + '/' + name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            // A write cut short by the app being killed
+            remove(path.c_str());
+            continue;
+        }
+
+        uint64_t key = 0;
+        size_t n_tokens = 0;
+        char ext[8] = {0};
+        struct stat st = {};
+        if (sscanf(name.c_str(), "%16" SCNx64 "-%zu.%5s", &key, &n_tokens, ext) != 3 ||
+            std::string(ext) != "flpc" || stat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        Entry entry;
+        entry.n_tokens = n_tokens;
+        entry.size = (uint64_t)st.st_size;
+        entry.last_used = (int64_t)st.st_mtime;
+        entries_[key] = entry;
+        lengths_[n_tokens]++;
+        total_bytes_ += entry.size;
+    }
+    closedir(dir);
+}
+
+size_t PromptCache::match(const std::vector<llama_token>& tokens, size_t max_tokens) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_tokens = std::min(max_tokens, tokens.size());
+    if (lengths_.empty()) {
+        return 0;
+    }
+    max_tokens = std::min(max_tokens, lengths_.rbegin()->first);
+
+    // The key of every prefix length comes out of one pass over the tokens
+    size_t best = 0;
+    uint64_t h = seed_;
+    for (size_t i = 0; i < max_tokens; i++) {
+        h = fnv1a(h, &tokens[i], sizeof(llama_token));
+        if (lengths_.count(i + 1) == 0) {
+            continue;
+        }
+        auto it = entries_.find(h);
+        if (it != entries_.end() && it->second.n_tokens == i + 1) {
+            best = i + 1;
+        }
+    }
+    return best;
+}
+
+bool PromptCache::contains(const std::vector<llama_token>& tokens, size_t n_tokens) {
+    const uint64_t key = key_of(tokens, n_tokens);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    return (it != entries_.end() && it->second.n_tokens == n_tokens) || pending_keys_.count(key) > 0;
+}
+
+bool PromptCache::load(const std::vector<llama_token>& tokens, size_t n_tokens, std::vector<uint8_t>& state) {
+    const uint64_t key = key_of(tokens, n_tokens);
+    const std::string path = file_path(key, n_tokens);
+
+    SessionSnapshot snapshot;
+    const bool ok = read_session_file(path, snapshot) &&
+                    snapshot.model_params == model_params_ &&
+                    snapshot.frames.size() == 1 &&
+                    snapshot.tokens.size() == n_tokens &&
+                    std::equal(snapshot.tokens.begin(), snapshot.tokens.end(), tokens.begin());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok) {
+        LOGE("Dropping unreadable prompt cache file: %s", path.c_str());
+        remove(path.c_str());
+        remove_entry(key);
+        return false;
+    }
+
+    // The modification time keeps the LRU order across restarts
+    utime(path.c_str(), nullptr);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        it->second.last_used = (int64_t)time(nullptr);
+    }
+    state = std::move(snapshot.frames[0].state);
+    return true;
+}
+
+void PromptCache::store(std::vector<llama_token> tokens, std::vector<uint8_t> state) {
+    PendingWrite write;
+    write.key = key_of(tokens, tokens.size());
+    write.tokens = std::move(tokens);
+    write.state = std::move(state);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending_keys_.insert(write.key).second) {
+            return;
+        }
+        pending_.push_back(std::move(write));
+    }
+    cv_.notify_one();
+}
+
+// Called with mutex_ held
+void PromptCache::remove_entry(uint64_t key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        return;
+    }
+    total_bytes_ -= it->second.size;
+    if (--lengths_[it->second.n_tokens] == 0) {
+        lengths_.erase(it->second.n_tokens);
+    }
+    entries_.erase(it);
+}
+
+// Called with mutex_ held. keep (the file just written) goes last, and only
+// if it does not fit the budget on its own.
+void PromptCache::evict_over_budget(uint64_t keep) {
+    while (total_bytes_ > budget_bytes_ && !entries_.empty()) {
+        auto victim = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->first == keep && entries_.size() > 1) {
+                continue;
+            }
+            if (victim == entries_.end() || it->second.last_used < victim->second.last_used) {
+                victim = it;
+            }
+        }
+        LOGI("Evicting prompt cache file of %zu tokens (%" PRIu64 " bytes)", victim->second.n_tokens,
+             victim->second.size);
+        remove(file_path(victim->first, victim->second.n_tokens).c_str());
+        remove_entry(victim->first);
+    }
+}
+
+void PromptCache::run() {
+    for (;;) {
+        PendingWrite write;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                return;
+            }
+            write = std::move(pending_.front());
+            pending_.pop_front();
+        }
+
+        SessionSnapshot snapshot;
+        snapshot.model_params = model_params_;
+        snapshot.tokens = std::move(write.tokens);
+        snapshot.frames.resize(1);
+        snapshot.frames[0].state = std::move(write.state);
+
+        const std::string path = file_path(write.key, snapshot.tokens.size());
+        struct stat st = {};
+        const bool ok = write_session_file(path, snapshot) && stat(path.c_str(), &st) == 0;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_keys_.erase(write.key);
+        if (!ok) {
+            continue;
+        }
+        remove_entry(write.key);
+        Entry entry;
+        entry.n_tokens = snapshot.tokens.size();
+        entry.size = (uint64_t)st.st_size;
+        entry.last_used = (int64_t)time(nullptr);
+        entries_[write.key] = entry;
+        lengths_[entry.n_tokens]++;
+        total_bytes_ += entry.size;
+        LOGI("Stored %zu-token prefix in prompt cache (%" PRIu64 " bytes)", entry.n_tokens, entry.size);
+
+        evict_over_budget(write.key);
+    }
+}
+
+} // namespace flutter_llama
@@ -0,0 +1,98 @@
+/*
+ * Flutter Llama - on-disk prompt cache
+ *
+ * Keeps the KV cells of recurring prompt prefixes (instruction blocks, tool
+ * descriptions, pinned prefixes) in a directory, so the first request after
+ * a cold start loads them instead of prefilling them again. A file is named
+ * after a hash of the model identity and the prefix tokens, and holds the
+ * tokens themselves (checked on load) and the cells in the session file
+ * format. The directory is held to a byte budget by deleting the least
+ * recently used files; a file's modification time is its last use, so the
+ * order survives restarts. Files are written on a thread of the cache's own.
+ */
+
+#ifndef FLUTTER_LLAMA_PROMPT_CACHE_H
+#define FLUTTER_LLAMA_PROMPT_CACHE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+class PromptCache {
+public:
+    // Files of dir that do not belong to the model at model_path are never
+    // matched, but count against budget_bytes like the model's own
+    PromptCache(const std::string& dir, uint64_t budget_bytes, const std::string& model_path,
+                const llama_model* model);
+
+    // Finishes the queued writes
+    ~PromptCache();
+
+    PromptCache(const PromptCache&) = delete;
+    PromptCache& operator=(const PromptCache&) = delete;
+
+    // Length of the longest stored prefix of tokens[0, max_tokens), 0 if none
+    size_t match(const std::vector<llama_token>& tokens, size_t max_tokens);
+
+    // True if tokens[0, n_tokens) is stored or queued to be
+    bool contains(const std::vector<llama_token>& tokens, size_t n_tokens);
+
+    // Read the state stored for tokens[0, n_tokens) and mark it used. A file
+    // that fails to read back is deleted.
+    bool load(const std::vector<llama_token>& tokens, size_t n_tokens, std::vector<uint8_t>& state);
+
+    // Queue the state of tokens (a llama_state_seq_get_data of their cells
+    // at positions [0, tokens.size())) to be written
+    void store(std::vector<llama_token> tokens, std::vector<uint8_t> state);
+
+private:
+    struct Entry {
+        size_t n_tokens = 0;
+        uint64_t size = 0;
+        int64_t last_used = 0;
+    };
+
+    struct PendingWrite {
+        uint64_t key = 0;
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state;
+    };
+
+    uint64_t key_of(const std::vector<llama_token>& tokens, size_t n_tokens) const;
+    std::string file_path(uint64_t key, size_t n_tokens) const;
+    void scan();
+    void run();
+    void remove_entry(uint64_t key);
+    void evict_over_budget(uint64_t keep);
+
+    std::string dir_;
+    uint64_t budget_bytes_;
+    uint64_t model_params_;
+    uint64_t seed_;                  // hash of the model identity
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    std::map<size_t, size_t> lengths_; // token count -> entries of that length
+    uint64_t total_bytes_ = 0;
+    std::deque<PendingWrite> pending_;
+    std::set<uint64_t> pending_keys_;
+    bool stopping_ = false;
+
+    std::thread thread_;
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_PROMPT_CACHE_H
@@ -0,0 +1,77 @@
+/*
+ * Flutter Llama - response cache for greedy requests
+ */
+
+#include "response_cache.h"
+
+namespace flutter_llama {
+
+static uint64_t hash_prompt(const std::vector<llama_token>& tokens) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    for (llama_token token : tokens) {
+        h = (h ^ (uint32_t)token) * 1099511628211ull;
+    }
+    return h;
+}
+
+ResponseCache::ResponseCache(size_t max_entries) : max_entries_(max_entries) {}
+
+// Called with mutex_ held
+std::list<ResponseCache::Entry>::iterator ResponseCache::find_entry(uint64_t hash,
+                                                                    const std::vector<llama_token>& prompt) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->hash == hash && it->prompt == prompt) {
+            return it;
+        }
+    }
+    return entries_.end();
+}
+
+bool ResponseCache::find(const std::vector<llama_token>& prompt, std::vector<llama_token>& reply,
+                         bool& complete) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = find_entry(hash_prompt(prompt), prompt);
+    if (it == entries_.end()) {
+        return false;
+    }
+    reply = it->reply;
+    complete = it->complete;
+    entries_.splice(entries_.begin(), entries_, it);
+    return true;
+}
+
+void ResponseCache::insert(const std::vector<llama_token>& prompt, const std::vector<llama_token>& reply,
+                           bool complete) {
+    if (max_entries_ == 0) {
+        return;
+    }
+    const uint64_t hash = hash_prompt(prompt);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = find_entry(hash, prompt);
+    if (it != entries_.end()) {
+        // A longer cut-off reply, or the whole one, tells more
+        if (!it->complete && (complete || reply.size() > it->reply.size())) {
+            it->reply = reply;
+            it->complete = complete;
+        }
+        entries_.splice(entries_.begin(), entries_, it);
+        return;
+    }
+
+    Entry entry;
+    entry.hash = hash;
+    entry.prompt = prompt;
+    entry.reply = reply;
+    entry.complete = complete;
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > max_entries_) {
+        entries_.pop_back();
+    }
+}
+
+void ResponseCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
+
+} // namespace flutter_llama
@@ -0,0 +1,62 @@
+/*
+ * Flutter Llama - response cache for greedy requests
+ *
+ * At temperature 0 the sampler always picks the most likely token, so a
+ * prompt always gets the same reply. The cache keeps the tokens generated
+ * for the last prompts of a context and hands them out again without
+ * queueing, prefilling or decoding anything: classification and other
+ * canned prompts that repeat verbatim cost a lookup.
+ *
+ * A reply that ended at end-of-generation serves any max_tokens it fits
+ * in; one cut off at max_tokens or a stop sequence serves requests that
+ * end within its tokens.
+ */
+
+#ifndef FLUTTER_LLAMA_RESPONSE_CACHE_H
+#define FLUTTER_LLAMA_RESPONSE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+class ResponseCache {
+public:
+    // Keeps the replies to the last max_entries prompts
+    explicit ResponseCache(size_t max_entries);
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    // The reply kept for prompt; complete if it ended at end-of-generation,
+    // else only its first tokens are known. False if there is none.
+    bool find(const std::vector<llama_token>& prompt, std::vector<llama_token>& reply, bool& complete);
+
+    // Keep the reply generated for prompt; complete if it ended at
+    // end-of-generation rather than at max_tokens
+    void insert(const std::vector<llama_token>& prompt, const std::vector<llama_token>& reply, bool complete);
+
+    void clear();
+
+private:
+    struct Entry {
+        uint64_t hash = 0;
+        std::vector<llama_token> prompt;
+        std::vector<llama_token> reply;
+        bool complete = false;
+    };
+
+    std::list<Entry>::iterator find_entry(uint64_t hash, const std::vector<llama_token>& prompt);
+
+    size_t max_entries_;
+    std::mutex mutex_;
+    std::list<Entry> entries_; // most recently used first
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_RESPONSE_CACHE_H
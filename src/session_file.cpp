@@ -0,0 +1,305 @@
+/*
+ * Flutter Llama - session snapshot files
+ *
+ * Layout (native endianness, the file never leaves the device):
+ *   magic "FLSS", version, model_params
+ *   frames until the end of the file, each:
+ *     magic "FLFR", base, n_tokens, tokens, state size,
+ *     compressed size, zlib stream of the state
+ *
+ * Frames are written in place and the compressed size is patched in last, so
+ * an append cut short by a crash leaves a frame that fails to read back and
+ * the frames before it still restore.
+ */
+
+#include "session_file.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <memory>
+
+#include <zlib.h>
+
+#include "flutter_llama_log.h"
+
+namespace flutter_llama {
+
+static constexpr uint32_t kSessionMagic = 0x53534c46; // "FLSS"
+static constexpr uint32_t kSessionVersion = 2;
+static constexpr uint32_t kFrameMagic = 0x52464c46;   // "FLFR"
+
+// Buffer the state streams through on its way to and from the file
+static constexpr size_t kStreamChunk = 256 * 1024;
+
+// Deflate never shrinks data by more than this (zlib's limit is 1032:1)
+static constexpr uint64_t kMaxDeflateRatio = 1032;
+
+// Closes the file on every return path
+using FilePtr = std::unique_ptr<FILE, int (*)(FILE*)>;
+
+static FilePtr open_file(const std::string& path, const char* mode) {
+    return FilePtr(fopen(path.c_str(), mode), fclose);
+}
+
+template <typename T>
+static bool write_value(FILE* f, const T& value) {
+    return fwrite(&value, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+static bool read_value(FILE* f, T& value) {
+    return fread(&value, sizeof(T), 1, f) == 1;
+}
+
+static long file_size(FILE* f) {
+    if (fseek(f, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    const long size = ftell(f);
+    return fseek(f, 0, SEEK_SET) == 0 ? size : -1;
+}
+
+// Deflate data into f one chunk at a time, so the state is never held in
+// memory a second time in compressed form. Level 1: saving usually happens
+// while the app is being backgrounded and has to finish quickly.
+static bool write_compressed(FILE* f, const std::vector<uint8_t>& data, uint64_t& n_compressed) {
+    z_stream zs = {};
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK) {
+        return false;
+    }
+
+    std::vector<uint8_t> out(kStreamChunk);
+    size_t offset = 0;
+    bool ok = true;
+    int flush;
+    n_compressed = 0;
+    do {
+        const size_t n_in = std::min(data.size() - offset, kStreamChunk);
+        zs.next_in = const_cast<Bytef*>(data.data() + offset);
+        zs.avail_in = (uInt)n_in;
+        offset += n_in;
+        flush = offset == data.size() ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            zs.next_out = out.data();
+            zs.avail_out = (uInt)out.size();
+            deflate(&zs, flush);
+            const size_t n_out = out.size() - zs.avail_out;
+            if (fwrite(out.data(), 1, n_out, f) != n_out) {
+                ok = false;
+                break;
+            }
+            n_compressed += n_out;
+        } while (zs.avail_out == 0);
+    } while (ok && flush != Z_FINISH);
+
+    deflateEnd(&zs);
+    return ok;
+}
+
+// Inflate n_compressed bytes of f straight into data, which is sized to the
+// expected state
+static bool read_compressed(FILE* f, uint64_t n_compressed, std::vector<uint8_t>& data) {
+    z_stream zs = {};
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+
+    std::vector<uint8_t> in(kStreamChunk);
+    Bytef* const out_end = data.data() + data.size();
+    zs.next_out = data.data();
+    int ret = Z_OK;
+    while (ret == Z_OK && n_compressed > 0) {
+        const size_t n_in = (size_t)std::min<uint64_t>(n_compressed, in.size());
+        if (fread(in.data(), 1, n_in, f) != n_in) {
+            break;
+        }
+        n_compressed -= n_in;
+        zs.next_in = in.data();
+        zs.avail_in = (uInt)n_in;
+        while (ret == Z_OK && zs.avail_in > 0) {
+            zs.avail_out = (uInt)std::min<size_t>(out_end - zs.next_out, INT_MAX);
+            ret = inflate(&zs, Z_NO_FLUSH);
+        }
+    }
+    const bool ok = ret == Z_STREAM_END && n_compressed == 0 && zs.next_out == out_end;
+
+    inflateEnd(&zs);
+    return ok;
+}
+
+static bool write_frame(FILE* f, const SessionSnapshot& snapshot, size_t index) {
+    const SessionFrame& frame = snapshot.frames[index];
+    const size_t end = index + 1 < snapshot.frames.size() ? snapshot.frames[index + 1].base : snapshot.tokens.size();
+    const uint32_t n_tokens = (uint32_t)(end - frame.base);
+    const uint64_t n_state = frame.state.size();
+    if (!write_value(f, kFrameMagic) ||
+        !write_value(f, frame.base) ||
+        !write_value(f, n_tokens) ||
+        fwrite(snapshot.tokens.data() + frame.base, sizeof(llama_token), n_tokens, f) != n_tokens ||
+        !write_value(f, n_state)) {
+        return false;
+    }
+
+    // Zero until the state is fully written, which marks a torn frame
+    uint64_t n_compressed = 0;
+    const long size_offset = ftell(f);
+    if (size_offset < 0 || !write_value(f, n_compressed) || !write_compressed(f, frame.state, n_compressed)) {
+        return false;
+    }
+    const long end_offset = ftell(f);
+    return end_offset >= 0 &&
+           fflush(f) == 0 &&
+           fseek(f, size_offset, SEEK_SET) == 0 &&
+           write_value(f, n_compressed) &&
+           fseek(f, end_offset, SEEK_SET) == 0 &&
+           fflush(f) == 0;
+}
+
+static bool read_header(FILE* f, uint64_t& model_params) {
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    return read_value(f, magic) && magic == kSessionMagic &&
+           read_value(f, version) && version == kSessionVersion &&
+           read_value(f, model_params);
+}
+
+// Read a frame up to its compressed state, appending its tokens. The frame
+// must continue the tokens read so far, and its state size must be one its
+// compressed size can hold, so a damaged one is not allocated for.
+static bool read_frame_head(FILE* f, long size, SessionFrame& frame, std::vector<llama_token>& tokens,
+                            uint64_t& n_state, uint64_t& n_compressed) {
+    uint32_t magic = 0;
+    uint32_t n_tokens = 0;
+    if (!read_value(f, magic) || magic != kFrameMagic ||
+        !read_value(f, frame.base) || frame.base != tokens.size() ||
+        !read_value(f, n_tokens) ||
+        (uint64_t)n_tokens * sizeof(llama_token) > (uint64_t)(size - ftell(f))) {
+        return false;
+    }
+    tokens.resize(frame.base + n_tokens);
+    if (fread(tokens.data() + frame.base, sizeof(llama_token), n_tokens, f) != n_tokens ||
+        !read_value(f, n_state) ||
+        !read_value(f, n_compressed) ||
+        n_compressed == 0 || n_compressed > (uint64_t)(size - ftell(f)) ||
+        n_state > n_compressed * kMaxDeflateRatio) {
+        return false;
+    }
+    return true;
+}
+
+bool write_session_file(const std::string& path, const SessionSnapshot& snapshot) {
+    // Write next to the target and rename, so a crash never leaves a torn file
+    const std::string tmp_path = path + ".tmp";
+    bool ok;
+    {
+        FilePtr file = open_file(tmp_path, "wb");
+        if (!file) {
+            LOGE("Failed to open session file for writing: %s", tmp_path.c_str());
+            return false;
+        }
+
+        ok = write_value(file.get(), kSessionMagic) &&
+             write_value(file.get(), kSessionVersion) &&
+             write_value(file.get(), snapshot.model_params);
+        for (size_t i = 0; ok && i < snapshot.frames.size(); i++) {
+            ok = write_frame(file.get(), snapshot, i);
+        }
+    }
+    if (!ok) {
+        LOGE("Failed to write session file: %s", tmp_path.c_str());
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to move session file into place: %s", path.c_str());
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool append_session_frame(const std::string& path, const SessionSnapshot& snapshot) {
+    FilePtr file = open_file(path, "r+b");
+    if (!file || fseek(file.get(), 0, SEEK_END) != 0) {
+        LOGE("Failed to open session file for appending: %s", path.c_str());
+        return false;
+    }
+    if (!write_frame(file.get(), snapshot, snapshot.frames.size() - 1)) {
+        // The torn frame is ignored on read and the next save rewrites the file
+        LOGE("Failed to append to session file: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool read_session_file(const std::string& path, SessionSnapshot& snapshot) {
+    FilePtr file = open_file(path, "rb");
+    if (!file) {
+        LOGE("Failed to open session file: %s", path.c_str());
+        return false;
+    }
+
+    const long size = file_size(file.get());
+    if (size < 0 || !read_header(file.get(), snapshot.model_params)) {
+        LOGE("Not a session file (or unsupported version): %s", path.c_str());
+        return false;
+    }
+
+    snapshot.tokens.clear();
+    snapshot.frames.clear();
+    while (ftell(file.get()) < size) {
+        const size_t n_valid = snapshot.tokens.size();
+        SessionFrame frame;
+        uint64_t n_state = 0;
+        uint64_t n_compressed = 0;
+        bool ok = read_frame_head(file.get(), size, frame, snapshot.tokens, n_state, n_compressed);
+        if (ok) {
+            frame.state.resize(n_state);
+            ok = read_compressed(file.get(), n_compressed, frame.state);
+        }
+        if (!ok) {
+            // An interrupted append; everything before it is still a valid session
+            LOGE("Session file %s is damaged after %zu tokens", path.c_str(), n_valid);
+            snapshot.tokens.resize(n_valid);
+            break;
+        }
+        snapshot.frames.push_back(std::move(frame));
+    }
+
+    if (snapshot.frames.empty()) {
+        LOGE("Truncated session file: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool read_session_index(const std::string& path, SessionFileIndex& index) {
+    FilePtr file = open_file(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    const long size = file_size(file.get());
+    if (size < 0 || !read_header(file.get(), index.model_params)) {
+        return false;
+    }
+
+    index.tokens.clear();
+    index.n_frames = 0;
+    while (ftell(file.get()) < size) {
+        SessionFrame frame;
+        uint64_t n_state = 0;
+        uint64_t n_compressed = 0;
+        if (!read_frame_head(file.get(), size, frame, index.tokens, n_state, n_compressed) ||
+            fseek(file.get(), (long)n_compressed, SEEK_CUR) != 0) {
+            return false;
+        }
+        index.n_frames++;
+    }
+    return index.n_frames > 0;
+}
+
+} // namespace flutter_llama
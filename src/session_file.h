@@ -0,0 +1,69 @@
+/*
+ * Flutter Llama - session snapshot files
+ *
+ * A session file holds the KV cache of one sequence (llama_state_seq_get_data)
+ * together with the tokens it was computed from, so a restored sequence keeps
+ * matching prompt prefixes like a freshly prefilled one.
+ *
+ * The state is stored as a chain of compressed frames: a keyframe with the
+ * whole sequence, then deltas holding only the cells appended since the
+ * previous save. Saving a conversation that grew by one turn appends that
+ * turn instead of rewriting its whole history.
+ */
+
+#ifndef FLUTTER_LLAMA_SESSION_FILE_H
+#define FLUTTER_LLAMA_SESSION_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+// Deltas appended after a keyframe before the next save writes a fresh one,
+// bounding both the chain a restore has to replay and the file's dead weight
+static constexpr uint32_t kSessionKeyframeInterval = 8;
+
+struct SessionFrame {
+    // Position of the first cell in state; 0 for the keyframe
+    uint32_t base = 0;
+    std::vector<uint8_t> state;
+};
+
+struct SessionSnapshot {
+    // llama_model_n_params of the model that produced the state; a file is
+    // only restored into a context over the same model
+    uint64_t model_params = 0;
+
+    // Whole token history of the session
+    std::vector<llama_token> tokens;
+
+    // frames[i] holds the cells of tokens [frames[i].base, frames[i + 1].base)
+    std::vector<SessionFrame> frames;
+};
+
+// What a save needs to know about an existing file to append to it
+struct SessionFileIndex {
+    uint64_t model_params = 0;
+    std::vector<llama_token> tokens;
+    uint32_t n_frames = 0;
+};
+
+// Write every frame of snapshot into a new file (replacing path)
+bool write_session_file(const std::string& path, const SessionSnapshot& snapshot);
+
+// Append the last frame of snapshot to the file at path. The file must hold
+// exactly tokens [0, frames.back().base), as read_session_index reported.
+bool append_session_frame(const std::string& path, const SessionSnapshot& snapshot);
+
+bool read_session_file(const std::string& path, SessionSnapshot& snapshot);
+
+// Read the header and tokens without decompressing any state. Fails quietly
+// for a missing file, and for one with a torn tail (it must be rewritten).
+bool read_session_index(const std::string& path, SessionFileIndex& index);
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_SESSION_FILE_H
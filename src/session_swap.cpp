@@ -0,0 +1,288 @@
+/*
+ * Flutter Llama - swap space for idle sessions
+ */
+
+#include "session_swap.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flutter_llama_log.h"
+#include "session_file.h"
+
+namespace flutter_llama {
+
+static const char kSwapExtension[] = ".flsw";
+
+SessionSwap::SessionSwap(uint64_t memory_budget_bytes, const std::string& dir, uint64_t disk_budget_bytes,
+                         uint64_t model_params)
+    : memory_budget_bytes_(memory_budget_bytes), dir_(dir), disk_budget_bytes_(disk_budget_bytes),
+      model_params_(model_params) {
+    if (dir_.empty()) {
+        return;
+    }
+    mkdir(dir_.c_str(), 0755);
+
+    // Sessions swapped out by an earlier run went with its context
+    if (DIR* d = opendir(dir_.c_str())) {
+        const size_t n_ext = sizeof(kSwapExtension) - 1;
+        while (dirent* item = readdir(d)) {
+            const std::string name = item->d_name;
+            if (name.size() > n_ext && name.compare(name.size() - n_ext, n_ext, kSwapExtension) == 0) {
+                remove((dir_ + '/' + name).c_str());
+            }
+        }
+        closedir(d);
+    } else {
+        LOGE("Cannot open session swap directory: %s", dir_.c_str());
+    }
+
+    thread_ = std::thread(&SessionSwap::run, this);
+}
+
+SessionSwap::~SessionSwap() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    for (const auto& item : entries_) {
+        if (!item.second.file.empty()) {
+            remove(item.second.file.c_str());
+        }
+    }
+    if (!dir_.empty()) {
+        rmdir(dir_.c_str());
+    }
+}
+
+void SessionSwap::put(const std::string& session, SwappedSession swapped) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(session);
+        if (it != entries_.end()) {
+            remove_entry(it);
+        }
+        Entry& entry = entries_[session];
+        entry.tokens = std::move(swapped.tokens);
+        entry.dropped = std::move(swapped.dropped);
+        entry.state = std::move(swapped.state);
+        entry.id = ++clock_;
+        entry.last_used = entry.id;
+        memory_bytes_ += entry.state.size();
+        spill_over_budget(memory_budget_bytes_);
+    }
+    cv_.notify_all();
+}
+
+bool SessionSwap::contains(const std::string& session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(session) > 0;
+}
+
+// The entry of session once no write of it is running, entries_.end() if none
+SessionSwap::Entries::iterator SessionSwap::find_settled(std::unique_lock<std::mutex>& lock,
+                                                         const std::string& session) {
+    for (;;) {
+        auto it = entries_.find(session);
+        if (it == entries_.end() || !it->second.writing) {
+            return it;
+        }
+        cv_.wait(lock);
+    }
+}
+
+bool SessionSwap::take(const std::string& session, SwappedSession& swapped) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = find_settled(lock, session);
+    if (it == entries_.end()) {
+        return false;
+    }
+    Entry& entry = it->second;
+    bool ok = true;
+    if (entry.file.empty()) {
+        if (!entry.spilling) {
+            memory_bytes_ -= entry.state.size();
+        }
+        swapped.state = std::move(entry.state);
+    } else {
+        ok = read_file(entry, swapped.state);
+    }
+    if (ok) {
+        swapped.tokens = std::move(entry.tokens);
+        swapped.dropped = std::move(entry.dropped);
+    }
+    remove_entry(it);
+    return ok;
+}
+
+bool SessionSwap::copy(const std::string& session, SwappedSession& swapped) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = find_settled(lock, session);
+    if (it == entries_.end()) {
+        return false;
+    }
+    const Entry& entry = it->second;
+    if (entry.file.empty()) {
+        swapped.state = entry.state;
+    } else if (!read_file(entry, swapped.state)) {
+        remove_entry(it);
+        return false;
+    }
+    swapped.tokens = entry.tokens;
+    swapped.dropped = entry.dropped;
+    return true;
+}
+
+void SessionSwap::forget(const std::string& session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(session);
+    if (it != entries_.end()) {
+        remove_entry(it);
+    }
+}
+
+// Called with mutex_ held
+bool SessionSwap::read_file(const Entry& entry, std::vector<uint8_t>& state) {
+    SessionSnapshot snapshot;
+    if (!read_session_file(entry.file, snapshot) || snapshot.model_params != model_params_ ||
+        snapshot.frames.size() != 1 || snapshot.tokens != entry.tokens) {
+        LOGE("Cannot read back swapped session file %s", entry.file.c_str());
+        return false;
+    }
+    state = std::move(snapshot.frames[0].state);
+    return true;
+}
+
+// Called with mutex_ held. The file of an entry being written is deleted by
+// the writer, which finds the entry gone.
+void SessionSwap::remove_entry(Entries::iterator it) {
+    const Entry& entry = it->second;
+    if (!entry.spilling) {
+        memory_bytes_ -= entry.state.size();
+    }
+    if (!entry.file.empty()) {
+        remove(entry.file.c_str());
+        disk_bytes_ -= entry.file_size;
+    }
+    entries_.erase(it);
+}
+
+void SessionSwap::spill_all() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        spill_over_budget(0);
+    }
+    cv_.notify_all();
+}
+
+// Called with mutex_ held
+void SessionSwap::spill_over_budget(uint64_t budget_bytes) {
+    while (memory_bytes_ > budget_bytes) {
+        auto victim = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (!it->second.spilling && it->second.file.empty() &&
+                (victim == entries_.end() || it->second.last_used < victim->second.last_used)) {
+                victim = it;
+            }
+        }
+        if (victim == entries_.end()) {
+            return;
+        }
+        if (dir_.empty()) {
+            LOGI("Dropping swapped session of %zu tokens", victim->second.tokens.size());
+            remove_entry(victim);
+            continue;
+        }
+        victim->second.spilling = true;
+        memory_bytes_ -= victim->second.state.size();
+        spills_.push_back(victim->first);
+    }
+}
+
+// Called with mutex_ held
+void SessionSwap::evict_disk_over_budget() {
+    while (disk_bytes_ > disk_budget_bytes_) {
+        auto victim = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (!it->second.file.empty() &&
+                (victim == entries_.end() || it->second.last_used < victim->second.last_used)) {
+                victim = it;
+            }
+        }
+        if (victim == entries_.end()) {
+            return;
+        }
+        LOGI("Dropping spilled session of %zu tokens (%" PRIu64 " bytes)", victim->second.tokens.size(),
+             victim->second.file_size);
+        remove_entry(victim);
+    }
+}
+
+void SessionSwap::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        cv_.wait(lock, [this] { return stopping_ || !spills_.empty(); });
+        if (stopping_) {
+            return;
+        }
+        const std::string session = std::move(spills_.front());
+        spills_.pop_front();
+        auto it = entries_.find(session);
+        if (it == entries_.end() || !it->second.spilling || it->second.writing) {
+            continue;
+        }
+
+        // The state moves into the snapshot rather than being copied: memory
+        // is short already. take and copy wait for the write to finish.
+        Entry& entry = it->second;
+        const uint64_t id = entry.id;
+        entry.writing = true;
+        SessionSnapshot snapshot;
+        snapshot.model_params = model_params_;
+        snapshot.tokens = entry.tokens;
+        snapshot.frames.resize(1);
+        snapshot.frames[0].state = std::move(entry.state);
+        const std::string path = dir_ + '/' + std::to_string(id) + kSwapExtension;
+
+        lock.unlock();
+        struct stat st = {};
+        const bool ok = write_session_file(path, snapshot) && stat(path.c_str(), &st) == 0;
+        lock.lock();
+
+        it = entries_.find(session);
+        if (it == entries_.end() || it->second.id != id) {
+            // Forgotten or replaced meanwhile
+            remove(path.c_str());
+            cv_.notify_all();
+            continue;
+        }
+        Entry& written = it->second;
+        written.writing = false;
+        written.spilling = false;
+        if (!ok) {
+            LOGE("Failed to spill swapped session of %zu tokens", written.tokens.size());
+            remove(path.c_str());
+            entries_.erase(it);
+            cv_.notify_all();
+            continue;
+        }
+        written.file = path;
+        written.file_size = (uint64_t)st.st_size;
+        disk_bytes_ += written.file_size;
+        LOGI("Spilled swapped session of %zu tokens to disk (%" PRIu64 " bytes)", written.tokens.size(),
+             written.file_size);
+        evict_disk_over_budget();
+        cv_.notify_all();
+    }
+}
+
+} // namespace flutter_llama
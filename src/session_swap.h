@@ -0,0 +1,119 @@
+/*
+ * Flutter Llama - swap space for idle sessions
+ *
+ * A sequence whose session sits idle is handed to the next request that
+ * needs one, and its cells are dropped. With a swap, they are first copied
+ * out (llama_state_seq_get_data) into host memory, and the session's next
+ * request loads them back into whichever sequence it gets instead of
+ * prefilling its history again. Many more sessions than sequences can so
+ * take turns in one context.
+ *
+ * States beyond the memory budget are spilled, least recently swapped out
+ * first, to files in a directory (in the session file format) on a thread
+ * of the swap's own, and past the directory's budget they are dropped. The
+ * swap only lives as long as its context: files left by an earlier run are
+ * deleted at start.
+ */
+
+#ifndef FLUTTER_LLAMA_SESSION_SWAP_H
+#define FLUTTER_LLAMA_SESSION_SWAP_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+
+namespace flutter_llama {
+
+// A sequence's tokens and cells, taken out of the context
+struct SwappedSession {
+    std::vector<llama_token> tokens;
+
+    // Slid out of tokens after the attention sinks; see BatchScheduler
+    std::vector<llama_token> dropped;
+
+    // llama_state_seq_get_data of the cells of tokens
+    std::vector<uint8_t> state;
+};
+
+class SessionSwap {
+public:
+    // States over memory_budget_bytes go to dir (empty: they are dropped),
+    // held to disk_budget_bytes
+    SessionSwap(uint64_t memory_budget_bytes, const std::string& dir, uint64_t disk_budget_bytes,
+                uint64_t model_params);
+
+    // Waits for the write in progress; queued ones are dropped
+    ~SessionSwap();
+
+    SessionSwap(const SessionSwap&) = delete;
+    SessionSwap& operator=(const SessionSwap&) = delete;
+
+    // Keep session, replacing what was kept for it before
+    void put(const std::string& session, SwappedSession swapped);
+
+    bool contains(const std::string& session);
+
+    // Hand back session and forget it. A spilled state is read back from its
+    // file; false if that fails or session is not here.
+    bool take(const std::string& session, SwappedSession& swapped);
+
+    // Like take, but session stays
+    bool copy(const std::string& session, SwappedSession& swapped);
+
+    void forget(const std::string& session);
+
+    // Move every state held in memory to disk (dropping them without a
+    // directory); returns before they are written
+    void spill_all();
+
+private:
+    struct Entry {
+        std::vector<llama_token> tokens;
+        std::vector<llama_token> dropped;
+
+        // In memory until spilled to file; moved out while being written
+        std::vector<uint8_t> state;
+        std::string file;
+        uint64_t file_size = 0;
+        bool spilling = false;           // queued or being written
+        bool writing = false;
+        uint64_t id = 0;                 // tells a replaced entry from its successor
+        uint64_t last_used = 0;
+    };
+
+    using Entries = std::unordered_map<std::string, Entry>;
+
+    Entries::iterator find_settled(std::unique_lock<std::mutex>& lock, const std::string& session);
+    bool read_file(const Entry& entry, std::vector<uint8_t>& state);
+    void remove_entry(Entries::iterator it);
+    void spill_over_budget(uint64_t budget_bytes);
+    void evict_disk_over_budget();
+    void run();
+
+    uint64_t memory_budget_bytes_;
+    std::string dir_;
+    uint64_t disk_budget_bytes_;
+    uint64_t model_params_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    Entries entries_;
+    uint64_t memory_bytes_ = 0;      // states in memory and not queued to spill
+    uint64_t disk_bytes_ = 0;
+    uint64_t clock_ = 0;
+    std::deque<std::string> spills_; // sessions to write out, in order
+    bool stopping_ = false;
+
+    std::thread thread_;
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_SESSION_SWAP_H
@@ -0,0 +1,103 @@
+/*
+ * Flutter Llama - incremental stop-sequence matching
+ */
+
+#include "stop_matcher.h"
+
+#include <algorithm>
+#include <deque>
+
+namespace flutter_llama {
+
+StopMatcher::StopMatcher(const std::vector<std::string>& stops) {
+    for (const std::string& stop : stops) {
+        for (unsigned char byte : stop) {
+            if (classes_[byte] == 0) {
+                classes_[byte] = (uint8_t)n_classes_++;
+            }
+        }
+    }
+
+    // The trie of the stop sequences; -1: no child yet
+    next_.assign(n_classes_, -1);
+    for (const std::string& stop : stops) {
+        if (stop.empty()) {
+            continue;
+        }
+        int32_t node = 0;
+        for (unsigned char byte : stop) {
+            int32_t& child = next_[node * n_classes_ + classes_[byte]];
+            if (child < 0) {
+                child = (int32_t)depth_.size();
+                depth_.push_back(depth_[node] + 1);
+                out_len_.push_back(0);
+                next_.resize(next_.size() + n_classes_, -1);
+            }
+            node = next_[node * n_classes_ + classes_[byte]];
+        }
+        out_len_[node] = (uint32_t)stop.size();
+    }
+
+    // Breadth first, fill in the missing transitions from the failure links
+    // (the node of the longest proper suffix), so feeding is one lookup a byte
+    std::vector<int32_t> fail(depth_.size(), 0);
+    std::deque<int32_t> queue;
+    for (int32_t c = 0; c < n_classes_; c++) {
+        int32_t& child = next_[c];
+        if (child < 0) {
+            child = 0;
+        } else {
+            queue.push_back(child);
+        }
+    }
+    while (!queue.empty()) {
+        const int32_t node = queue.front();
+        queue.pop_front();
+        // A stop sequence ending at a suffix of the node ends here too
+        out_len_[node] = std::max(out_len_[node], out_len_[fail[node]]);
+        for (int32_t c = 0; c < n_classes_; c++) {
+            int32_t& child = next_[node * n_classes_ + c];
+            const int32_t fallback = next_[fail[node] * n_classes_ + c];
+            if (child < 0) {
+                child = fallback;
+            } else {
+                fail[child] = fallback;
+                queue.push_back(child);
+            }
+        }
+    }
+}
+
+bool StopMatcher::feed(const std::string& piece, std::string& out) {
+    if (empty()) {
+        out += piece;
+        return false;
+    }
+    for (unsigned char byte : piece) {
+        held_.push_back((char)byte);
+        state_ = next_[state_ * n_classes_ + classes_[byte]];
+        if (out_len_[state_] > 0) {
+            out.append(held_, 0, held_.size() - out_len_[state_]);
+            reset();
+            return true;
+        }
+    }
+    // Whatever precedes the tail the automaton is in cannot start a match
+    const size_t n_done = held_.size() - depth_[state_];
+    out.append(held_, 0, n_done);
+    held_.erase(0, n_done);
+    return false;
+}
+
+std::string StopMatcher::flush() {
+    std::string tail = std::move(held_);
+    reset();
+    return tail;
+}
+
+void StopMatcher::reset() {
+    state_ = 0;
+    held_.clear();
+}
+
+} // namespace flutter_llama
@@ -0,0 +1,61 @@
+/*
+ * Flutter Llama - incremental stop-sequence matching
+ *
+ * Generated text arrives one token piece at a time, and a stop sequence can
+ * span several pieces (or start in the middle of one). The stop sequences
+ * are compiled into an Aho-Corasick automaton over bytes, and each piece is
+ * fed through it as it is sampled: the automaton's state is the longest
+ * tail of the text that may still grow into a stop sequence, so only those
+ * bytes are held back and everything before them is handed out at once.
+ * When a stop sequence completes, the text ends right before it and
+ * generation can stop on that token.
+ *
+ * Bytes no stop sequence contains share one column of the transition table,
+ * so the table stays small however many distinct bytes the text has.
+ */
+
+#ifndef FLUTTER_LLAMA_STOP_MATCHER_H
+#define FLUTTER_LLAMA_STOP_MATCHER_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace flutter_llama {
+
+class StopMatcher {
+public:
+    // Matches nothing: every byte is handed out as fed
+    StopMatcher() = default;
+
+    // Empty strings among stops are ignored
+    explicit StopMatcher(const std::vector<std::string>& stops);
+
+    bool empty() const { return out_len_.size() <= 1; }
+
+    // Feed the next piece of generated text. Appends to out the bytes that
+    // can no longer be part of a stop sequence and returns false, or returns
+    // true once a stop sequence completed, with out ending right before it.
+    bool feed(const std::string& piece, std::string& out);
+
+    // The held back bytes, once generation ended without a stop sequence
+    std::string flush();
+
+    // Back to the start of a text
+    void reset();
+
+private:
+    int32_t n_classes_ = 1;
+    std::array<uint8_t, 256> classes_{};   // byte -> column; 0: in no stop sequence
+    std::vector<int32_t> next_;            // node * n_classes_ + column -> node
+    std::vector<uint32_t> depth_{0};       // bytes from the root
+    std::vector<uint32_t> out_len_{0};     // longest stop sequence ending at the node, 0 if none
+
+    int32_t state_ = 0;
+    std::string held_;                     // the last depth_[state_] bytes fed
+};
+
+} // namespace flutter_llama
+
+#endif // FLUTTER_LLAMA_STOP_MATCHER_H
@@ -146,6 +146,7 @@ void main() {
         prompt: 'Hello',
         temperature: 0.7,
         maxTokens: 100,
+        stopSequences: ['\n\n', 'User:'],
       );
 
       await llama.generate(params);
@@ -155,6 +156,7 @@ void main() {
       expect(methodCallLog[0].arguments['prompt'], 'Hello');
       expect(methodCallLog[0].arguments['temperature'], 0.7);
       expect(methodCallLog[0].arguments['maxTokens'], 100);
+      expect(methodCallLog[0].arguments['stopSequences'], ['\n\n', 'User:']);
     });
 
     test('generate returns LlamaResponse', () async {
@@ -274,6 +276,421 @@ void main() {
     });
   });
 
+  group('FlutterLlama generateStream', () {
+    const EventChannel streamChannel = EventChannel('flutter_llama/stream');
+
+    tearDown(() {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockStreamHandler(streamChannel, null);
+    });
+
+    test('yields tokens and reports prefill progress', () async {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockStreamHandler(
+        streamChannel,
+        MockStreamHandler.inline(onListen: (arguments, events) {
+          events.success({'type': 'prefillProgress', 'prefilled': 4, 'total': 8});
+          events.success({'type': 'prefillProgress', 'prefilled': 8, 'total': 8});
+          events.success('Hel');
+          events.success('lo');
+          events.endOfStream();
+        }),
+      );
+
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      final progress = <PrefillProgress>[];
+      final tokens = await llama
+          .generateStream(
+            const GenerationParams(prompt: 'Hi'),
+            onPrefillProgress: progress.add,
+          )
+          .toList();
+
+      expect(tokens, ['Hel', 'lo']);
+      expect(progress.map((p) => p.prefilled), [4, 8]);
+      expect(progress.last.isComplete, true);
+
+      await Future<void>.delayed(Duration.zero);
+      expect(methodCallLog.map((call) => call.method), contains('generateStream'));
+    });
+
+    test('cancelling the stream cancels the platform subscription', () async {
+      var cancelled = false;
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockStreamHandler(
+        streamChannel,
+        MockStreamHandler.inline(
+          onListen: (arguments, events) => events.success('first'),
+          onCancel: (arguments) => cancelled = true,
+        ),
+      );
+
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      final first = await llama
+          .generateStream(const GenerationParams(prompt: 'Hi'))
+          .first;
+
+      expect(first, 'first');
+      await Future<void>.delayed(Duration.zero);
+      expect(cancelled, true);
+    });
+
+    test('routes tagged events to concurrent streams', () async {
+      MockStreamHandlerEventSink? sink;
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockStreamHandler(
+        streamChannel,
+        MockStreamHandler.inline(onListen: (arguments, events) => sink = events),
+      );
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockMethodCallHandler(channel, (MethodCall methodCall) async {
+        methodCallLog.add(methodCall);
+        if (methodCall.method == 'generateStream') {
+          while (sink == null) {
+            await Future<void>.delayed(Duration.zero);
+          }
+          final streamId = methodCall.arguments['streamId'];
+          final prompt = methodCall.arguments['prompt'] as String;
+          sink!.success({'streamId': streamId, 'type': 'token', 'text': prompt});
+          sink!.success({'streamId': streamId, 'type': 'token', 'text': '!'});
+          sink!.success({'streamId': streamId, 'type': 'done'});
+          return null;
+        }
+        return methodCall.method == 'loadModel' ? true : null;
+      });
+
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      final results = await Future.wait([
+        llama.generateStream(const GenerationParams(prompt: 'A')).toList(),
+        llama.generateStream(const GenerationParams(prompt: 'B')).toList(),
+      ]);
+
+      expect(results[0], ['A', '!']);
+      expect(results[1], ['B', '!']);
+      expect(methodCallLog.map((call) => call.method), isNot(contains('cancelStream')));
+    });
+
+    test('abandoning a stream cancels only its request', () async {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockStreamHandler(
+        streamChannel,
+        MockStreamHandler.inline(
+          onListen: (arguments, events) =>
+              events.success({'streamId': 0, 'type': 'token', 'text': 'other'}),
+        ),
+      );
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockMethodCallHandler(channel, (MethodCall methodCall) async {
+        methodCallLog.add(methodCall);
+        return methodCall.method == 'loadModel' ? true : null;
+      });
+
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      final stream = llama.generateStream(const GenerationParams(prompt: 'Hi'));
+      final subscription = stream.listen((_) {});
+      await Future<void>.delayed(Duration.zero);
+      await subscription.cancel();
+      await Future<void>.delayed(Duration.zero);
+
+      final start = methodCallLog.firstWhere((call) => call.method == 'generateStream');
+      final cancel = methodCallLog.firstWhere((call) => call.method == 'cancelStream');
+      expect(cancel.arguments['streamId'], start.arguments['streamId']);
+    });
+  });
+
+  group('FlutterLlama openModel', () {
+    setUp(() {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockMethodCallHandler(channel, (MethodCall methodCall) async {
+        methodCallLog.add(methodCall);
+        switch (methodCall.method) {
+          case 'loadModel':
+            return true;
+          case 'openModel':
+            return methodCall.arguments['modelPath'] == '/missing.gguf' ? null : 7;
+          case 'createContext':
+            return 8;
+          case 'embed':
+            return [0.6, 0.8];
+          case 'generate':
+            return {
+              'text': 'Model ${methodCall.arguments['modelId']}',
+              'tokensGenerated': 1,
+              'generationTimeMs': 1,
+            };
+          default:
+            return null;
+        }
+      });
+    });
+
+    test('returns a model bound to the platform handle', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/a.gguf'));
+
+      expect(model, isNotNull);
+      expect(model!.id, 7);
+      expect(model.modelPath, '/a.gguf');
+      expect(methodCallLog.last.method, 'openModel');
+      expect(methodCallLog.last.arguments['modelPath'], '/a.gguf');
+
+      final response = await model.generate(const GenerationParams(prompt: 'Hi'));
+      expect(response.text, 'Model 7');
+      expect(methodCallLog.last.arguments['modelId'], 7);
+
+      await model.getModelInfo();
+      expect(methodCallLog.last.method, 'getModelInfo');
+      expect(methodCallLog.last.arguments, {'modelId': 7});
+    });
+
+    test('returns null when the model cannot be loaded', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/missing.gguf'));
+
+      expect(model, isNull);
+    });
+
+    test('close releases the handle and rejects further calls', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/a.gguf'));
+
+      await model!.close();
+
+      expect(model.isClosed, true);
+      expect(methodCallLog.last.method, 'closeModel');
+      expect(methodCallLog.last.arguments, {'modelId': 7});
+      expect(
+        () => model.generate(const GenerationParams(prompt: 'Hi')),
+        throwsStateError,
+      );
+
+      methodCallLog.clear();
+      await model.close();
+      expect(methodCallLog, isEmpty);
+    });
+
+    test('createContext shares the model and embeds on embedding contexts', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/a.gguf'));
+
+      final embedder = await model!.createContext(
+        const LlamaContextConfig(contextSize: 512, embeddings: true),
+      );
+
+      expect(embedder, isNotNull);
+      expect(embedder!.id, 8);
+      expect(embedder.modelPath, '/a.gguf');
+      expect(embedder.embeddings, true);
+      expect(methodCallLog.last.method, 'createContext');
+      expect(methodCallLog.last.arguments['modelId'], 7);
+      expect(methodCallLog.last.arguments['contextSize'], 512);
+      expect(methodCallLog.last.arguments['embeddings'], true);
+
+      final vector = await embedder.embed('hello');
+      expect(vector, [0.6, 0.8]);
+      expect(methodCallLog.last.arguments, {'modelId': 8, 'text': 'hello'});
+    });
+
+    test('embed is rejected on generation contexts', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/a.gguf'));
+
+      expect(() => model!.embed('hello'), throwsStateError);
+    });
+
+    test('default model calls carry no modelId', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+      methodCallLog.clear();
+
+      await llama.generate(const GenerationParams(prompt: 'Hi'));
+      await llama.stopGeneration();
+
+      expect(methodCallLog[0].arguments.containsKey('modelId'), false);
+      expect(methodCallLog[1].arguments, isNull);
+    });
+  });
+
+  group('FlutterLlama sessions', () {
+    setUp(() {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockMethodCallHandler(channel, (MethodCall methodCall) async {
+        methodCallLog.add(methodCall);
+        switch (methodCall.method) {
+          case 'loadModel':
+            return true;
+          case 'openModel':
+            return 7;
+          case 'prepare':
+            return true;
+          case 'saveSession':
+            return true;
+          case 'restoreSession':
+            return methodCall.arguments['path'] != '/missing.bin';
+          default:
+            return null;
+        }
+      });
+    });
+
+    test('saveSession and restoreSession pass session and path', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      expect(await llama.saveSession('chat-1', '/s.bin'), true);
+      expect(methodCallLog.last.method, 'saveSession');
+      expect(methodCallLog.last.arguments, {'sessionId': 'chat-1', 'path': '/s.bin'});
+
+      expect(await llama.restoreSession('chat-1', '/missing.bin'), false);
+      expect(methodCallLog.last.method, 'restoreSession');
+    });
+
+    test('prepare passes session and partial text', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      expect(await llama.prepare('chat-1', 'Hello, how'), true);
+      expect(methodCallLog.last.method, 'prepare');
+      expect(methodCallLog.last.arguments, {'sessionId': 'chat-1', 'text': 'Hello, how'});
+    });
+
+    test('model sessions carry the modelId', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/a.gguf'));
+
+      expect(await model!.restoreSession('chat-1', '/s.bin'), true);
+      expect(methodCallLog.last.arguments, {
+        'sessionId': 'chat-1',
+        'path': '/s.bin',
+        'modelId': 7,
+      });
+    });
+  });
+
+  group('FlutterLlama document library', () {
+    setUp(() {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockMethodCallHandler(channel, (MethodCall methodCall) async {
+        methodCallLog.add(methodCall);
+        switch (methodCall.method) {
+          case 'loadModel':
+            return true;
+          case 'openModel':
+            return 7;
+          case 'addDocuments':
+            return (methodCall.arguments['chunks'] as List).length;
+          case 'useDocumentLibrary':
+            return methodCall.arguments['path'] != '/missing.fldl';
+          default:
+            return null;
+        }
+      });
+    });
+
+    test('addDocuments passes path and chunks', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+
+      expect(await llama.addDocuments('/docs.fldl', ['chunk one', 'chunk two']), 2);
+      expect(methodCallLog.last.method, 'addDocuments');
+      expect(methodCallLog.last.arguments, {
+        'path': '/docs.fldl',
+        'chunks': ['chunk one', 'chunk two'],
+      });
+
+      expect(await llama.useDocumentLibrary('/missing.fldl'), false);
+      expect(methodCallLog.last.method, 'useDocumentLibrary');
+    });
+
+    test('model document calls carry the modelId', () async {
+      final model = await llama.openModel(const LlamaConfig(modelPath: '/a.gguf'));
+
+      expect(await model!.useDocumentLibrary('/docs.fldl'), true);
+      expect(methodCallLog.last.arguments, {'path': '/docs.fldl', 'modelId': 7});
+    });
+  });
+
+  group('FlutterLlama trimMemory', () {
+    test('passes the native level', () async {
+      await llama.trimMemory(MemoryTrimLevel.sessions);
+      expect(methodCallLog.last.method, 'trimMemory');
+      expect(methodCallLog.last.arguments, {'level': 2});
+
+      await llama.trimMemory(MemoryTrimLevel.unload);
+      expect(methodCallLog.last.arguments, {'level': 3});
+    });
+  });
+
+  group('LlamaConversation', () {
+    setUp(() {
+      TestDefaultBinaryMessengerBinding.instance.defaultBinaryMessenger
+          .setMockMethodCallHandler(channel, (MethodCall methodCall) async {
+        methodCallLog.add(methodCall);
+        switch (methodCall.method) {
+          case 'loadModel':
+            return true;
+          case 'createConversation':
+            return 3;
+          case 'appendMessage':
+            return true;
+          case 'generateReply':
+            return {'text': 'Hi!', 'tokensGenerated': 2, 'generationTimeMs': 10};
+          case 'checkpointConversation':
+            return 2;
+          case 'rollbackConversation':
+            return true;
+          case 'forkConversation':
+            return 4;
+          default:
+            return null;
+        }
+      });
+    });
+
+    test('messages and replies go to the native conversation', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+      final conversation = await llama.createConversation();
+      expect(conversation!.id, 3);
+
+      expect(await conversation.appendMessage('user', 'Hello'), true);
+      expect(methodCallLog.last.arguments, {
+        'conversationId': 3,
+        'role': 'user',
+        'content': 'Hello',
+      });
+
+      final reply = await conversation.generateReply(
+        const GenerationParams(prompt: 'ignored', maxTokens: 16, sessionId: 's'),
+      );
+      expect(reply.text, 'Hi!');
+      final args = methodCallLog.last.arguments as Map;
+      expect(args['conversationId'], 3);
+      expect(args['maxTokens'], 16);
+      expect(args.containsKey('prompt'), false);
+      expect(args.containsKey('sessionId'), false);
+    });
+
+    test('checkpoint, rollback and fork', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+      final conversation = await llama.createConversation();
+
+      final checkpoint = await conversation!.checkpoint();
+      expect(checkpoint, 2);
+      expect(await conversation.rollback(checkpoint), true);
+      expect(methodCallLog.last.arguments, {'conversationId': 3, 'checkpoint': 2});
+
+      final fork = await conversation.fork();
+      expect(fork!.id, 4);
+      expect(methodCallLog.last.arguments, {'conversationId': 3});
+      await conversation.fork(checkpoint);
+      expect(methodCallLog.last.arguments, {'conversationId': 3, 'checkpoint': 2});
+    });
+
+    test('closed conversation rejects calls', () async {
+      await llama.loadModel(const LlamaConfig(modelPath: '/test.gguf'));
+      final conversation = await llama.createConversation();
+      await conversation!.close();
+
+      expect(methodCallLog.last.method, 'closeConversation');
+      expect(conversation.isClosed, true);
+      expect(() => conversation.appendMessage('user', 'Hello'), throwsStateError);
+    });
+  });
+
   group('FlutterLlama stopGeneration', () {
     test('stopGeneration calls platform method', () async {
       methodCallLog.clear();
@@ -59,6 +59,14 @@ void main() {
       expect(map['stopSequences'], ['STOP', 'END']);
     });
 
+    test('toMap includes sessionId only when set', () {
+      expect(const GenerationParams(prompt: 'Hi').toMap().containsKey('sessionId'), false);
+      expect(
+        const GenerationParams(prompt: 'Hi', sessionId: 'chat-1').toMap()['sessionId'],
+        'chat-1',
+      );
+    });
+
     test('toString returns formatted string', () {
       const params = GenerationParams(
         prompt: 'A very long prompt for testing',
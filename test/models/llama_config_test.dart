@@ -12,7 +12,20 @@ void main() {
       expect(config.nThreads, 4);
       expect(config.nGpuLayers, 0);
       expect(config.contextSize, 2048);
+      expect(config.initialContextSize, 0);
       expect(config.batchSize, 512);
+      expect(config.maxSequences, 4);
+      expect(config.stepBudget, 128);
+      expect(config.cacheReuse, 32);
+      expect(config.sinkTokens, 4);
+      expect(config.recentWindow, 0);
+      expect(config.pinnedPrefixes, isEmpty);
+      expect(config.promptCacheDir, isNull);
+      expect(config.promptCacheBudgetMb, 512);
+      expect(config.sessionSwapMb, 0);
+      expect(config.sessionSwapDiskMb, 512);
+      expect(config.idleTimeoutSeconds, 0);
+      expect(config.responseCacheEntries, 64);
       expect(config.useGpu, true);
       expect(config.verbose, false);
     });
@@ -24,6 +37,7 @@ void main() {
         nGpuLayers: 32,
         contextSize: 4096,
         batchSize: 1024,
+        maxSequences: 8,
         useGpu: false,
         verbose: true,
       );
@@ -33,6 +47,7 @@ void main() {
       expect(config.nGpuLayers, 32);
       expect(config.contextSize, 4096);
       expect(config.batchSize, 1024);
+      expect(config.maxSequences, 8);
       expect(config.useGpu, false);
       expect(config.verbose, true);
     });
@@ -43,7 +58,20 @@ void main() {
         nThreads: 6,
         nGpuLayers: 16,
         contextSize: 3072,
+        initialContextSize: 512,
         batchSize: 768,
+        maxSequences: 2,
+        stepBudget: 64,
+        cacheReuse: 0,
+        sinkTokens: 8,
+        recentWindow: 1024,
+        pinnedPrefixes: ['You are a helpful assistant.'],
+        promptCacheDir: '/cache/prompts',
+        promptCacheBudgetMb: 128,
+        sessionSwapMb: 64,
+        sessionSwapDiskMb: 256,
+        idleTimeoutSeconds: 300,
+        responseCacheEntries: 16,
         useGpu: true,
         verbose: true,
       );
@@ -54,11 +82,31 @@ void main() {
       expect(map['nThreads'], 6);
       expect(map['nGpuLayers'], 16);
       expect(map['contextSize'], 3072);
+      expect(map['initialContextSize'], 512);
       expect(map['batchSize'], 768);
+      expect(map['maxSequences'], 2);
+      expect(map['stepBudget'], 64);
+      expect(map['cacheReuse'], 0);
+      expect(map['sinkTokens'], 8);
+      expect(map['recentWindow'], 1024);
+      expect(map['pinnedPrefixes'], ['You are a helpful assistant.']);
+      expect(map['promptCacheDir'], '/cache/prompts');
+      expect(map['promptCacheBudgetMb'], 128);
+      expect(map['sessionSwapMb'], 64);
+      expect(map['sessionSwapDiskMb'], 256);
+      expect(map['idleTimeoutSeconds'], 300);
+      expect(map['responseCacheEntries'], 16);
       expect(map['useGpu'], true);
       expect(map['verbose'], true);
     });
 
+    test('toMap omits promptCacheDir when unset', () {
+      const config = LlamaConfig(modelPath: '/test/model.gguf');
+
+      expect(config.toMap().containsKey('promptCacheDir'), false);
+      expect(config.toMap()['promptCacheBudgetMb'], 512);
+    });
+
     test('toString returns formatted string', () {
       const config = LlamaConfig(
         modelPath: '/test/model.gguf',
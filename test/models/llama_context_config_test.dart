@@ -0,0 +1,73 @@
+import 'package:flutter_test/flutter_test.dart';
+import 'package:flutter_llama/flutter_llama.dart';
+
+void main() {
+  group('LlamaContextConfig', () {
+    test('has generation defaults', () {
+      const config = LlamaContextConfig();
+
+      expect(config.nThreads, 4);
+      expect(config.contextSize, 2048);
+      expect(config.initialContextSize, 0);
+      expect(config.batchSize, 512);
+      expect(config.maxSequences, 4);
+      expect(config.stepBudget, 128);
+      expect(config.cacheReuse, 32);
+      expect(config.sinkTokens, 4);
+      expect(config.recentWindow, 0);
+      expect(config.pinnedPrefixes, isEmpty);
+      expect(config.promptCacheDir, isNull);
+      expect(config.promptCacheBudgetMb, 512);
+      expect(config.sessionSwapMb, 0);
+      expect(config.sessionSwapDiskMb, 512);
+      expect(config.idleTimeoutSeconds, 0);
+      expect(config.responseCacheEntries, 64);
+      expect(config.embeddings, false);
+    });
+
+    test('toMap converts config to map correctly', () {
+      const config = LlamaContextConfig(
+        nThreads: 2,
+        contextSize: 512,
+        batchSize: 512,
+        embeddings: true,
+      );
+
+      expect(config.toMap(), {
+        'nThreads': 2,
+        'contextSize': 512,
+        'initialContextSize': 0,
+        'batchSize': 512,
+        'maxSequences': 4,
+        'stepBudget': 128,
+        'cacheReuse': 32,
+        'sinkTokens': 4,
+        'recentWindow': 0,
+        'pinnedPrefixes': <String>[],
+        'promptCacheBudgetMb': 512,
+        'sessionSwapMb': 0,
+        'sessionSwapDiskMb': 512,
+        'idleTimeoutSeconds': 0,
+        'responseCacheEntries': 64,
+        'embeddings': true,
+      });
+    });
+
+    test('copyWith changes only given fields', () {
+      const config = LlamaContextConfig(contextSize: 1024);
+
+      final copy = config.copyWith(embeddings: true);
+
+      expect(copy.contextSize, 1024);
+      expect(copy.embeddings, true);
+      expect(copy.nThreads, config.nThreads);
+    });
+
+    test('toString contains all fields', () {
+      const config = LlamaContextConfig(embeddings: true);
+
+      expect(config.toString(), contains('embeddings: true'));
+      expect(config.toString(), contains('contextSize: 2048'));
+    });
+  });
+}
@@ -0,0 +1,41 @@
+import 'package:flutter_test/flutter_test.dart';
+import 'package:flutter_llama/flutter_llama.dart';
+
+void main() {
+  group('PrefillProgress', () {
+    test('fromMap reads prefilled and total', () {
+      final progress = PrefillProgress.fromMap({
+        'type': 'prefillProgress',
+        'prefilled': 512,
+        'total': 2048,
+      });
+
+      expect(progress.prefilled, 512);
+      expect(progress.total, 2048);
+      expect(progress.fraction, 0.25);
+      expect(progress.isComplete, false);
+    });
+
+    test('fromMap handles missing values', () {
+      final progress = PrefillProgress.fromMap({});
+
+      expect(progress.prefilled, 0);
+      expect(progress.total, 0);
+      expect(progress.fraction, 1.0);
+      expect(progress.isComplete, true);
+    });
+
+    test('isComplete when whole prompt is prefilled', () {
+      const progress = PrefillProgress(prefilled: 6000, total: 6000);
+
+      expect(progress.isComplete, true);
+      expect(progress.fraction, 1.0);
+    });
+
+    test('toString returns formatted string', () {
+      const progress = PrefillProgress(prefilled: 10, total: 20);
+
+      expect(progress.toString(), 'PrefillProgress(prefilled: 10, total: 20)');
+    });
+  });
+}